@@ -0,0 +1,483 @@
+// =================
+// bench.naive.c
+// naivefs基准测试：建目录、建文件、大目录里查找、readdir、stat、顺序和随机读写
+// 默认用libnaivefs直接操作镜像；-m指定挂载点时改走系统调用，测内核模块或fuse.naive挂上之后的表现
+// -D和-m一起用时读写测试的文件以O_DIRECT打开，测绕过页缓存的直接I/O
+// 结果以JSON打到标准输出，每项给出ops/s和延迟分位数，方便逐个提交比较；进度打到标准错误
+// 用法：bench.naive [-n files] [-d dirs] [-s MiB] [-b io-bytes] [-r rand-ops]
+//                   [-p passes] [-l label] [-m mountpoint [-D]] image
+// =================
+
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libnaivefs.h"
+
+#define BENCH_ROOT "/nb"          // 所有测试文件都放在这个目录下
+#define BENCH_BIG BENCH_ROOT "/big" // 大目录
+#define BENCH_DATA BENCH_ROOT "/data" // 读写测试用的文件
+#define BENCH_RAND_IO 4096        // 随机读写每次多少字节
+
+// 测试通过的前端：libnaivefs或者挂载点上的系统调用
+// 出错都返回负的errno，open返回的句柄给后面的pread/pwrite用
+struct bench_frontend {
+  const char *name;
+  int (*mkdir)(const char *path);
+  int (*create)(const char *path);
+  int (*stat)(const char *path);
+  int (*readdir)(const char *path); // 返回目录下有几项（不算.和..）
+  int (*open)(const char *path);
+  int (*pread)(int h, void *buf, int size, long long off);
+  int (*pwrite)(int h, const void *buf, int size, long long off);
+  void (*close)(int h);
+  int (*sync)(int h); // h<0时只同步文件系统的元数据
+};
+
+static struct naivefs fs;
+static const char *mountpoint;
+static int direct_io; // 挂载点上的读写测试是否用O_DIRECT
+static char path_buf[4096];
+
+// ============ libnaivefs ============
+
+// 和fuse.naive一样按路径找父目录，再在父目录里建
+static int lib_mknod(const char *path, int mode) {
+  const char *slash = strrchr(path, '/');
+  char parent[4096];
+  int dir_ino, ino;
+  memcpy(parent, path, slash - path);
+  parent[slash - path] = '\0';
+  dir_ino = naivefs_namei(&fs, slash == path ? "/" : parent);
+  if (dir_ino < 0)
+    return dir_ino;
+  ino = naivefs_mknod(&fs, dir_ino, slash + 1, strlen(slash + 1), mode,
+                      getuid(), getgid());
+  return ino < 0 ? ino : 0;
+}
+
+static int lib_mkdir(const char *path) { return lib_mknod(path, S_IFDIR | 0755); }
+
+static int lib_create(const char *path) { return lib_mknod(path, S_IFREG | 0644); }
+
+static int lib_stat(const char *path) {
+  struct naive_inode ninode;
+  int ino = naivefs_namei(&fs, path);
+  if (ino < 0)
+    return ino;
+  return naivefs_read_inode(&fs, ino, &ninode);
+}
+
+static int lib_count(void *ctx, const char *name, int len, long long pos,
+                     int ino, int file_type) {
+  if (!(len == 1 && name[0] == '.') && !(len == 2 && !memcmp(name, "..", 2)))
+    (*(int *)ctx)++;
+  return 0;
+}
+
+static int lib_readdir(const char *path) {
+  struct naive_inode dir;
+  long long pos = 0;
+  int count = 0, err, ino = naivefs_namei(&fs, path);
+  if (ino < 0)
+    return ino;
+  err = naivefs_read_inode(&fs, ino, &dir);
+  if (!err)
+    err = naivefs_readdir(&fs, &dir, &pos, lib_count, &count);
+  return err < 0 ? err : count;
+}
+
+static int lib_open(const char *path) { return naivefs_namei(&fs, path); }
+
+// 每次读写都重新读inode，和fuse.naive按fh里的inode号读写时一样
+static int lib_pread(int h, void *buf, int size, long long off) {
+  struct naive_inode ninode;
+  int err = naivefs_read_inode(&fs, h, &ninode);
+  return err ? err : naivefs_read(&fs, &ninode, buf, size, off);
+}
+
+static int lib_pwrite(int h, const void *buf, int size, long long off) {
+  struct naive_inode ninode;
+  int err = naivefs_read_inode(&fs, h, &ninode);
+  return err ? err : naivefs_write(&fs, &ninode, buf, size, off);
+}
+
+static void lib_close(int h) {}
+
+static int lib_sync(int h) {
+  int err = naivefs_sync(&fs);
+  if (!err && fsync(fs.fd) < 0)
+    err = -errno;
+  return err;
+}
+
+static struct bench_frontend lib_frontend = {
+    "libnaivefs", lib_mkdir, lib_create, lib_stat,  lib_readdir,
+    lib_open,     lib_pread, lib_pwrite, lib_close, lib_sync,
+};
+
+// ============ 挂载点 ============
+
+static const char *mnt_path(const char *path) {
+  snprintf(path_buf, sizeof(path_buf), "%s%s", mountpoint, path);
+  return path_buf;
+}
+
+static int mnt_mkdir(const char *path) {
+  return mkdir(mnt_path(path), 0755) < 0 ? -errno : 0;
+}
+
+static int mnt_create(const char *path) {
+  int fd = open(mnt_path(path), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0)
+    return -errno;
+  close(fd);
+  return 0;
+}
+
+static int mnt_stat(const char *path) {
+  struct stat st;
+  return stat(mnt_path(path), &st) < 0 ? -errno : 0;
+}
+
+static int mnt_readdir(const char *path) {
+  DIR *dir = opendir(mnt_path(path));
+  struct dirent *de;
+  int count = 0;
+  if (dir == NULL)
+    return -errno;
+  while ((de = readdir(dir)) != NULL)
+    if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+      count++;
+  closedir(dir);
+  return count;
+}
+
+static int mnt_open(const char *path) {
+  int fd = open(mnt_path(path), O_RDWR | (direct_io ? O_DIRECT : 0));
+  return fd < 0 ? -errno : fd;
+}
+
+static int mnt_pread(int h, void *buf, int size, long long off) {
+  ssize_t n = pread(h, buf, size, off);
+  return n < 0 ? -errno : n;
+}
+
+static int mnt_pwrite(int h, const void *buf, int size, long long off) {
+  ssize_t n = pwrite(h, buf, size, off);
+  return n < 0 ? -errno : n;
+}
+
+static void mnt_close(int h) { close(h); }
+
+static int mnt_sync(int h) {
+  if (h < 0) {
+    sync();
+    return 0;
+  }
+  return fsync(h) < 0 ? -errno : 0;
+}
+
+static struct bench_frontend mnt_frontend = {
+    "mount",  mnt_mkdir, mnt_create, mnt_stat,  mnt_readdir,
+    mnt_open, mnt_pread, mnt_pwrite, mnt_close, mnt_sync,
+};
+
+// ============ 计时和报告 ============
+
+static struct bench_frontend *fe;
+static long long *lat; // 本项每次操作的耗时（纳秒）
+static int nlat;
+static long long phase_start;
+static int first_result = 1;
+static unsigned long long rand_state = 88172645463325252ull;
+
+static long long now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ll + ts.tv_nsec;
+}
+
+// xorshift64，种子固定，每次跑的随机序列都一样，前后两次提交才好比
+static unsigned long long bench_rand(void) {
+  rand_state ^= rand_state << 13;
+  rand_state ^= rand_state >> 7;
+  rand_state ^= rand_state << 17;
+  return rand_state;
+}
+
+static int cmp_ll(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static void phase_begin(const char *name) {
+  fprintf(stderr, "[bench_naive] %s...\n", name);
+  nlat = 0;
+  phase_start = now_ns();
+}
+
+// 记一次操作，出错就没必要往下测了
+static void record(const char *name, long long start, int res) {
+  if (res < 0) {
+    fprintf(stderr, "[bench_naive] %s failed: %s.\n", name, strerror(-res));
+    exit(1);
+  }
+  lat[nlat++] = now_ns() - start;
+}
+
+static double pct_us(double p) {
+  int i = (int)(p * (nlat - 1) + 0.5);
+  return lat[i] / 1e3;
+}
+
+// 一项结束：总耗时从phase_begin算起（包括最后的sync），延迟分位数只看单次操作
+static void phase_end(const char *name, int items, long long bytes) {
+  double secs = (now_ns() - phase_start) / 1e9;
+  qsort(lat, nlat, sizeof(long long), cmp_ll);
+  printf("%s\n    {\"name\": \"%s\", \"ops\": %d, \"items_per_op\": %d, "
+         "\"bytes_per_op\": %lld, \"seconds\": %.6f, \"ops_per_sec\": %.1f, "
+         "\"mib_per_sec\": %.2f, \"p50_us\": %.2f, \"p90_us\": %.2f, "
+         "\"p99_us\": %.2f, \"max_us\": %.2f}",
+         first_result ? "" : ",", name, nlat, items, bytes, secs,
+         nlat / secs, bytes * nlat / secs / (1 << 20), pct_us(0.5),
+         pct_us(0.9), pct_us(0.99), lat[nlat - 1] / 1e3);
+  first_result = 0;
+}
+
+// ============ 测试项 ============
+
+static void bench_mkdir(int dirs) {
+  char name[64];
+  long long t;
+  int i;
+  phase_begin("mkdir");
+  for (i = 0; i < dirs; i++) {
+    snprintf(name, sizeof(name), BENCH_ROOT "/d%07d", i);
+    t = now_ns();
+    record("mkdir", t, fe->mkdir(name));
+  }
+  fe->sync(-1);
+  phase_end("mkdir", 1, 0);
+}
+
+static void bench_create(int files) {
+  char name[64];
+  long long t;
+  int i;
+  phase_begin("create");
+  for (i = 0; i < files; i++) {
+    snprintf(name, sizeof(name), BENCH_BIG "/f%07d", i);
+    t = now_ns();
+    record("create", t, fe->create(name));
+  }
+  fe->sync(-1);
+  phase_end("create", 1, 0);
+}
+
+// 在大目录里随机查找，miss为真时找的都是不存在的名字
+static void bench_lookup(int files, int miss) {
+  const char *phase = miss ? "lookup_miss" : "lookup";
+  char name[64];
+  long long t;
+  int i, res;
+  phase_begin(phase);
+  for (i = 0; i < files; i++) {
+    snprintf(name, sizeof(name), BENCH_BIG "/%c%07d", miss ? 'x' : 'f',
+             (int)(bench_rand() % files));
+    t = now_ns();
+    res = fe->stat(name);
+    if (miss && res == -ENOENT)
+      res = 0;
+    else if (miss && res == 0)
+      res = -EEXIST;
+    record(phase, t, res);
+  }
+  phase_end(phase, 1, 0);
+}
+
+// 按创建顺序把每个文件stat一遍，相当于ls -l
+static void bench_stat(int files) {
+  char name[64];
+  long long t;
+  int i;
+  phase_begin("stat");
+  for (i = 0; i < files; i++) {
+    snprintf(name, sizeof(name), BENCH_BIG "/f%07d", i);
+    t = now_ns();
+    record("stat", t, fe->stat(name));
+  }
+  phase_end("stat", 1, 0);
+}
+
+static void bench_readdir(int files, int passes) {
+  long long t;
+  int i, res;
+  phase_begin("readdir");
+  for (i = 0; i < passes; i++) {
+    t = now_ns();
+    res = fe->readdir(BENCH_BIG);
+    if (res >= 0 && res != files)
+      res = -EIO;
+    record("readdir", t, res < 0 ? res : 0);
+  }
+  phase_end("readdir", files, 0);
+}
+
+// 顺序或随机读写，写完都sync一次，算在总耗时里
+static void bench_io(const char *phase, int h, char *buf, int io_size,
+                     long long size, int ops, int write, int random) {
+  long long t, off = 0;
+  int i, res;
+  phase_begin(phase);
+  for (i = 0; i < ops; i++) {
+    if (random)
+      off = bench_rand() % (size / io_size) * io_size;
+    t = now_ns();
+    res = write ? fe->pwrite(h, buf, io_size, off)
+                : fe->pread(h, buf, io_size, off);
+    record(phase, t, res == io_size ? 0 : (res < 0 ? res : -EIO));
+    off += io_size;
+  }
+  if (write)
+    fe->sync(h);
+  phase_end(phase, 1, io_size);
+}
+
+int main(int argc, char *const argv[]) {
+  int files = 10000, dirs = 500, io_size = 65536, rand_ops = 4096;
+  int passes = 20, buf_size, opt, h, err;
+  long long size = 32ll << 20, max_ops;
+  const char *label = "";
+  char *buf;
+
+  while ((opt = getopt(argc, argv, "n:d:s:b:r:p:l:m:D")) != -1) {
+    switch (opt) {
+    case 'n':
+      files = atoi(optarg);
+      break;
+    case 'd':
+      dirs = atoi(optarg);
+      break;
+    case 's':
+      size = atoll(optarg) << 20;
+      break;
+    case 'b':
+      io_size = atoi(optarg);
+      break;
+    case 'r':
+      rand_ops = atoi(optarg);
+      break;
+    case 'p':
+      passes = atoi(optarg);
+      break;
+    case 'l':
+      label = optarg;
+      break;
+    case 'm':
+      mountpoint = optarg;
+      break;
+    case 'D':
+      direct_io = 1;
+      break;
+    default:
+      fprintf(stderr,
+              "[bench_naive] Usage: %s [-n files] [-d dirs] [-s MiB] "
+              "[-b io-bytes] [-r rand-ops] [-p passes] [-l label] "
+              "[-m mountpoint [-D]] image\n",
+              argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1 && mountpoint == NULL) {
+    fprintf(stderr, "[bench_naive] No image specified.\n");
+    return 1;
+  }
+  if (files <= 0 || dirs <= 0 || io_size <= 0 || size < io_size ||
+      size % io_size != 0 || size % BENCH_RAND_IO != 0 || passes <= 0 ||
+      (direct_io && (mountpoint == NULL || io_size % 4096 != 0))) {
+    fprintf(stderr, "[bench_naive] Bad parameters.\n");
+    return 1;
+  }
+
+  if (mountpoint != NULL) {
+    fe = &mnt_frontend;
+  } else {
+    fe = &lib_frontend;
+    err = naivefs_open(&fs, argv[optind], 1);
+    if (err) {
+      fprintf(stderr, "[bench_naive] Cannot open %s: %s.\n", argv[optind],
+              strerror(-err));
+      return 1;
+    }
+  }
+  // 延迟数组按操作次数最多的那一项分配
+  max_ops = size / io_size;
+  if (max_ops < files)
+    max_ops = files;
+  if (max_ops < dirs)
+    max_ops = dirs;
+  if (max_ops < rand_ops)
+    max_ops = rand_ops;
+  if (max_ops < passes)
+    max_ops = passes;
+  buf_size = io_size > BENCH_RAND_IO ? io_size : BENCH_RAND_IO;
+  lat = malloc(sizeof(long long) * max_ops);
+  // O_DIRECT要求缓冲区按块对齐，统一按页对齐分配
+  if (posix_memalign((void **)&buf, 4096, buf_size) != 0)
+    buf = NULL;
+  if (lat == NULL || buf == NULL) {
+    fprintf(stderr, "[bench_naive] Out of memory.\n");
+    return 1;
+  }
+  memset(buf, 0x5a, buf_size);
+
+  err = fe->mkdir(BENCH_ROOT);
+  if (!err)
+    err = fe->mkdir(BENCH_BIG);
+  if (err) {
+    fprintf(stderr, "[bench_naive] Cannot create %s: %s. Use a fresh image.\n",
+            BENCH_BIG, strerror(-err));
+    return 1;
+  }
+
+  printf("{\n  \"label\": \"%s\",\n  \"frontend\": \"%s\",\n  \"target\": "
+         "\"%s\",\n  \"files\": %d,\n  \"results\": [",
+         label, direct_io ? "mount-direct" : fe->name,
+         mountpoint != NULL ? mountpoint : argv[optind], files);
+  bench_mkdir(dirs);
+  bench_create(files);
+  bench_lookup(files, 0);
+  bench_lookup(files, 1);
+  bench_stat(files);
+  bench_readdir(files, passes);
+
+  h = fe->create(BENCH_DATA);
+  if (!h)
+    h = fe->open(BENCH_DATA);
+  if (h < 0) {
+    fprintf(stderr, "[bench_naive] Cannot create %s: %s.\n", BENCH_DATA,
+            strerror(-h));
+    return 1;
+  }
+  bench_io("seq_write", h, buf, io_size, size, size / io_size, 1, 0);
+  bench_io("seq_read", h, buf, io_size, size, size / io_size, 0, 0);
+  bench_io("rand_write", h, buf, BENCH_RAND_IO, size, rand_ops, 1, 1);
+  bench_io("rand_read", h, buf, BENCH_RAND_IO, size, rand_ops, 0, 1);
+  fe->close(h);
+  printf("\n  ]\n}\n");
+
+  if (mountpoint == NULL && (err = naivefs_close(&fs)) != 0) {
+    fprintf(stderr, "[bench_naive] Closing image failed: %s.\n", strerror(-err));
+    return 1;
+  }
+  return 0;
+}
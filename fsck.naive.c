@@ -0,0 +1,787 @@
+// =================
+// fsck.naive.c
+// naivefs一致性检查和修复工具
+// 把镜像整个mmap进来，从根目录出发遍历目录树、从inode表收集extent，重新算出两张位图，再和盘上的比对
+// 目录树和inode表都分给多个线程扫，大镜像的检查速度取决于读盘而不是CPU
+// =================
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "naivefs.h"
+
+// 退出码，和e2fsck一样
+#define FSCK_OK 0
+#define FSCK_FIXED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+static _Byte *image;                   // 整个镜像
+static long long image_size;
+static struct naive_super_block *nsb;  // 指向镜像里的超级块
+static int block_size;                 // 块大小，从超级块取
+static int dir_size;                   // 目录块里目录项能用的字节数，带校验和时块尾是假目录项
+static int has_csum;                   // 元数据带校验和
+static int has_chain;                  // 间接extent块可以串成链，extent表不排序
+static _Byte *bmap;                    // 重新算出来的块位图
+static _Byte *imap;                    // 重新算出来的inode位图（即目录树能走到的inode）
+static int repair = 0;                 // -y：发现问题就修
+static int verbose = 0;                // -v：逐条报告
+static int nthreads = 0;               // -j：线程数
+static int errors_found = 0;           // 发现的问题
+static int errors_fixed = 0;           // 修好的问题
+
+// 目录遍历的工作队列：待扫描的目录inode号，外加正在被扫描的个数，两者都为0时遍历结束
+static int *dir_queue;
+static int dir_queue_len = 0;
+static int dir_active = 0;
+static pthread_mutex_t dir_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dir_cond = PTHREAD_COND_INITIALIZER;
+
+// 报告一个问题，fixed表示这个问题已经修好
+static void problem(int fixed, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+static void problem(int fixed, const char *fmt, ...) {
+  __atomic_add_fetch(&errors_found, 1, __ATOMIC_RELAXED);
+  if (fixed)
+    __atomic_add_fetch(&errors_fixed, 1, __ATOMIC_RELAXED);
+  if (verbose) {
+    va_list ap;
+    char msg[512];
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    printf("[fsck_naive] %s%s\n", msg, fixed ? " (fixed)" : "");
+  }
+}
+
+// 原子地把位图的某位置1，返回原来的值；多个线程可能同时改同一字节
+static int test_and_set(_Byte *map, int nr) {
+  _Byte mask = 1 << (nr % 8);
+  return __atomic_fetch_or(&map[nr / 8], mask, __ATOMIC_RELAXED) & mask;
+}
+
+static int test_bit(const _Byte *map, int nr) { return map[nr / 8] >> (nr % 8) & 1; }
+
+static _Byte *block_at(int block_no) {
+  return image + (long long)block_no * block_size;
+}
+
+// 分了块组的话，每个块组开头的位图和inode表也不是数据块
+static int data_block_ok(int block_no) {
+  if (block_no < nsb->data_block_no || block_no >= nsb->block_total)
+    return 0;
+  return nsb->group_blocks == 0 ||
+         (block_no - nsb->bmap_block_no) % nsb->group_blocks >=
+             nsb->data_block_no - nsb->bmap_block_no;
+}
+
+// inode表的每块紧凑地放着NAIVE_INODES_PER_BLOCK个inode
+static struct naive_inode *inode_at(int ino) {
+  int per_block = NAIVE_INODES_PER_BLOCK(block_size);
+  return (struct naive_inode *)(block_at(naive_inode_block(nsb, ino)) +
+                                ino % per_block * NAIVE_INODE_SIZE);
+}
+
+// 从头顺序走extent表时取第i项，i必须从0起逐个加1，*eblock是当前走到的间接extent块，块号在*eblock_no里
+// 链上的块不合法（链断了、指到数据区外）时返回NULL
+static struct naive_extent *extent_next(struct naive_inode *ninode, int i,
+                                        _Byte **eblock, int *eblock_no) {
+  int per = NAIVE_EXTENTS_PER_BLOCK(block_size), k = i - NAIVE_INLINE_EXTENTS;
+  if (i < NAIVE_INLINE_EXTENTS)
+    return &ninode->extents[i];
+  if (k % per == 0) {
+    *eblock_no = k == 0 ? ninode->extent_block
+                        : NAIVE_EXTENT_NEXT(*eblock, block_size);
+    if (!data_block_ok(*eblock_no))
+      return NULL;
+    *eblock = block_at(*eblock_no);
+  }
+  return (struct naive_extent *)*eblock + k % per;
+}
+
+// extent表最多看几项，老镜像的表有上限，超了的部分不可信
+static int extent_limit(struct naive_inode *ninode) {
+  if (!has_chain && ninode->extent_count > NAIVE_MAX_EXTENTS(block_size))
+    return NAIVE_MAX_EXTENTS(block_size);
+  return ninode->extent_count;
+}
+
+static int extent_cmp(const void *a, const void *b) {
+  const struct naive_extent *x = a, *y = b;
+  return x->file_block < y->file_block ? -1 : x->file_block > y->file_block;
+}
+
+// 把文件内的逻辑块号映射为物理块号，没有映射或映射到数据区外时返回0
+static int map_block(struct naive_inode *ninode, int file_block) {
+  _Byte *eblock = NULL;
+  int i, eblock_no;
+  for (i = 0; i < extent_limit(ninode); i++) {
+    struct naive_extent *ext = extent_next(ninode, i, &eblock, &eblock_no);
+    if (ext == NULL || (!has_chain && file_block < ext->file_block))
+      break;
+    if (file_block < ext->file_block)
+      continue;
+    if (file_block < ext->file_block + ext->len) {
+      int block_no = ext->start + (file_block - ext->file_block);
+      return data_block_ok(block_no) ? block_no : 0;
+    }
+  }
+  return 0;
+}
+
+static int inode_ok(int ino) {
+  struct naive_inode *ninode;
+  if (ino < 0 || ino >= nsb->inode_total)
+    return 0;
+  ninode = inode_at(ino);
+  return (S_ISDIR(ninode->mode) || S_ISREG(ninode->mode)) &&
+         ninode->i_ino == ino;
+}
+
+// 带校验和时inode的校验和，修复时改过inode要重算
+static void check_inode_csum(int ino) {
+  struct naive_inode *ninode = inode_at(ino);
+  if (!has_csum || ninode->checksum == naive_inode_csum(ninode))
+    return;
+  problem(repair, "Inode %d: checksum mismatch.", ino);
+}
+
+static void fix_inode_csum(int ino) {
+  struct naive_inode *ninode = inode_at(ino);
+  unsigned short csum;
+  if (!repair || !has_csum)
+    return;
+  csum = naive_inode_csum(ninode);
+  if (ninode->checksum != csum)
+    ninode->checksum = csum;
+}
+
+// 目录块、位图块的块尾校验和；只在不一样时才写，免得修复时把没问题的页也弄脏
+static int block_csum_ok(int block_no) {
+  return *naive_block_csum_at(block_at(block_no), block_size) ==
+         naive_block_csum(block_no, block_at(block_no), block_size);
+}
+
+static void fix_block_csum(int block_no) {
+  unsigned int csum = naive_block_csum(block_no, block_at(block_no), block_size);
+  if (*naive_block_csum_at(block_at(block_no), block_size) != csum)
+    *naive_block_csum_at(block_at(block_no), block_size) = csum;
+}
+
+// 目录块的假目录项和校验和
+static int dir_tail_ok(int block_no) {
+  struct naive_dir_tail *tail =
+      (struct naive_dir_tail *)(block_at(block_no) + dir_size);
+  return tail->i_ino == 0 && tail->rec_len == NAIVE_DIR_TAIL_SIZE &&
+         tail->name_len == 0 && tail->file_type == NAIVE_FT_CSUM &&
+         block_csum_ok(block_no);
+}
+
+static void fix_dir_tail(int block_no) {
+  struct naive_dir_tail *tail =
+      (struct naive_dir_tail *)(block_at(block_no) + dir_size);
+  if (tail->rec_len != NAIVE_DIR_TAIL_SIZE || tail->file_type != NAIVE_FT_CSUM ||
+      tail->i_ino != 0 || tail->name_len != 0) {
+    tail->i_ino = 0;
+    tail->rec_len = NAIVE_DIR_TAIL_SIZE;
+    tail->name_len = 0;
+    tail->file_type = NAIVE_FT_CSUM;
+  }
+  fix_block_csum(block_no);
+}
+
+static int rec_ok(struct naive_dir_record *rec, int off, int size) {
+  return rec->rec_len >= NAIVE_DIR_REC_LEN(0) && rec->rec_len % 4 == 0 &&
+         off + rec->rec_len <= size &&
+         NAIVE_DIR_REC_LEN(rec->name_len) <= rec->rec_len;
+}
+
+static void dir_push(int ino) {
+  pthread_mutex_lock(&dir_lock);
+  dir_queue[dir_queue_len++] = ino;
+  pthread_cond_signal(&dir_cond);
+  pthread_mutex_unlock(&dir_lock);
+}
+
+// 检查目录ino的每条目录项，把走到的inode记进imap，子目录放进队列
+// 每个目录只会被一个线程扫描（imap置位时就排好了队），所以改它的目录块和inode不用加锁
+static void check_dir(int ino) {
+  struct naive_inode *dir = inode_at(ino);
+  int lblock, off, count = 0;
+  // 内联目录当成只有一块、大小为NAIVE_INLINE_DATA_LEN的目录
+  int is_inline = dir->flags & NAIVE_INODE_FLAG_INLINE;
+  int blocks = is_inline ? 1 : dir->block_count;
+  int size = is_inline ? NAIVE_INLINE_DATA_LEN : dir_size;
+
+  // 下面修复时会改目录的inode，先校验
+  check_inode_csum(ino);
+  for (lblock = 0; lblock < blocks; lblock++) {
+    int block_no = is_inline ? 0 : map_block(dir, lblock);
+    _Byte *block;
+    struct naive_dir_record *rec;
+    if (!is_inline && block_no == 0) {
+      problem(0, "Directory %d: block %d is not mapped.", ino, lblock);
+      continue;
+    }
+    block = is_inline ? (_Byte *)dir->inline_data : block_at(block_no);
+    if (!is_inline && has_csum && !dir_tail_ok(block_no))
+      problem(repair, "Directory %d: block %d checksum mismatch.", ino, lblock);
+    for (off = 0; off < size; off += rec->rec_len) {
+      int child;
+      rec = (struct naive_dir_record *)(block + off);
+      if (!rec_ok(rec, off, size)) {
+        // 链断了，剩下的部分改成一条空目录项
+        if (repair) {
+          rec->rec_len = size - off;
+          rec->name_len = 0;
+          rec->i_ino = 0;
+        }
+        problem(repair, "Directory %d: corrupt entry at block %d offset %d.",
+                ino, lblock, off);
+        break;
+      }
+      if (rec->name_len == 0)
+        continue;
+      child = rec->i_ino;
+      if ((rec->name_len == 1 && rec->filename[0] == '.') ||
+          (rec->name_len == 2 && memcmp(rec->filename, "..", 2) == 0)) {
+        // .和..只算数，不往下走
+        if (rec->name_len == 1 && child != ino) {
+          if (repair)
+            rec->i_ino = ino;
+          problem(repair, "Directory %d: '.' points to %d.", ino, child);
+        }
+        count++;
+        continue;
+      }
+      if (!inode_ok(child)) {
+        problem(repair, "Directory %d: entry '%.*s' points to bad inode %d.",
+                ino, rec->name_len, rec->filename, child);
+        if (repair)
+          rec->name_len = 0;
+        else
+          count++;
+        continue;
+      }
+      if (test_and_set(imap, child) && S_ISDIR(inode_at(child)->mode)) {
+        // 目录只能有一个父目录，否则遍历会绕圈
+        problem(repair, "Directory %d: directory %d is linked more than once.",
+                ino, child);
+        if (repair)
+          rec->name_len = 0;
+        else
+          count++;
+        continue;
+      }
+      unsigned char type =
+          S_ISDIR(inode_at(child)->mode) ? NAIVE_FT_DIR : NAIVE_FT_REG_FILE;
+      if (rec->file_type != type) {
+        if (repair)
+          rec->file_type = type;
+        problem(repair, "Directory %d: wrong file type for '%.*s'.", ino,
+                rec->name_len, rec->filename);
+      }
+      count++;
+      if (type == NAIVE_FT_DIR)
+        dir_push(child);
+    }
+    // 不管是校验和本身坏了还是上面修过目录项，都按现在的内容重算
+    if (!is_inline && has_csum && repair)
+      fix_dir_tail(block_no);
+  }
+
+  if (count != dir->dir_children_count) {
+    problem(repair, "Directory %d: has %d entries, inode says %d.", ino, count,
+            dir->dir_children_count);
+    if (repair)
+      dir->dir_children_count = count;
+  }
+}
+
+static void *dir_worker(void *arg) {
+  pthread_mutex_lock(&dir_lock);
+  for (;;) {
+    while (dir_queue_len == 0 && dir_active > 0)
+      pthread_cond_wait(&dir_cond, &dir_lock);
+    if (dir_queue_len == 0)
+      break;
+    int ino = dir_queue[--dir_queue_len];
+    dir_active++;
+    pthread_mutex_unlock(&dir_lock);
+    check_dir(ino);
+    pthread_mutex_lock(&dir_lock);
+    dir_active--;
+    if (dir_queue_len == 0 && dir_active == 0)
+      pthread_cond_broadcast(&dir_cond);
+  }
+  pthread_mutex_unlock(&dir_lock);
+  return NULL;
+}
+
+// 把目录树能走到的inode的块记进bmap，检查extent表本身是否合理
+static void check_inode(int ino) {
+  struct naive_inode *ninode = inode_at(ino);
+  struct naive_extent *sorted = NULL;
+  _Byte *eblock = NULL;
+  int i, j, blocks = 0, prev_end = 0, nsorted = 0, eblock_no = 0;
+
+  // 目录的校验和在check_dir里已经查过了
+  if (!S_ISDIR(ninode->mode))
+    check_inode_csum(ino);
+
+  // 内联inode的extent区放的是数据，不占块
+  if (ninode->flags & NAIVE_INODE_FLAG_INLINE) {
+    if (ninode->extent_count != 0 || ninode->block_count != 0)
+      problem(0, "Inode %d: inline inode maps %d extents, %d blocks.", ino,
+              ninode->extent_count, ninode->block_count);
+    if (S_ISREG(ninode->mode) && ninode->file_size > NAIVE_INLINE_DATA_LEN) {
+      problem(repair, "Inode %d: inline file size %lld is too large.", ino,
+              ninode->file_size);
+      if (repair)
+        ninode->file_size = NAIVE_INLINE_DATA_LEN;
+    }
+    return;
+  }
+  if (ninode->extent_count < 0 || extent_limit(ninode) != ninode->extent_count) {
+    problem(0, "Inode %d: bad extent count %d.", ino, ninode->extent_count);
+    return;
+  }
+  // 链式的表不排序，另外拷一份排好序再查有没有重叠
+  if (has_chain && ninode->extent_count > 1 &&
+      (sorted = malloc(ninode->extent_count * sizeof(*sorted))) == NULL) {
+    problem(0, "Inode %d: out of memory.", ino);
+    return;
+  }
+  for (i = 0; i < ninode->extent_count; i++) {
+    struct naive_extent *ext = extent_next(ninode, i, &eblock, &eblock_no);
+    if (ext == NULL) {
+      problem(0, "Inode %d: bad extent block %d.", ino, eblock_no);
+      break;
+    }
+    if (i >= NAIVE_INLINE_EXTENTS &&
+        (i - NAIVE_INLINE_EXTENTS) % NAIVE_EXTENTS_PER_BLOCK(block_size) == 0 &&
+        test_and_set(bmap, eblock_no))
+      problem(0, "Inode %d: extent block %d is shared.", ino, eblock_no);
+    if ((!has_chain && ext->file_block < prev_end) || ext->len <= 0 ||
+        !data_block_ok(ext->start) || !data_block_ok(ext->start + ext->len - 1)) {
+      problem(0, "Inode %d: bad extent %d (%d, %d, %d).", ino, i,
+              ext->file_block, ext->start, ext->len);
+      continue;
+    }
+    prev_end = ext->file_block + ext->len;
+    if (sorted != NULL)
+      sorted[nsorted++] = *ext;
+    blocks += ext->len;
+    for (j = 0; j < ext->len; j++)
+      if (test_and_set(bmap, ext->start + j))
+        problem(0, "Inode %d: block %d is claimed more than once.", ino,
+                ext->start + j);
+  }
+  if (sorted != NULL) {
+    qsort(sorted, nsorted, sizeof(*sorted), extent_cmp);
+    for (i = 1; i < nsorted; i++)
+      if (sorted[i].file_block < sorted[i - 1].file_block + sorted[i - 1].len)
+        problem(0, "Inode %d: extents overlap at file block %d.", ino,
+                sorted[i].file_block);
+    free(sorted);
+  }
+  if (blocks != ninode->block_count) {
+    problem(repair, "Inode %d: maps %d blocks, inode says %d.", ino, blocks,
+            ninode->block_count);
+    if (repair)
+      ninode->block_count = blocks;
+  }
+}
+
+// inode表按线程数切成几段，各扫各的
+struct inode_range {
+  int from, to;
+};
+
+static void *inode_worker(void *arg) {
+  struct inode_range *range = arg;
+  int ino;
+  for (ino = range->from; ino < range->to; ino++)
+    if (test_bit(imap, ino)) {
+      check_inode(ino);
+      fix_inode_csum(ino);
+    }
+  return NULL;
+}
+
+static int run_threads(void *(*fn)(void *), void *args, size_t arg_size) {
+  pthread_t *tids = calloc(nthreads, sizeof(pthread_t));
+  int i;
+  if (tids == NULL)
+    return -1;
+  for (i = 0; i < nthreads; i++)
+    if (pthread_create(&tids[i], NULL, fn, (char *)args + i * arg_size) != 0)
+      return -1;
+  for (i = 0; i < nthreads; i++)
+    pthread_join(tids[i], NULL);
+  free(tids);
+  return 0;
+}
+
+// 拿算出来的位图和盘上的比，calc按编号平铺，盘上的位图第i块在disk_block(i)处，
+// 管理从first + i * bits开始的bits个编号；每块bits之后的位和total之后的位（填充）应该都是1，
+// 带校验和时块尾4字节不是位；返回两者不一致的位数，修复时把算出来的逐块写回去
+static int compare_bitmap(const char *name, _Byte *calc, int total, int first,
+                          int bits,
+                          int (*disk_block)(const struct naive_super_block *,
+                                            int),
+                          int blocks) {
+  int i, k, leaked = 0, lost = 0;
+  int map_bits = has_csum ? NAIVE_GROUP_MAX(block_size)
+                          : NAIVE_BITS_PER_BLOCK(block_size);
+  for (i = 0; i < blocks; i++) {
+    _Byte *disk = block_at(disk_block(nsb, i));
+    int bad_csum = has_csum && !block_csum_ok(disk_block(nsb, i));
+    if (bad_csum)
+      problem(repair, "%s block %d: checksum mismatch.", name, i);
+    for (k = 0; k < map_bits; k++) {
+      int nr = first + i * bits + k;
+      int want = k >= bits || nr >= total || test_bit(calc, nr);
+      if (test_bit(disk, k) == want)
+        continue;
+      if (want)
+        lost++; // 盘上空着，其实有人在用，再分配就会覆盖数据
+      else
+        leaked++; // 盘上占着，其实没人用，浪费但无害
+      if (verbose > 1)
+        printf("[fsck_naive] %s block %d bit %d should be %d.\n", name, i, k,
+               want);
+      if (repair)
+        disk[k / 8] ^= 1 << (k % 8);
+    }
+    if (has_csum && repair)
+      fix_block_csum(disk_block(nsb, i));
+  }
+  if (leaked + lost == 0)
+    return 0;
+  printf("[fsck_naive] %s: %d marked used but unreferenced, %d in use but "
+         "marked free.%s\n",
+         name, leaked, lost, repair ? " Fixed." : "");
+  errors_found++;
+  if (repair)
+    errors_fixed++;
+  return leaked + lost;
+}
+
+static double elapsed_ms(struct timespec *from) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - from->tv_sec) * 1e3 +
+         (now.tv_nsec - from->tv_nsec) / 1e6;
+}
+
+// 分了块组的布局：日志区之后是一个个块组，每组开头依次是块位图、inode位图、inode表
+static int check_group_super(long long need) {
+  int super_end = (NAIVE_SUPER_BLOCK_OFFSET + NAIVE_SUPER_BLOCK_SIZE +
+                   block_size - 1) / block_size;
+  int per_block = NAIVE_INODES_PER_BLOCK(block_size);
+  int max = has_csum ? NAIVE_GROUP_MAX(block_size)
+                     : NAIVE_BITS_PER_BLOCK(block_size);
+  int groups, meta;
+  if (nsb->group_blocks <= 0 || nsb->group_blocks > max ||
+      nsb->group_inodes <= 0 || nsb->group_inodes > max ||
+      nsb->group_inodes % per_block != 0) {
+    printf("[fsck_naive] Bad block group geometry.\n");
+    return -1;
+  }
+  meta = 2 + nsb->group_inodes / per_block;
+  groups = (nsb->block_total - nsb->bmap_block_no + nsb->group_blocks - 1) /
+           nsb->group_blocks;
+  if (nsb->block_total <= 0 || need > image_size ||
+      (nsb->journal_blocks != 0 &&
+       (nsb->journal_blocks < NAIVE_JOURNAL_MIN_BLOCKS ||
+        nsb->journal_block_no != super_end)) ||
+      nsb->bmap_block_no != super_end + nsb->journal_blocks ||
+      nsb->bmap_block_no >= nsb->block_total || groups <= 0 ||
+      nsb->bmap_blocks != groups || nsb->imap_blocks != groups ||
+      nsb->inode_total != groups * nsb->group_inodes ||
+      nsb->imap_block_no != nsb->bmap_block_no + 1 ||
+      nsb->inode_table_block_no != nsb->bmap_block_no + 2 ||
+      nsb->data_block_no != nsb->bmap_block_no + meta ||
+      nsb->block_total - naive_bmap_block(nsb, groups - 1) <= meta) {
+    printf("[fsck_naive] Superblock layout is inconsistent.\n");
+    return -1;
+  }
+  return 0;
+}
+
+// 超级块里的布局要自洽，否则后面的指针运算都会越界
+static int check_super(void) {
+  long long need;
+  if (nsb->magic != NAIVE_MAGIC) {
+    printf("[fsck_naive] Bad magic number, not a naivefs image.\n");
+    return -1;
+  }
+  if (block_size < NAIVE_MIN_BLOCK_SIZE || block_size > NAIVE_MAX_BLOCK_SIZE ||
+      (block_size & (block_size - 1)) != 0) {
+    printf("[fsck_naive] Bad block size %d.\n", block_size);
+    return -1;
+  }
+  if (nsb->features & ~NAIVE_FEATURES_SUPPORTED) {
+    printf("[fsck_naive] Unknown features 0x%x.\n",
+           nsb->features & ~NAIVE_FEATURES_SUPPORTED);
+    return -1;
+  }
+  has_csum = nsb->features & NAIVE_FEATURE_CSUM;
+  has_chain = nsb->features & NAIVE_FEATURE_EXTENT_CHAIN;
+  dir_size = naive_dir_block_size(nsb);
+  // 超级块的校验和坏了，只要下面的布局自洽就重算；布局不自洽的话修了也没用
+  if (has_csum && nsb->checksum != naive_super_csum(nsb)) {
+    problem(repair, "Superblock checksum mismatch.");
+    if (repair)
+      nsb->checksum = naive_super_csum(nsb);
+  }
+  need = (long long)nsb->block_total * block_size;
+  if (has_csum && nsb->group_blocks == 0) {
+    printf("[fsck_naive] Checksums without block groups.\n");
+    return -1;
+  }
+  if (nsb->group_blocks != 0)
+    return check_group_super(need);
+  if (nsb->block_total <= 0 || need > image_size || nsb->inode_total <= 0 ||
+      nsb->bmap_block_no != (NAIVE_SUPER_BLOCK_OFFSET + NAIVE_SUPER_BLOCK_SIZE +
+                             block_size - 1) / block_size ||
+      nsb->bmap_blocks * NAIVE_BITS_PER_BLOCK(block_size) < nsb->block_total ||
+      nsb->imap_block_no != nsb->bmap_block_no + nsb->bmap_blocks ||
+      nsb->imap_blocks * NAIVE_BITS_PER_BLOCK(block_size) < nsb->inode_total ||
+      (nsb->journal_blocks != 0 &&
+       (nsb->journal_blocks < NAIVE_JOURNAL_MIN_BLOCKS ||
+        nsb->journal_block_no != nsb->imap_block_no + nsb->imap_blocks)) ||
+      nsb->inode_table_block_no !=
+          nsb->imap_block_no + nsb->imap_blocks + nsb->journal_blocks ||
+      nsb->data_block_no !=
+          nsb->inode_table_block_no +
+              (nsb->inode_total + NAIVE_INODES_PER_BLOCK(block_size) - 1) /
+                  NAIVE_INODES_PER_BLOCK(block_size) ||
+      nsb->data_block_no >= nsb->block_total) {
+    printf("[fsck_naive] Superblock layout is inconsistent.\n");
+    return -1;
+  }
+  return 0;
+}
+
+// 内核没有干净卸载时，日志里可能还有已提交的事务，先像挂载时那样恢复，再检查恢复后的样子
+// 只检查时恢复只发生在私有映射里，不会写盘
+static void replay_journal(void) {
+  struct naive_journal_header *jh;
+  struct naive_journal_block *desc, *commit;
+  int start = nsb->journal_block_no, blocks = nsb->journal_blocks;
+  int max = NAIVE_JOURNAL_TAGS(block_size) < blocks - 3
+                ? NAIVE_JOURNAL_TAGS(block_size)
+                : blocks - 3;
+  int pos = 1, replayed = 0, i;
+
+  if (blocks == 0)
+    return;
+  jh = (struct naive_journal_header *)block_at(start);
+  if (jh->magic != NAIVE_JOURNAL_MAGIC) {
+    // 日志头坏了，没法知道哪些事务有效，只能清空日志
+    if (repair) {
+      memset(jh, 0, block_size);
+      jh->magic = NAIVE_JOURNAL_MAGIC;
+      memset(block_at(start + 1), 0, block_size);
+    }
+    problem(repair, "Journal header is corrupt, journal reset");
+    return;
+  }
+
+  for (;;) {
+    desc = (struct naive_journal_block *)block_at(start + pos);
+    if (desc->magic != NAIVE_JOURNAL_MAGIC || desc->type != NAIVE_JOURNAL_DESC ||
+        desc->sequence != jh->sequence || desc->count <= 0 ||
+        desc->count > max || pos + desc->count + 1 >= blocks)
+      break;
+    for (i = 0; i < desc->count; i++)
+      if (desc->blocks[i] < nsb->bmap_block_no ||
+          desc->blocks[i] >= nsb->block_total ||
+          (desc->blocks[i] >= start && desc->blocks[i] < start + blocks))
+        break;
+    if (i < desc->count)
+      break;
+    commit = (struct naive_journal_block *)block_at(start + pos + desc->count + 1);
+    if (commit->magic != NAIVE_JOURNAL_MAGIC ||
+        commit->type != NAIVE_JOURNAL_COMMIT ||
+        commit->sequence != desc->sequence || commit->count != desc->count)
+      break;
+    for (i = 0; i < desc->count; i++)
+      memcpy(block_at(desc->blocks[i]), block_at(start + pos + 1 + i),
+             block_size);
+    pos += desc->count + 2;
+    jh->sequence++;
+    replayed++;
+  }
+  if (replayed == 0)
+    return;
+  printf("[fsck_naive] Journal: %s %d transactions.\n",
+         repair ? "replayed" : "would replay", replayed);
+  // 恢复过就算改过镜像，退出码和e2fsck一样报1
+  if (repair) {
+    errors_found++;
+    errors_fixed++;
+  }
+}
+
+// 用法：fsck.naive [-n | -y] [-v] [-j threads] device
+// -n：只检查不修改（默认）；-y：发现问题就修；-v：逐条报告，-vv连位图的每一位都报
+int main(int argc, char *const argv[]) {
+  int fd, opt, i;
+  struct stat stat_;
+  struct timespec start;
+
+  while ((opt = getopt(argc, argv, "nyvj:")) != -1) {
+    switch (opt) {
+    case 'n':
+      repair = 0;
+      break;
+    case 'y':
+      repair = 1;
+      break;
+    case 'v':
+      verbose++;
+      break;
+    case 'j':
+      nthreads = atoi(optarg);
+      break;
+    default:
+      printf("[fsck_naive] Usage: %s [-n | -y] [-v] [-j threads] device\n",
+             argv[0]);
+      return FSCK_ERROR;
+    }
+  }
+  if (optind != argc - 1) {
+    printf("[fsck_naive] No device specified.\n");
+    return FSCK_ERROR;
+  }
+  if (nthreads <= 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0)
+    nthreads = 1;
+
+  fd = open(argv[optind], repair ? O_RDWR : O_RDONLY);
+  if (fd < 0 || fstat(fd, &stat_) != 0) {
+    printf("[fsck_naive] Cannot open %s: %s.\n", argv[optind], strerror(errno));
+    return FSCK_ERROR;
+  }
+  image_size = stat_.st_size;
+  if (S_ISBLK(stat_.st_mode)) {
+    unsigned long long bytes;
+    if (ioctl(fd, BLKGETSIZE64, &bytes) != 0) {
+      printf("[fsck_naive] Cannot get size of %s.\n", argv[optind]);
+      return FSCK_ERROR;
+    }
+    image_size = bytes;
+  }
+  if (image_size < NAIVE_SUPER_BLOCK_OFFSET + NAIVE_SUPER_BLOCK_SIZE) {
+    printf("[fsck_naive] %s is too small.\n", argv[optind]);
+    return FSCK_ERROR;
+  }
+  // 只检查时私有映射，不会碰到盘上的数据；修复时共享映射，改动直接落到镜像上
+  image = mmap(NULL, image_size, PROT_READ | PROT_WRITE,
+               repair ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+  if (image == MAP_FAILED) {
+    printf("[fsck_naive] Cannot mmap %s: %s.\n", argv[optind], strerror(errno));
+    return FSCK_ERROR;
+  }
+  nsb = (struct naive_super_block *)(image + NAIVE_SUPER_BLOCK_OFFSET);
+  block_size = naive_block_size(nsb);
+  if (check_super() != 0)
+    return FSCK_ERROR;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  replay_journal();
+  // 算出来的位图按编号平铺，和盘上怎么分块无关
+  bmap = calloc(nsb->block_total / 8 + 1, 1);
+  imap = calloc(nsb->inode_total / 8 + 1, 1);
+  dir_queue = calloc(nsb->inode_total, sizeof(int));
+  if (bmap == NULL || imap == NULL || dir_queue == NULL) {
+    printf("[fsck_naive] Out of memory.\n");
+    return FSCK_ERROR;
+  }
+  // 整张inode表顺序访问，提示内核预读；分了块组的话每组一段
+  for (i = 0; i < (nsb->group_blocks ? nsb->imap_blocks : 1); i++)
+    madvise(block_at(nsb->inode_table_block_no + i * nsb->group_blocks),
+            (long long)(nsb->data_block_no - nsb->inode_table_block_no) *
+                block_size,
+            MADV_SEQUENTIAL | MADV_WILLNEED);
+
+  // 第一遍：从根目录出发遍历目录树，算出imap
+  if (!inode_ok(NAIVE_ROOT_INODE_NO) ||
+      !S_ISDIR(inode_at(NAIVE_ROOT_INODE_NO)->mode)) {
+    printf("[fsck_naive] Root inode is not a directory.\n");
+    return FSCK_UNCORRECTED;
+  }
+  test_and_set(imap, NAIVE_ROOT_INODE_NO);
+  dir_push(NAIVE_ROOT_INODE_NO);
+  if (run_threads(dir_worker, NULL, 0) != 0) {
+    printf("[fsck_naive] Cannot create threads.\n");
+    return FSCK_ERROR;
+  }
+
+  // 第二遍：按inode表分段，收集走得到的inode占用的块，算出bmap
+  // 数据区之前的块和各块组开头的位图、inode表都是元数据，一律算已用
+  for (i = 0; i < nsb->block_total; i++)
+    if (i < nsb->data_block_no || !data_block_ok(i))
+      bmap[i / 8] |= 1 << (i % 8);
+  struct inode_range *ranges = calloc(nthreads, sizeof(struct inode_range));
+  int per = (nsb->inode_total + nthreads - 1) / nthreads;
+  for (i = 0; i < nthreads; i++) {
+    ranges[i].from = i * per < nsb->inode_total ? i * per : nsb->inode_total;
+    ranges[i].to = ranges[i].from + per < nsb->inode_total ? ranges[i].from + per
+                                                          : nsb->inode_total;
+  }
+  if (run_threads(inode_worker, ranges, sizeof(struct inode_range)) != 0) {
+    printf("[fsck_naive] Cannot create threads.\n");
+    return FSCK_ERROR;
+  }
+  free(ranges);
+
+  // 第三遍：和盘上的位图比对
+  compare_bitmap("Block bitmap", bmap, nsb->block_total, naive_bmap_base(nsb),
+                 naive_bmap_bits(nsb), naive_bmap_block, nsb->bmap_blocks);
+  compare_bitmap("Inode bitmap", imap, nsb->inode_total, 0,
+                 naive_imap_bits(nsb), naive_imap_block, nsb->imap_blocks);
+
+  int used_inodes = 0, used_blocks = 0;
+  for (i = 0; i < nsb->inode_total; i++)
+    used_inodes += test_bit(imap, i);
+  for (i = 0; i < nsb->block_total; i++)
+    used_blocks += test_bit(bmap, i);
+  printf("[fsck_naive] %d/%d inodes, %d/%d blocks in use. Checked in %.3f ms "
+         "with %d threads.\n",
+         used_inodes, nsb->inode_total, used_blocks, nsb->block_total,
+         elapsed_ms(&start), nthreads);
+
+  if (repair && errors_fixed > 0 && msync(image, image_size, MS_SYNC) != 0) {
+    printf("[fsck_naive] msync failed: %s.\n", strerror(errno));
+    return FSCK_ERROR;
+  }
+  munmap(image, image_size);
+  close(fd);
+
+  if (errors_found == 0) {
+    printf("[fsck_naive] Clean.\n");
+    return FSCK_OK;
+  }
+  printf("[fsck_naive] %d problems found, %d fixed.\n", errors_found,
+         errors_fixed);
+  return errors_found > errors_fixed ? FSCK_UNCORRECTED : FSCK_FIXED;
+}
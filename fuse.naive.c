@@ -0,0 +1,253 @@
+// =================
+// fuse.naive.c
+// 用FUSE在用户态挂载naivefs镜像，不依赖特定版本的内核
+// 用法：fuse.naive image mountpoint [FUSE选项]
+// =================
+
+#define FUSE_USE_VERSION 26
+
+#include <errno.h>
+#include <fuse.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+
+#include "libnaivefs.h"
+
+// libnaivefs不是线程安全的，main里强制FUSE单线程运行，这里用一个全局的镜像即可
+static struct naivefs fs;
+
+// 把路径拆成父目录的inode号和最后一级文件名
+static int naive_fuse_parent(const char *path, const char **name, int *len) {
+  const char *slash = strrchr(path, '/');
+  char parent[PATH_MAX];
+  if (slash == NULL || slash[1] == '\0')
+    return -EINVAL;
+  *name = slash + 1;
+  *len = strlen(*name);
+  if (slash - path >= PATH_MAX)
+    return -ENAMETOOLONG;
+  memcpy(parent, path, slash - path);
+  parent[slash - path] = '\0';
+  return naivefs_namei(&fs, parent);
+}
+
+// 按路径读出inode
+static int naive_fuse_inode(const char *path, struct naive_inode *ninode) {
+  int ino = naivefs_namei(&fs, path);
+  if (ino < 0)
+    return ino;
+  return naivefs_read_inode(&fs, ino, ninode);
+}
+
+static int naive_fuse_getattr(const char *path, struct stat *st) {
+  struct naive_inode ninode;
+  int err = naive_fuse_inode(path, &ninode);
+  if (err)
+    return err;
+  memset(st, 0, sizeof(struct stat));
+  st->st_ino = ninode.i_ino;
+  st->st_mode = ninode.mode;
+  st->st_nlink = ninode.i_nlink;
+  st->st_uid = ninode.i_uid;
+  st->st_gid = ninode.i_gid;
+  // 内核模块把目录的i_size当项目数用，这里按目录实际占的字节报告，du、ls看着更正常
+  if (S_ISDIR(ninode.mode) && (ninode.flags & NAIVE_INODE_FLAG_INLINE))
+    st->st_size = NAIVE_INLINE_DATA_LEN;
+  else if (S_ISDIR(ninode.mode))
+    st->st_size = (off_t)ninode.block_count * fs.block_size;
+  else
+    st->st_size = ninode.file_size;
+  st->st_blksize = fs.block_size;
+  st->st_blocks = (blkcnt_t)ninode.block_count * (fs.block_size / 512);
+  st->st_atime = ninode.i_atime;
+  st->st_mtime = ninode.i_mtime;
+  st->st_ctime = ninode.i_ctime;
+  return 0;
+}
+
+// filldir回调的上下文
+struct naive_fuse_dirent {
+  void *buf;
+  fuse_fill_dir_t filler;
+};
+
+static int naive_fuse_filldir(void *ctx, const char *name, int len,
+                              long long pos, int ino, int file_type) {
+  struct naive_fuse_dirent *de = ctx;
+  char filename[NAIVE_MAX_FILENAME_LEN + 1];
+  struct stat st;
+  memcpy(filename, name, len);
+  filename[len] = '\0';
+  memset(&st, 0, sizeof(struct stat));
+  st.st_ino = ino;
+  st.st_mode = file_type == NAIVE_FT_DIR ? S_IFDIR : S_IFREG;
+  // 下一次从这条之后的位置开始，组内序号+1正好落到下一条目录项上
+  return de->filler(de->buf, filename, &st, pos + 1);
+}
+
+// 用带偏移的readdir，FUSE的缓冲区满了就停，下次从offset接着读
+static int naive_fuse_readdir(const char *path, void *buf,
+                              fuse_fill_dir_t filler, off_t offset,
+                              struct fuse_file_info *fi) {
+  struct naive_fuse_dirent de = {buf, filler};
+  struct naive_inode dir;
+  long long pos = offset;
+  int err = naive_fuse_inode(path, &dir);
+  if (err)
+    return err;
+  if (!S_ISDIR(dir.mode))
+    return -ENOTDIR;
+  return naivefs_readdir(&fs, &dir, &pos, naive_fuse_filldir, &de);
+}
+
+static int naive_fuse_mknod(const char *path, mode_t mode, dev_t rdev) {
+  const char *name;
+  int len, ino;
+  int dir_ino = naive_fuse_parent(path, &name, &len);
+  if (dir_ino < 0)
+    return dir_ino;
+  // 和内核模块一样只支持普通文件和目录
+  if (!S_ISREG(mode))
+    return -EPERM;
+  ino = naivefs_mknod(&fs, dir_ino, name, len, mode, fuse_get_context()->uid,
+                      fuse_get_context()->gid);
+  return ino < 0 ? ino : 0;
+}
+
+static int naive_fuse_mkdir(const char *path, mode_t mode) {
+  const char *name;
+  int len, ino;
+  int dir_ino = naive_fuse_parent(path, &name, &len);
+  if (dir_ino < 0)
+    return dir_ino;
+  ino = naivefs_mknod(&fs, dir_ino, name, len, mode | S_IFDIR,
+                      fuse_get_context()->uid, fuse_get_context()->gid);
+  return ino < 0 ? ino : 0;
+}
+
+// 打开时解析一次路径，之后的读写直接用fh里的inode号
+static int naive_fuse_open(const char *path, struct fuse_file_info *fi) {
+  int ino = naivefs_namei(&fs, path);
+  if (ino < 0)
+    return ino;
+  fi->fh = ino;
+  return 0;
+}
+
+static int naive_fuse_read(const char *path, char *buf, size_t size,
+                           off_t offset, struct fuse_file_info *fi) {
+  struct naive_inode ninode;
+  int err = naivefs_read_inode(&fs, fi->fh, &ninode);
+  if (err)
+    return err;
+  return naivefs_read(&fs, &ninode, buf, size, offset);
+}
+
+static int naive_fuse_write(const char *path, const char *buf, size_t size,
+                            off_t offset, struct fuse_file_info *fi) {
+  struct naive_inode ninode;
+  int err = naivefs_read_inode(&fs, fi->fh, &ninode);
+  if (err)
+    return err;
+  return naivefs_write(&fs, &ninode, buf, size, offset);
+}
+
+static int naive_fuse_truncate(const char *path, off_t size) {
+  struct naive_inode ninode;
+  int err = naive_fuse_inode(path, &ninode);
+  if (err)
+    return err;
+  return naivefs_truncate(&fs, &ninode, size);
+}
+
+static int naive_fuse_chmod(const char *path, mode_t mode) {
+  struct naive_inode ninode;
+  int err = naive_fuse_inode(path, &ninode);
+  if (err)
+    return err;
+  ninode.mode = (ninode.mode & S_IFMT) | (mode & ~S_IFMT);
+  return naivefs_write_inode(&fs, &ninode);
+}
+
+static int naive_fuse_chown(const char *path, uid_t uid, gid_t gid) {
+  struct naive_inode ninode;
+  int err = naive_fuse_inode(path, &ninode);
+  if (err)
+    return err;
+  if (uid != (uid_t)-1)
+    ninode.i_uid = uid;
+  if (gid != (gid_t)-1)
+    ninode.i_gid = gid;
+  return naivefs_write_inode(&fs, &ninode);
+}
+
+static int naive_fuse_utimens(const char *path, const struct timespec tv[2]) {
+  struct naive_inode ninode;
+  int err = naive_fuse_inode(path, &ninode);
+  if (err)
+    return err;
+  ninode.i_atime = tv[0].tv_sec;
+  ninode.i_mtime = tv[1].tv_sec;
+  return naivefs_write_inode(&fs, &ninode);
+}
+
+static int naive_fuse_statfs(const char *path, struct statvfs *st) {
+  memset(st, 0, sizeof(struct statvfs));
+  st->f_bsize = st->f_frsize = fs.block_size;
+  st->f_blocks = fs.nsb.block_total;
+  st->f_bfree = st->f_bavail = naivefs_free_blocks(&fs);
+  st->f_files = fs.nsb.inode_total;
+  st->f_ffree = st->f_favail = naivefs_free_inodes(&fs);
+  st->f_namemax = NAIVE_MAX_FILENAME_LEN;
+  return 0;
+}
+
+// 位图只在内存里改，fsync和卸载时才写回镜像
+static int naive_fuse_fsync(const char *path, int datasync,
+                            struct fuse_file_info *fi) {
+  return naivefs_sync(&fs);
+}
+
+static void naive_fuse_destroy(void *private_data) { naivefs_close(&fs); }
+
+static struct fuse_operations naive_fuse_ops = {
+    .getattr = naive_fuse_getattr,
+    .readdir = naive_fuse_readdir,
+    .mknod = naive_fuse_mknod,
+    .mkdir = naive_fuse_mkdir,
+    .open = naive_fuse_open,
+    .read = naive_fuse_read,
+    .write = naive_fuse_write,
+    .truncate = naive_fuse_truncate,
+    .chmod = naive_fuse_chmod,
+    .chown = naive_fuse_chown,
+    .utimens = naive_fuse_utimens,
+    .statfs = naive_fuse_statfs,
+    .fsync = naive_fuse_fsync,
+    .destroy = naive_fuse_destroy,
+};
+
+int main(int argc, char *argv[]) {
+  struct fuse_args args;
+  int err;
+  if (argc < 3) {
+    printf("[fuse_naive] Usage: %s image mountpoint [FUSE options]\n", argv[0]);
+    return 1;
+  }
+  err = naivefs_open(&fs, argv[1], 1);
+  if (err) {
+    printf("[fuse_naive] Cannot open %s: %s.\n", argv[1], strerror(-err));
+    return 1;
+  }
+  // 把镜像路径从参数里拿掉，剩下的交给FUSE，并强制单线程
+  argv[1] = argv[0];
+  args = (struct fuse_args)FUSE_ARGS_INIT(argc - 1, argv + 1);
+  fuse_opt_add_arg(&args, "-s");
+  err = fuse_main(args.argc, args.argv, &naive_fuse_ops, NULL);
+  fuse_opt_free_args(&args);
+  return err;
+}
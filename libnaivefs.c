@@ -0,0 +1,1663 @@
+// =================
+// libnaivefs.c
+// 用户态的naivefs镜像读写库，盘上格式与内核模块完全一致
+// 目录、extent、位图的算法都照搬naivefs.c，缓冲区换成栈上的块，读写换成pread/pwrite
+// =================
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libnaivefs.h"
+
+// ============ image ============
+
+int naivefs_read_block(struct naivefs *fs, int block_no, void *buf) {
+  ssize_t n = pread(fs->fd, buf, fs->block_size,
+                    (off_t)block_no * fs->block_size);
+  return n == fs->block_size ? 0 : -EIO;
+}
+
+int naivefs_write_block(struct naivefs *fs, int block_no, const void *buf) {
+  ssize_t n;
+  if (!fs->writable)
+    return -EROFS;
+  n = pwrite(fs->fd, buf, fs->block_size, (off_t)block_no * fs->block_size);
+  return n == fs->block_size ? 0 : -EIO;
+}
+
+// 连续读写多块
+static int naivefs_rw_blocks(struct naivefs *fs, int block_no, int blocks,
+                             void *buf, int write) {
+  size_t len = (size_t)blocks * fs->block_size;
+  off_t off = (off_t)block_no * fs->block_size;
+  ssize_t n = write ? pwrite(fs->fd, buf, len, off) : pread(fs->fd, buf, len, off);
+  return n == (ssize_t)len ? 0 : -EIO;
+}
+
+// 带校验和的镜像上，位图块、目录块的块尾是块号和块内容的CRC32C
+static int has_csum(struct naivefs *fs) {
+  return fs->nsb.features & NAIVE_FEATURE_CSUM;
+}
+
+static void csum_block_set(struct naivefs *fs, int block_no, void *block) {
+  if (has_csum(fs))
+    *naive_block_csum_at(block, fs->block_size) =
+        naive_block_csum(block_no, block, fs->block_size);
+}
+
+static int csum_block_ok(struct naivefs *fs, int block_no, void *block) {
+  return !has_csum(fs) || *naive_block_csum_at(block, fs->block_size) ==
+                              naive_block_csum(block_no, block, fs->block_size);
+}
+
+// 分了块组时读写一个位图块，写之前算好校验和，读出来先校验
+static int naivefs_rw_bitmap(struct naivefs *fs, int block_no, _Byte *map,
+                             int write) {
+  int err;
+  if (write)
+    csum_block_set(fs, block_no, map);
+  err = naivefs_rw_blocks(fs, block_no, 1, map, write);
+  if (!err && !write && !csum_block_ok(fs, block_no, map))
+    err = -EIO;
+  return err;
+}
+
+// 整张读写两张位图，在内存里各块依次排着；分了块组的话位图块分散在各块组开头，一块一块地读写
+static int naivefs_rw_bitmaps(struct naivefs *fs, int write) {
+  int i, err = 0;
+  if (fs->nsb.group_blocks == 0) {
+    err = naivefs_rw_blocks(fs, fs->nsb.bmap_block_no, fs->nsb.bmap_blocks,
+                            fs->bmap, write);
+    if (!err)
+      err = naivefs_rw_blocks(fs, fs->nsb.imap_block_no, fs->nsb.imap_blocks,
+                              fs->imap, write);
+    return err;
+  }
+  for (i = 0; i < fs->nsb.bmap_blocks && !err; i++)
+    err = naivefs_rw_bitmap(fs, naive_bmap_block(&fs->nsb, i),
+                            fs->bmap + (size_t)i * fs->block_size, write);
+  for (i = 0; i < fs->nsb.imap_blocks && !err; i++)
+    err = naivefs_rw_bitmap(fs, naive_imap_block(&fs->nsb, i),
+                            fs->imap + (size_t)i * fs->block_size, write);
+  return err;
+}
+
+// 打开镜像，读入超级块和两张位图
+// 超级块的位置与块大小无关，直接按字节偏移读，读出来才知道块大小
+int naivefs_open(struct naivefs *fs, const char *path, int writable) {
+  int err;
+  memset(fs, 0, sizeof(struct naivefs));
+  fs->writable = writable;
+  fs->fd = open(path, writable ? O_RDWR : O_RDONLY);
+  if (fs->fd < 0)
+    return -errno;
+
+  if (pread(fs->fd, &fs->nsb, NAIVE_SUPER_BLOCK_SIZE,
+            NAIVE_SUPER_BLOCK_OFFSET) != NAIVE_SUPER_BLOCK_SIZE) {
+    err = -EIO;
+    goto out_close;
+  }
+  fs->block_size = naive_block_size(&fs->nsb);
+  if (fs->nsb.magic != NAIVE_MAGIC || fs->block_size > NAIVE_MAX_BLOCK_SIZE ||
+      fs->block_size < NAIVE_MIN_BLOCK_SIZE ||
+      (fs->block_size & (fs->block_size - 1)) != 0) {
+    err = -EINVAL;
+    goto out_close;
+  }
+  // 不认识的features不碰；带校验和的超级块先校验，位图、inode和目录块读的时候再各自校验
+  if ((fs->nsb.features & ~NAIVE_FEATURES_SUPPORTED) ||
+      (has_csum(fs) && (fs->nsb.checksum != naive_super_csum(&fs->nsb) ||
+                        fs->nsb.group_blocks == 0))) {
+    err = -EINVAL;
+    goto out_close;
+  }
+  fs->dir_size = naive_dir_block_size(&fs->nsb);
+  // 内核没有干净卸载时日志里还有事务，先恢复再读位图；只读打开时看到的就是没恢复的样子
+  if (writable) {
+    err = naivefs_journal_recover(fs);
+    if (err < 0)
+      goto out_close;
+  }
+
+  fs->bmap = malloc((size_t)fs->nsb.bmap_blocks * fs->block_size);
+  fs->imap = malloc((size_t)fs->nsb.imap_blocks * fs->block_size);
+  if (fs->bmap == NULL || fs->imap == NULL) {
+    err = -ENOMEM;
+    goto out_free;
+  }
+  err = naivefs_rw_bitmaps(fs, 0);
+  if (err)
+    goto out_free;
+  fs->bmap_hint = fs->nsb.data_block_no;
+  fs->imap_hint = NAIVE_ROOT_INODE_NO + 1;
+  return 0;
+
+out_free:
+  free(fs->bmap);
+  free(fs->imap);
+out_close:
+  close(fs->fd);
+  return err;
+}
+
+// 把改过的超级块和位图写回镜像
+int naivefs_sync(struct naivefs *fs) {
+  int err = 0;
+  if (!fs->dirty)
+    return 0;
+  if (has_csum(fs))
+    fs->nsb.checksum = naive_super_csum(&fs->nsb);
+  if (pwrite(fs->fd, &fs->nsb, NAIVE_SUPER_BLOCK_SIZE,
+             NAIVE_SUPER_BLOCK_OFFSET) != NAIVE_SUPER_BLOCK_SIZE)
+    err = -EIO;
+  if (!err)
+    err = naivefs_rw_bitmaps(fs, 1);
+  if (!err)
+    fs->dirty = 0;
+  return err;
+}
+
+int naivefs_close(struct naivefs *fs) {
+  int err = fs->writable ? naivefs_sync(fs) : 0;
+  free(fs->bmap);
+  free(fs->imap);
+  if (close(fs->fd) < 0 && !err)
+    err = -errno;
+  return err;
+}
+
+// ============ journal ============
+
+// 和内核的naive_journal_replay一样：从日志区第1块起按序号找完整的事务，把副本拷回原位，
+// 然后在日志头记下下一个序号，清空日志。返回恢复了几个事务
+// 用户态的读写本身不走日志，直接写原位
+int naivefs_journal_recover(struct naivefs *fs) {
+  // 日志头、描述块和提交块都整块读进来，按int对齐
+  int jh_buf[NAIVE_MAX_BLOCK_SIZE / sizeof(int)];
+  int desc_buf[NAIVE_MAX_BLOCK_SIZE / sizeof(int)];
+  int commit_buf[NAIVE_MAX_BLOCK_SIZE / sizeof(int)];
+  struct naive_journal_header *jh = (struct naive_journal_header *)jh_buf;
+  struct naive_journal_block *desc = (struct naive_journal_block *)desc_buf;
+  struct naive_journal_block *commit = (struct naive_journal_block *)commit_buf;
+  _Byte block[NAIVE_MAX_BLOCK_SIZE];
+  int start = fs->nsb.journal_block_no, blocks = fs->nsb.journal_blocks;
+  int max = NAIVE_JOURNAL_TAGS(fs->block_size);
+  int pos = 1, replayed = 0, err, i;
+
+  if (blocks == 0)
+    return 0;
+  if (max > blocks - 3)
+    max = blocks - 3;
+  err = naivefs_read_block(fs, start, jh);
+  if (err)
+    return err;
+  if (jh->magic != NAIVE_JOURNAL_MAGIC)
+    return -EINVAL;
+
+  for (;;) {
+    err = naivefs_read_block(fs, start + pos, desc);
+    if (err)
+      return err;
+    if (desc->magic != NAIVE_JOURNAL_MAGIC ||
+        desc->type != NAIVE_JOURNAL_DESC || desc->sequence != jh->sequence ||
+        desc->count <= 0 || desc->count > max ||
+        pos + desc->count + 1 >= blocks)
+      break;
+    for (i = 0; i < desc->count; i++)
+      if (desc->blocks[i] < fs->nsb.bmap_block_no ||
+          desc->blocks[i] >= fs->nsb.block_total ||
+          (desc->blocks[i] >= start && desc->blocks[i] < start + blocks))
+        break;
+    if (i < desc->count)
+      break;
+    err = naivefs_read_block(fs, start + pos + desc->count + 1, commit);
+    if (err)
+      return err;
+    if (commit->magic != NAIVE_JOURNAL_MAGIC ||
+        commit->type != NAIVE_JOURNAL_COMMIT ||
+        commit->sequence != desc->sequence || commit->count != desc->count)
+      break;
+    for (i = 0; i < desc->count; i++) {
+      err = naivefs_read_block(fs, start + pos + 1 + i, block);
+      if (!err)
+        err = naivefs_write_block(fs, desc->blocks[i], block);
+      if (err)
+        return err;
+    }
+    pos += desc->count + 2;
+    jh->sequence++;
+    replayed++;
+  }
+  if (replayed == 0)
+    return 0;
+  // 副本都落盘了才能清空日志
+  if (fsync(fs->fd) < 0)
+    return -errno;
+  err = naivefs_write_block(fs, start, jh);
+  if (!err && fsync(fs->fd) < 0)
+    err = -errno;
+  return err ? err : replayed;
+}
+
+// ============ bitmap ============
+
+// 位序与mkfs.naive、内核的ext2_*_bit一致
+static int test_bit(_Byte *map, int idx) { return map[idx / 8] >> (idx % 8) & 1; }
+
+// 内存里的位图由各位图块依次拼成，每块只用前bits位，管理从first开始的编号
+// 编号nr在拼起来的位图里是第几位；不分块组时每块的位全用上，就是nr - first
+static int bit_index(struct naivefs *fs, int bits, int first, int nr) {
+  return (nr - first) / bits * NAIVE_BITS_PER_BLOCK(fs->block_size) +
+         (nr - first) % bits;
+}
+
+static int bmap_index(struct naivefs *fs, int block_no) {
+  return bit_index(fs, naive_bmap_bits(&fs->nsb), naive_bmap_base(&fs->nsb),
+                   block_no);
+}
+
+static int imap_index(struct naivefs *fs, int ino) {
+  return bit_index(fs, naive_imap_bits(&fs->nsb), 0, ino);
+}
+
+// 在位图中编号[low, size)的范围内从hint开始找一个0位，找一圈回来为止，找不到返回-1
+// 整字节为0xff时直接跳过，但不越过位图块的有效位和size
+static int find_free_bit(struct naivefs *fs, _Byte *map, int bits, int first,
+                         int low, int size, int hint) {
+  int i, nr, idx;
+  if (hint < low || hint >= size)
+    hint = low;
+  for (i = 0, nr = hint; i < size - low; i++, nr++) {
+    if (nr == size)
+      nr = low;
+    idx = bit_index(fs, bits, first, nr);
+    if (idx % 8 == 0 && map[idx / 8] == 0xff && nr + 8 <= size &&
+        (nr - first) % bits + 8 <= bits && size - low - i >= 8) {
+      i += 7;
+      nr += 7;
+      continue;
+    }
+    if (!test_bit(map, idx))
+      return nr;
+  }
+  return -1;
+}
+
+static int count_free_bits(struct naivefs *fs, _Byte *map, int bits,
+                           int first, int low, int size) {
+  int nr, free = 0;
+  for (nr = low; nr < size; nr++)
+    free += !test_bit(map, bit_index(fs, bits, first, nr));
+  return free;
+}
+
+// 分配一个空闲块（绝对块号），尽量取goal或紧跟其后的块，goal<0表示不在乎位置
+int naivefs_alloc_block(struct naivefs *fs, int goal) {
+  int nr = find_free_bit(fs, fs->bmap, naive_bmap_bits(&fs->nsb),
+                         naive_bmap_base(&fs->nsb), fs->nsb.data_block_no,
+                         fs->nsb.block_total, goal >= 0 ? goal : fs->bmap_hint);
+  int idx;
+  if (nr < 0)
+    return -ENOSPC;
+  idx = bmap_index(fs, nr);
+  fs->bmap[idx / 8] |= 1 << (idx % 8);
+  fs->bmap_hint = nr + 1;
+  fs->dirty = 1;
+  return nr;
+}
+
+void naivefs_free_block(struct naivefs *fs, int block_no) {
+  int idx = bmap_index(fs, block_no);
+  fs->bmap[idx / 8] &= ~(1 << (idx % 8));
+  fs->dirty = 1;
+}
+
+// 分配一个空闲inode，从goal开始找，goal<0表示不在乎位置
+int naivefs_alloc_inode(struct naivefs *fs, int goal) {
+  int nr = find_free_bit(fs, fs->imap, naive_imap_bits(&fs->nsb), 0,
+                         NAIVE_ROOT_INODE_NO + 1, fs->nsb.inode_total,
+                         goal >= 0 ? goal : fs->imap_hint);
+  int idx;
+  if (nr < 0)
+    return -ENOSPC;
+  idx = imap_index(fs, nr);
+  fs->imap[idx / 8] |= 1 << (idx % 8);
+  fs->imap_hint = nr + 1;
+  fs->dirty = 1;
+  return nr;
+}
+
+void naivefs_free_inode(struct naivefs *fs, int ino) {
+  int idx = imap_index(fs, ino);
+  fs->imap[idx / 8] &= ~(1 << (idx % 8));
+  fs->dirty = 1;
+}
+
+int naivefs_free_blocks(struct naivefs *fs) {
+  return count_free_bits(fs, fs->bmap, naive_bmap_bits(&fs->nsb),
+                         naive_bmap_base(&fs->nsb), fs->nsb.data_block_no,
+                         fs->nsb.block_total);
+}
+
+int naivefs_free_inodes(struct naivefs *fs) {
+  return count_free_bits(fs, fs->imap, naive_imap_bits(&fs->nsb), 0,
+                         NAIVE_ROOT_INODE_NO + 1, fs->nsb.inode_total);
+}
+
+// ============ inode ============
+
+// inode表的每块紧凑地放着NAIVE_INODES_PER_BLOCK(fs->block_size)个inode，分了块组的话在所属块组的那段inode表里
+static int inode_block_no(struct naivefs *fs, int ino) {
+  return naive_inode_block(&fs->nsb, ino);
+}
+
+int naivefs_read_inode(struct naivefs *fs, int ino, struct naive_inode *ninode) {
+  _Byte block[NAIVE_MAX_BLOCK_SIZE];
+  int err;
+  if (ino < 0 || ino >= fs->nsb.inode_total)
+    return -EINVAL;
+  err = naivefs_read_block(fs, inode_block_no(fs, ino), block);
+  if (err)
+    return err;
+  memcpy(ninode,
+         block + ino % NAIVE_INODES_PER_BLOCK(fs->block_size) * NAIVE_INODE_SIZE,
+         NAIVE_INODE_SIZE);
+  // 没用过的inode槽全是0，谈不上校验和
+  if (has_csum(fs) && ninode->mode != 0 &&
+      ninode->checksum != naive_inode_csum(ninode))
+    return -EIO;
+  return 0;
+}
+
+// 读改写inode所在的块，同块的其他inode不受影响
+int naivefs_write_inode(struct naivefs *fs, const struct naive_inode *ninode) {
+  _Byte block[NAIVE_MAX_BLOCK_SIZE];
+  struct naive_inode *slot;
+  int block_no = inode_block_no(fs, ninode->i_ino);
+  int err = naivefs_read_block(fs, block_no, block);
+  if (err)
+    return err;
+  slot = (struct naive_inode *)(block + ninode->i_ino %
+                                NAIVE_INODES_PER_BLOCK(fs->block_size) *
+                                NAIVE_INODE_SIZE);
+  memcpy(slot, ninode, NAIVE_INODE_SIZE);
+  if (has_csum(fs))
+    slot->checksum = naive_inode_csum(slot);
+  return naivefs_write_block(fs, block_no, block);
+}
+
+// ============ extent ============
+
+// 带NAIVE_FEATURE_EXTENT_CHAIN的镜像上间接extent块可以串成链，新的extent追加在表尾，表不保证有序
+static int has_chain(struct naivefs *fs) {
+  return fs->nsb.features & NAIVE_FEATURE_EXTENT_CHAIN;
+}
+
+// 装下n个extent要几个间接extent块
+static int extent_blocks(struct naivefs *fs, int n) {
+  int per = NAIVE_EXTENTS_PER_BLOCK(fs->block_size);
+  if (n <= NAIVE_INLINE_EXTENTS)
+    return 0;
+  return has_chain(fs) ? (n - NAIVE_INLINE_EXTENTS + per - 1) / per : 1;
+}
+
+// 取extent表的第i项：前NAIVE_INLINE_EXTENTS项直接放在inode里，其余的在间接extent块eblock里
+// 只用于老镜像，那时间接extent块只有一块
+static struct naive_extent *extent_at(struct naive_inode *ninode,
+                                      struct naive_extent *eblock, int i) {
+  if (i < NAIVE_INLINE_EXTENTS)
+    return &ninode->extents[i];
+  return &eblock[i - NAIVE_INLINE_EXTENTS];
+}
+
+// 从头顺序走extent表时取第i项，i必须从0起逐个加1
+// eblock放当前走到的间接extent块，*eblock_no是它的块号，走进下一块时读进来；读不出来返回NULL
+static struct naive_extent *extent_next(struct naivefs *fs,
+                                        struct naive_inode *ninode,
+                                        struct naive_extent *eblock,
+                                        int *eblock_no, int i) {
+  int per = NAIVE_EXTENTS_PER_BLOCK(fs->block_size);
+  int k = i - NAIVE_INLINE_EXTENTS;
+  if (i < NAIVE_INLINE_EXTENTS)
+    return &ninode->extents[i];
+  if (k % per == 0) {
+    *eblock_no = k == 0 ? ninode->extent_block
+                        : NAIVE_EXTENT_NEXT(eblock, fs->block_size);
+    if (*eblock_no == 0 || naivefs_read_block(fs, *eblock_no, eblock) != 0)
+      return NULL;
+  }
+  return &eblock[k % per];
+}
+
+// 把文件内的逻辑块号映射为物理块号，没有映射时返回0
+// count不为NULL时，顺便给出从file_block开始、在盘上连续的块数
+int naivefs_map_block(struct naivefs *fs, struct naive_inode *ninode,
+                      int file_block, int *count) {
+  int eblock_buf[NAIVE_MAX_BLOCK_SIZE / sizeof(int)]; // 整块读进来，按int对齐
+  struct naive_extent *eblock = (struct naive_extent *)eblock_buf;
+  int i, eblock_no = 0, sorted = !has_chain(fs);
+  for (i = 0; i < ninode->extent_count; i++) {
+    struct naive_extent *ext = extent_next(fs, ninode, eblock, &eblock_no, i);
+    if (ext == NULL)
+      return -EIO;
+    // 有序的表过头了就是空洞，链式的表要看完
+    if (file_block < ext->file_block) {
+      if (sorted)
+        break;
+      continue;
+    }
+    if (file_block < ext->file_block + ext->len) {
+      if (count != NULL)
+        *count = ext->len - (file_block - ext->file_block);
+      return ext->start + (file_block - ext->file_block);
+    }
+  }
+  return 0;
+}
+
+// 链式extent表：把ext追加到表尾，eblock是表尾所在的间接extent块（块号*eblock_no），
+// 那块满了就新分配一块接在链上
+static int extent_append(struct naivefs *fs, struct naive_inode *ninode,
+                         struct naive_extent *eblock, int *eblock_no,
+                         struct naive_extent *ext) {
+  int per = NAIVE_EXTENTS_PER_BLOCK(fs->block_size);
+  int k = ninode->extent_count - NAIVE_INLINE_EXTENTS, no, err;
+  if (k < 0) {
+    ninode->extents[ninode->extent_count++] = *ext;
+    return 0;
+  }
+  if (k % per == 0) {
+    no = naivefs_alloc_block(fs, ext->start + ext->len);
+    if (no < 0)
+      return no;
+    if (k == 0) {
+      ninode->extent_block = no;
+    } else {
+      NAIVE_EXTENT_NEXT(eblock, fs->block_size) = no;
+      err = naivefs_write_block(fs, *eblock_no, eblock);
+      if (err) {
+        naivefs_free_block(fs, no);
+        return err;
+      }
+    }
+    memset(eblock, 0, fs->block_size);
+    *eblock_no = no;
+  }
+  eblock[k % per] = *ext;
+  ninode->extent_count++;
+  return naivefs_write_block(fs, *eblock_no, eblock);
+}
+
+// 给文件的逻辑块file_block分配一个物理块并记进extent表，返回物理块号
+// 只改ninode本身（和间接extent块），ninode由调用者写回
+int naivefs_add_block(struct naivefs *fs, struct naive_inode *ninode,
+                      int file_block) {
+  int eblock_buf[NAIVE_MAX_BLOCK_SIZE / sizeof(int)];
+  int pblock_buf[NAIVE_MAX_BLOCK_SIZE / sizeof(int)];
+  struct naive_extent *eblock = (struct naive_extent *)eblock_buf;
+  struct naive_extent *pblock = (struct naive_extent *)pblock_buf;
+  struct naive_extent *prev = NULL, *ext, new;
+  int per = NAIVE_EXTENTS_PER_BLOCK(fs->block_size);
+  int i, j, pos = 0, prev_i = -1, prev_no = 0, eblock_no = 0, block_no, err;
+  int prev_fb = 0;
+  // 文件的第一块从inode所在的块组里找
+  int goal = naive_inode_group_start(&fs->nsb, ninode->i_ino);
+
+  // 找前一个extent（起点不超过file_block的里面起点最大的），老镜像的表有序，插入位置就在它之后；
+  // 整张表走完后eblock停在表尾所在的块
+  for (i = 0; i < ninode->extent_count; i++) {
+    ext = extent_next(fs, ninode, eblock, &eblock_no, i);
+    if (ext == NULL)
+      return -EIO;
+    if (ext->file_block <= file_block &&
+        (prev_i < 0 || ext->file_block > prev_fb)) {
+      prev_fb = ext->file_block;
+      prev_i = i;
+      prev_no = i < NAIVE_INLINE_EXTENTS ? 0 : eblock_no;
+      pos = i + 1;
+    }
+  }
+  // eblock里已经换成了表尾那块，前一个extent在更早走过的块里的话把那块再读出来
+  if (prev_no == 0 && prev_i >= 0) {
+    prev = &ninode->extents[prev_i];
+  } else if (prev_no != 0) {
+    if (prev_no != eblock_no && naivefs_read_block(fs, prev_no, pblock) != 0)
+      return -EIO;
+    prev = (prev_no == eblock_no ? eblock : pblock) +
+           (prev_i - NAIVE_INLINE_EXTENTS) % per;
+  }
+  if (prev != NULL) {
+    if (file_block < prev->file_block + prev->len)
+      return prev->start + (file_block - prev->file_block);
+    goal = prev->start + (file_block - prev->file_block);
+  }
+
+  block_no = naivefs_alloc_block(fs, goal);
+  if (block_no < 0)
+    return block_no;
+
+  if (prev != NULL && prev->file_block + prev->len == file_block &&
+      prev->start + prev->len == block_no) {
+    // 正好接得上，延长前一个extent即可
+    prev->len++;
+    ninode->block_count++;
+    if (prev_no == 0)
+      return block_no;
+    err = naivefs_write_block(fs, prev_no,
+                              prev_no == eblock_no ? eblock : pblock);
+    return err ? err : block_no;
+  }
+  if (has_chain(fs)) {
+    new.file_block = file_block;
+    new.start = block_no;
+    new.len = 1;
+    err = extent_append(fs, ninode, eblock, &eblock_no, &new);
+    if (err) {
+      naivefs_free_block(fs, block_no);
+      return err;
+    }
+    ninode->block_count++;
+    return block_no;
+  }
+  if (ninode->extent_count == NAIVE_MAX_EXTENTS(fs->block_size)) {
+    naivefs_free_block(fs, block_no);
+    return -EFBIG;
+  }
+  if (ninode->extent_count == NAIVE_INLINE_EXTENTS) {
+    // inode里放满了，分配一个间接extent块
+    eblock_no = naivefs_alloc_block(fs, block_no + 1);
+    if (eblock_no < 0) {
+      naivefs_free_block(fs, block_no);
+      return eblock_no;
+    }
+    memset(eblock, 0, fs->block_size);
+    ninode->extent_block = eblock_no;
+  }
+  for (j = ninode->extent_count; j > pos; j--)
+    *extent_at(ninode, eblock, j) = *extent_at(ninode, eblock, j - 1);
+  ext = extent_at(ninode, eblock, pos);
+  ext->file_block = file_block;
+  ext->start = block_no;
+  ext->len = 1;
+  ninode->extent_count++;
+  ninode->block_count++;
+  if (ninode->extent_count > NAIVE_INLINE_EXTENTS) {
+    err = naivefs_write_block(fs, ninode->extent_block, eblock);
+    if (err)
+      return err;
+  }
+  return block_no;
+}
+
+// 把整张extent表读进malloc的数组，链上各间接extent块的块号依次放进*blocks（也是malloc的），块数放进*nblocks
+static struct naive_extent *load_extents(struct naivefs *fs,
+                                         struct naive_inode *ninode,
+                                         int **blocks, int *nblocks) {
+  int eblock_buf[NAIVE_MAX_BLOCK_SIZE / sizeof(int)];
+  struct naive_extent *eblock = (struct naive_extent *)eblock_buf;
+  struct naive_extent *ext = malloc((ninode->extent_count + 1) * sizeof(*ext));
+  int *nos = malloc((extent_blocks(fs, ninode->extent_count) + 1) * sizeof(int));
+  int per = NAIVE_EXTENTS_PER_BLOCK(fs->block_size);
+  int i, n = 0, eblock_no = 0;
+  if (ext == NULL || nos == NULL)
+    goto fail;
+  for (i = 0; i < ninode->extent_count; i++) {
+    struct naive_extent *e = extent_next(fs, ninode, eblock, &eblock_no, i);
+    if (e == NULL)
+      goto fail;
+    if (i >= NAIVE_INLINE_EXTENTS && (i - NAIVE_INLINE_EXTENTS) % per == 0)
+      nos[n++] = eblock_no;
+    ext[i] = *e;
+  }
+  *blocks = nos;
+  *nblocks = n;
+  return ext;
+fail:
+  free(ext);
+  free(nos);
+  return NULL;
+}
+
+// 把n个extent写回extent表，原来链上的间接extent块按顺序接着用，用不完的释放掉
+static int store_extents(struct naivefs *fs, struct naive_inode *ninode,
+                         struct naive_extent *ext, int n, int *blocks,
+                         int nblocks) {
+  int eblock_buf[NAIVE_MAX_BLOCK_SIZE / sizeof(int)];
+  struct naive_extent *eblock = (struct naive_extent *)eblock_buf;
+  int per = NAIVE_EXTENTS_PER_BLOCK(fs->block_size);
+  int need = extent_blocks(fs, n), b, k, err;
+  for (k = 0; k < n && k < NAIVE_INLINE_EXTENTS; k++)
+    ninode->extents[k] = ext[k];
+  for (b = 0; b < need; b++) {
+    memset(eblock, 0, fs->block_size);
+    for (k = 0; k < per && NAIVE_INLINE_EXTENTS + b * per + k < n; k++)
+      eblock[k] = ext[NAIVE_INLINE_EXTENTS + b * per + k];
+    NAIVE_EXTENT_NEXT(eblock, fs->block_size) = b + 1 < need ? blocks[b + 1] : 0;
+    err = naivefs_write_block(fs, blocks[b], eblock);
+    if (err)
+      return err;
+  }
+  for (b = need; b < nblocks; b++)
+    naivefs_free_block(fs, blocks[b]);
+  ninode->extent_count = n;
+  ninode->extent_block = need > 0 ? blocks[0] : 0;
+  return 0;
+}
+
+// 释放文件从逻辑块from_block开始的所有块，extent表跟着截短
+// 链式的表不保证有序，整张读出来逐项截，截空了的项去掉，剩下的按原来的顺序写回
+static int truncate_blocks(struct naivefs *fs, struct naive_inode *ninode,
+                           int from_block) {
+  int *blocks, nblocks, i, j, n = 0, err;
+  struct naive_extent *ext = load_extents(fs, ninode, &blocks, &nblocks);
+  if (ext == NULL)
+    return -EIO;
+  for (i = 0; i < ninode->extent_count; i++) {
+    int keep = from_block - ext[i].file_block;
+    if (keep < 0)
+      keep = 0;
+    if (keep < ext[i].len) {
+      for (j = keep; j < ext[i].len; j++)
+        naivefs_free_block(fs, ext[i].start + j);
+      ninode->block_count -= ext[i].len - keep;
+      ext[i].len = keep;
+    }
+    if (ext[i].len > 0)
+      ext[n++] = ext[i];
+  }
+  err = store_extents(fs, ninode, ext, n, blocks, nblocks);
+  free(ext);
+  free(blocks);
+  return err;
+}
+
+// ============ dir ============
+
+// 沿目录索引往下走时，每一层索引块的信息，块内容就放在frame里
+struct dx_frame {
+  _Byte block[NAIVE_MAX_BLOCK_SIZE];  // 索引块的内容
+  int block_no;                   // 索引块的物理块号
+  struct naive_dx_entry *entries; // 该块的索引项
+  int *count;                     // 指向该块的索引项个数
+  int limit;                      // 该块最多放几个索引项
+  int at;                         // 要找的散列值落在第几项
+};
+
+// 分裂叶子块时用来排序的目录项
+struct dx_sort_item {
+  unsigned int hash;
+  int off;
+  int len;
+};
+
+static struct naive_dir_record *dir_at(void *block, int off) {
+  return (struct naive_dir_record *)((char *)block + off);
+}
+
+// 检查偏移off处的目录项头是否合理，size是目录块或内联目录的大小
+static int dir_rec_ok(struct naive_dir_record *rec, int off, int size) {
+  return rec->rec_len >= NAIVE_DIR_REC_LEN(0) && rec->rec_len % 4 == 0 &&
+         off + rec->rec_len <= size &&
+         NAIVE_DIR_REC_LEN(rec->name_len) <= rec->rec_len;
+}
+
+// 读目录的第lblock个逻辑块并校验，返回其物理块号，方便改完写回
+static int dir_bread(struct naivefs *fs, struct naive_inode *dir, int lblock,
+                     void *block) {
+  int block_no = naivefs_map_block(fs, dir, lblock, NULL);
+  int err;
+  if (block_no <= 0)
+    return -EIO;
+  err = naivefs_read_block(fs, block_no, block);
+  if (!err && !csum_block_ok(fs, block_no, block))
+    err = -EIO;
+  return err ? err : block_no;
+}
+
+// 写回目录块，先算好块尾的校验和
+static int dir_bwrite(struct naivefs *fs, int block_no, void *block) {
+  csum_block_set(fs, block_no, block);
+  return naivefs_write_block(fs, block_no, block);
+}
+
+// 给目录追加一个逻辑块，block初始化为一条占满整块（带校验和时到假目录项之前）的空目录项，
+// 返回物理块号，由调用者写盘
+static int dir_append_block(struct naivefs *fs, struct naive_inode *dir,
+                            int *lblock, void *block) {
+  int block_no;
+  *lblock = dir->block_count;
+  block_no = naivefs_add_block(fs, dir, *lblock);
+  if (block_no < 0)
+    return block_no;
+  memset(block, 0, fs->block_size);
+  dir_at(block, 0)->rec_len = fs->dir_size;
+  if (has_csum(fs)) {
+    struct naive_dir_tail *tail =
+        (struct naive_dir_tail *)((_Byte *)block + fs->dir_size);
+    tail->rec_len = NAIVE_DIR_TAIL_SIZE;
+    tail->file_type = NAIVE_FT_CSUM;
+  }
+  return block_no;
+}
+
+// 在目录块（或内联目录）里找名为name的目录项，返回其偏移，找不到返回-1
+static int find_in_block(void *block, int size, const char *name, int len) {
+  struct naive_dir_record *rec;
+  int off;
+  for (off = 0; off < size; off += rec->rec_len) {
+    rec = dir_at(block, off);
+    if (!dir_rec_ok(rec, off, size))
+      break;
+    if (rec->name_len == len && memcmp(rec->filename, name, len) == 0)
+      return off;
+  }
+  return -1;
+}
+
+// 在目录块（或内联目录）里找空闲空间放新目录项，放不下返回-ENOSPC
+static int insert_in_block(void *block, int size, const char *name, int len,
+                           int ino, unsigned char type) {
+  int need = NAIVE_DIR_REC_LEN(len);
+  struct naive_dir_record *rec;
+  int off;
+  for (off = 0; off < size; off += rec->rec_len) {
+    int used;
+    rec = dir_at(block, off);
+    if (!dir_rec_ok(rec, off, size))
+      break;
+    used = rec->name_len ? NAIVE_DIR_REC_LEN(rec->name_len) : 0;
+    if (rec->rec_len - used < need)
+      continue;
+    if (used) {
+      struct naive_dir_record *next = dir_at(rec, used);
+      next->rec_len = rec->rec_len - used;
+      rec->rec_len = used;
+      rec = next;
+    }
+    rec->i_ino = ino;
+    rec->name_len = len;
+    rec->file_type = type;
+    memcpy(rec->filename, name, len);
+    return 0;
+  }
+  return -ENOSPC;
+}
+
+// 把暂存区buf里items[from, to)紧凑地排进block，最后一条的rec_len延伸到块尾
+static void dir_pack(void *block, int size, char *buf,
+                     struct dx_sort_item *items, int from, int to) {
+  struct naive_dir_record *rec = NULL;
+  int off = 0, i;
+  memset(block, 0, size);
+  for (i = from; i < to; i++) {
+    rec = dir_at(block, off);
+    memcpy(rec, buf + items[i].off, items[i].len);
+    rec->rec_len = items[i].len;
+    off += items[i].len;
+  }
+  if (rec == NULL) {
+    dir_at(block, 0)->rec_len = size;
+    return;
+  }
+  rec->rec_len += size - off;
+}
+
+// 在索引项里二分查找最后一个hash不大于给定值的项
+static int dx_search(struct naive_dx_entry *entries, int count,
+                     unsigned int hash) {
+  int lo = 1, hi = count - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (entries[mid].hash > hash)
+      hi = mid - 1;
+    else
+      lo = mid + 1;
+  }
+  return lo - 1;
+}
+
+// 按frame里的块内容设好entries等指针
+static void dx_frame_init(struct dx_frame *frame, int is_root) {
+  if (is_root) {
+    struct naive_dx_root *root = (struct naive_dx_root *)frame->block;
+    frame->entries = root->entries;
+    frame->count = &root->count;
+    frame->limit = root->limit;
+  } else {
+    struct naive_dx_node *node = (struct naive_dx_node *)frame->block;
+    frame->entries = node->entries;
+    frame->count = &node->count;
+    frame->limit = node->limit;
+  }
+}
+
+// 检查索引块头里的count和limit，和内核的naive_dx_frame_ok一样
+static int dx_frame_ok(struct dx_frame *frame, int expect) {
+  return frame->limit == expect && *frame->count > 0 &&
+         *frame->count <= frame->limit;
+}
+
+// 从索引根往下找散列值hash所在的叶子块，返回层数+1
+static int dx_probe(struct naivefs *fs, struct naive_inode *dir,
+                    unsigned int hash, struct dx_frame *frames) {
+  struct naive_dx_root *root;
+  int i, block_no;
+  block_no = dir_bread(fs, dir, 0, frames[0].block);
+  if (block_no < 0)
+    return block_no;
+  root = (struct naive_dx_root *)frames[0].block;
+  if (root->levels < 0 || root->levels > NAIVE_DX_MAX_LEVELS)
+    return -EIO;
+  frames[0].block_no = block_no;
+  dx_frame_init(&frames[0], 1);
+  if (!dx_frame_ok(&frames[0], NAIVE_DX_ROOT_LIMIT(fs->dir_size)))
+    return -EIO;
+  frames[0].at = dx_search(frames[0].entries, *frames[0].count, hash);
+
+  for (i = 1; i <= root->levels; i++) {
+    block_no = dir_bread(fs, dir, frames[i - 1].entries[frames[i - 1].at].block,
+                         frames[i].block);
+    if (block_no < 0)
+      return block_no;
+    frames[i].block_no = block_no;
+    dx_frame_init(&frames[i], 0);
+    if (!dx_frame_ok(&frames[i], NAIVE_DX_NODE_LIMIT(fs->dir_size)))
+      return -EIO;
+    frames[i].at = dx_search(frames[i].entries, *frames[i].count, hash);
+  }
+  return root->levels + 1;
+}
+
+// 在frame->at之后插入一个索引项并写回
+static int dx_insert(struct naivefs *fs, struct dx_frame *frame,
+                     unsigned int hash, int block) {
+  struct naive_dx_entry *pos = frame->entries + frame->at + 1;
+  memmove(pos + 1, pos,
+          (frame->entries + *frame->count - pos) * sizeof(struct naive_dx_entry));
+  pos->hash = hash;
+  pos->block = block;
+  (*frame->count)++;
+  return dir_bwrite(fs, frame->block_no, frame->block);
+}
+
+// 在目录中按名字找目录项，找到时把它拷进*res
+static int dir_find_entry(struct naivefs *fs, struct naive_inode *dir,
+                          const char *name, int len,
+                          struct naive_dir_record *res) {
+  _Byte block[NAIVE_MAX_BLOCK_SIZE];
+  int i, off, err;
+
+  if (dir->flags & NAIVE_INODE_FLAG_INLINE) {
+    off = find_in_block(dir->inline_data, NAIVE_INLINE_DATA_LEN, name, len);
+    if (off < 0)
+      return -ENOENT;
+    memcpy(res, dir_at(dir->inline_data, off), NAIVE_DIR_REC_LEN(len));
+    return 0;
+  }
+
+  if (dir->flags & NAIVE_INODE_FLAG_DX) {
+    struct dx_frame frames[NAIVE_DX_MAX_LEVELS + 1];
+    int n = dx_probe(fs, dir, naive_name_hash(name, len), frames);
+    if (n < 0)
+      return n;
+    err = dir_bread(fs, dir, frames[n - 1].entries[frames[n - 1].at].block,
+                    block);
+    if (err < 0)
+      return err;
+    off = find_in_block(block, fs->dir_size, name, len);
+    if (off < 0)
+      return -ENOENT;
+    memcpy(res, dir_at(block, off), NAIVE_DIR_REC_LEN(len));
+    return 0;
+  }
+
+  for (i = 0; i < dir->block_count; i++) {
+    err = dir_bread(fs, dir, i, block);
+    if (err < 0)
+      return err;
+    off = find_in_block(block, fs->dir_size, name, len);
+    if (off >= 0) {
+      memcpy(res, dir_at(block, off), NAIVE_DIR_REC_LEN(len));
+      return 0;
+    }
+  }
+  return -ENOENT;
+}
+
+// 线性目录的第0块满了，改成带索引的格式，和内核的naive_dx_make_indexed一样
+static int dx_make_indexed(struct naivefs *fs, struct naive_inode *dir) {
+  _Byte root_block[NAIVE_MAX_BLOCK_SIZE], leaf_block[NAIVE_MAX_BLOCK_SIZE];
+  struct naive_dx_root *root = (struct naive_dx_root *)root_block;
+  struct naive_dir_record *rec, *last = NULL;
+  int root_no, leaf_no, leaf, off, leaf_off = 0, err;
+
+  root_no = dir_bread(fs, dir, 0, root_block);
+  if (root_no < 0)
+    return root_no;
+  leaf_no = dir_append_block(fs, dir, &leaf, leaf_block);
+  if (leaf_no < 0)
+    return leaf_no;
+
+  off = root->dot.rec_len + dir_at(root_block, root->dot.rec_len)->rec_len;
+  for (; off < fs->dir_size; off += rec->rec_len) {
+    rec = dir_at(root_block, off);
+    if (!dir_rec_ok(rec, off, fs->dir_size))
+      break;
+    if (rec->name_len == 0)
+      continue;
+    last = dir_at(leaf_block, leaf_off);
+    memcpy(last, rec, NAIVE_DIR_REC_LEN(rec->name_len));
+    last->rec_len = NAIVE_DIR_REC_LEN(rec->name_len);
+    leaf_off += last->rec_len;
+  }
+  if (last != NULL)
+    last->rec_len += fs->dir_size - leaf_off;
+
+  root->dot.rec_len = NAIVE_DIR_REC_LEN(1);
+  root->dotdot.rec_len = fs->dir_size - NAIVE_DIR_REC_LEN(1);
+  memset(&root->levels, 0,
+         fs->dir_size - offsetof(struct naive_dx_root, levels));
+  root->limit = NAIVE_DX_ROOT_LIMIT(fs->dir_size);
+  root->count = 1;
+  root->entries[0].hash = 0;
+  root->entries[0].block = leaf;
+  dir->flags |= NAIVE_INODE_FLAG_DX;
+
+  err = dir_bwrite(fs, leaf_no, leaf_block);
+  if (!err)
+    err = dir_bwrite(fs, root_no, root_block);
+  return err;
+}
+
+// 给目录追加一个空的索引节点块
+static int dx_new_node(struct naivefs *fs, struct naive_inode *dir,
+                       int *lblock, void *block) {
+  int block_no = dir_append_block(fs, dir, lblock, block);
+  struct naive_dx_node *node = block;
+  if (block_no < 0)
+    return block_no;
+  node->count = 0;
+  node->limit = NAIVE_DX_NODE_LIMIT(fs->dir_size);
+  return block_no;
+}
+
+// 保证frames[*n-1]还能再插一项，满了就往上分裂，和内核的naive_dx_make_room一样，层数变了*n跟着变
+static int dx_make_room(struct naivefs *fs, struct naive_inode *dir,
+                        struct dx_frame *frames, int *n) {
+  struct dx_frame *frame;
+  struct naive_dx_node *node;
+  _Byte block[NAIVE_MAX_BLOCK_SIZE];
+  int i, lblock, block_no, half, err;
+
+  for (i = *n - 1; i >= 0 && *frames[i].count >= frames[i].limit; i--)
+    ;
+  if (i < 0) {
+    // 根也满了，把根的索引项整体下移到新节点，树长高一层
+    struct naive_dx_root *root = (struct naive_dx_root *)frames[0].block;
+    if (root->levels >= NAIVE_DX_MAX_LEVELS)
+      return -ENOSPC;
+    for (i = *n - 1; i >= 1; i--) {
+      memcpy(&frames[i + 1], &frames[i], sizeof(struct dx_frame));
+      dx_frame_init(&frames[i + 1], 0);
+    }
+    block_no = dx_new_node(fs, dir, &lblock, frames[1].block);
+    if (block_no < 0)
+      return block_no;
+    node = (struct naive_dx_node *)frames[1].block;
+    node->count = root->count;
+    memcpy(node->entries, root->entries,
+           root->count * sizeof(struct naive_dx_entry));
+    frames[1].block_no = block_no;
+    dx_frame_init(&frames[1], 0);
+    frames[1].at = frames[0].at;
+    root->levels++;
+    root->count = 1;
+    root->entries[0].hash = 0;
+    root->entries[0].block = lblock;
+    frames[0].at = 0;
+    (*n)++;
+    err = dir_bwrite(fs, frames[0].block_no, frames[0].block);
+    if (!err)
+      err = dir_bwrite(fs, frames[1].block_no, frames[1].block);
+    if (err)
+      return err;
+    i = 1;
+  }
+
+  // frames[i]有空位，它下面的各层都满了，依次对半分裂，后一半搬到新节点
+  for (i++; i < *n; i++) {
+    frame = &frames[i];
+    block_no = dx_new_node(fs, dir, &lblock, block);
+    if (block_no < 0)
+      return block_no;
+    node = (struct naive_dx_node *)block;
+    half = *frame->count / 2;
+    node->count = *frame->count - half;
+    memcpy(node->entries, frame->entries + half,
+           node->count * sizeof(struct naive_dx_entry));
+    *frame->count = half;
+    err = dir_bwrite(fs, frame->block_no, frame->block);
+    if (!err)
+      err = dir_bwrite(fs, block_no, block);
+    if (!err)
+      err = dx_insert(fs, &frames[i - 1], node->entries[0].hash, lblock);
+    if (err)
+      return err;
+
+    if (frame->at >= half) {
+      // 要找的位置在后一半，换到新节点上，上一层也改指新插的那一项
+      memcpy(frame->block, block, fs->block_size);
+      frame->block_no = block_no;
+      dx_frame_init(frame, 0);
+      frame->at -= half;
+      frames[i - 1].at++;
+    }
+  }
+  return 0;
+}
+
+static int dx_sort_cmp(const void *a, const void *b) {
+  unsigned int ha = ((const struct dx_sort_item *)a)->hash;
+  unsigned int hb = ((const struct dx_sort_item *)b)->hash;
+  return ha < hb ? -1 : (ha > hb ? 1 : 0);
+}
+
+// 叶子块满了，按散列值排序后按字节数对半分裂，散列值相同的目录项不会分到两个叶子里
+static int dx_split_leaf(struct naivefs *fs, struct naive_inode *dir,
+                         struct dx_frame *frames, int n, void *leaf_block,
+                         int leaf_no, const char *name, int len, int ino,
+                         unsigned char type) {
+  char buf[NAIVE_MAX_BLOCK_SIZE + NAIVE_DIR_REC_LEN(NAIVE_MAX_FILENAME_LEN)];
+  struct dx_sort_item items[NAIVE_MAX_BLOCK_SIZE / NAIVE_DIR_REC_LEN(1) + 1];
+  _Byte new_block[NAIVE_MAX_BLOCK_SIZE];
+  struct naive_dir_record *rec;
+  int i, off, count = 0, mid, lblock, new_no, err, total = 0, left = 0;
+
+  err = dx_make_room(fs, dir, frames, &n);
+  if (err)
+    return err;
+
+  memcpy(buf, leaf_block, fs->block_size);
+  rec = dir_at(buf, fs->dir_size);
+  rec->i_ino = ino;
+  rec->name_len = len;
+  rec->file_type = type;
+  memcpy(rec->filename, name, len);
+
+  for (off = 0; off < fs->dir_size; off += rec->rec_len) {
+    rec = dir_at(buf, off);
+    if (!dir_rec_ok(rec, off, fs->dir_size))
+      break;
+    if (rec->name_len == 0)
+      continue;
+    items[count].hash = naive_name_hash(rec->filename, rec->name_len);
+    items[count].off = off;
+    items[count].len = NAIVE_DIR_REC_LEN(rec->name_len);
+    total += items[count++].len;
+  }
+  items[count].hash = naive_name_hash(name, len);
+  items[count].off = fs->dir_size;
+  items[count].len = NAIVE_DIR_REC_LEN(len);
+  total += items[count++].len;
+  qsort(items, count, sizeof(struct dx_sort_item), dx_sort_cmp);
+
+  for (mid = 0; mid < count && left + items[mid].len <= total / 2; mid++)
+    left += items[mid].len;
+  if (mid == 0)
+    mid = 1;
+  i = mid;
+  while (mid < count && items[mid].hash == items[mid - 1].hash)
+    mid++;
+  if (mid == count) {
+    mid = i;
+    while (mid > 0 && items[mid].hash == items[mid - 1].hash)
+      mid--;
+  }
+  for (left = 0, i = 0; i < mid; i++)
+    left += items[i].len;
+  if (mid == 0 || left > fs->dir_size || total - left > fs->dir_size)
+    return -ENOSPC;
+
+  new_no = dir_append_block(fs, dir, &lblock, new_block);
+  if (new_no < 0)
+    return new_no;
+  dir_pack(leaf_block, fs->dir_size, buf, items, 0, mid);
+  dir_pack(new_block, fs->dir_size, buf, items, mid, count);
+  err = dir_bwrite(fs, leaf_no, leaf_block);
+  if (!err)
+    err = dir_bwrite(fs, new_no, new_block);
+  if (!err)
+    err = dx_insert(fs, &frames[n - 1], items[mid].hash, lblock);
+  return err;
+}
+
+static int dx_add_entry(struct naivefs *fs, struct naive_inode *dir,
+                        const char *name, int len, int ino,
+                        unsigned char type) {
+  struct dx_frame frames[NAIVE_DX_MAX_LEVELS + 1];
+  _Byte block[NAIVE_MAX_BLOCK_SIZE];
+  int n, leaf_no, err;
+
+  n = dx_probe(fs, dir, naive_name_hash(name, len), frames);
+  if (n < 0)
+    return n;
+  leaf_no = dir_bread(fs, dir, frames[n - 1].entries[frames[n - 1].at].block,
+                      block);
+  if (leaf_no < 0)
+    return leaf_no;
+  err = insert_in_block(block, fs->dir_size, name, len, ino, type);
+  if (err == -ENOSPC)
+    return dx_split_leaf(fs, dir, frames, n, block, leaf_no, name, len, ino,
+                         type);
+  if (err)
+    return err;
+  return dir_bwrite(fs, leaf_no, block);
+}
+
+// 内联目录放不下了，搬到新分配的第0块上，和内核的naive_dir_promote一样
+static int dir_promote(struct naivefs *fs, struct naive_inode *dir) {
+  _Byte block[NAIVE_MAX_BLOCK_SIZE];
+  char data[NAIVE_INLINE_DATA_LEN];
+  struct naive_dir_record *rec, *last = NULL;
+  int lblock, block_no, off;
+
+  memcpy(data, dir->inline_data, NAIVE_INLINE_DATA_LEN);
+  memset(dir->inline_data, 0, NAIVE_INLINE_DATA_LEN);
+  dir->flags &= ~NAIVE_INODE_FLAG_INLINE;
+  block_no = dir_append_block(fs, dir, &lblock, block);
+  if (block_no < 0) {
+    memcpy(dir->inline_data, data, NAIVE_INLINE_DATA_LEN);
+    dir->flags |= NAIVE_INODE_FLAG_INLINE;
+    return block_no;
+  }
+  memcpy(block, data, NAIVE_INLINE_DATA_LEN);
+  for (off = 0; off < NAIVE_INLINE_DATA_LEN; off += rec->rec_len) {
+    rec = dir_at(block, off);
+    if (!dir_rec_ok(rec, off, NAIVE_INLINE_DATA_LEN))
+      break;
+    last = rec;
+  }
+  if (last != NULL)
+    last->rec_len = fs->dir_size - ((_Byte *)last - block);
+  else
+    dir_at(block, 0)->rec_len = fs->dir_size;
+  return dir_bwrite(fs, block_no, block);
+}
+
+// 往目录中加一条目录项，dir的修改（extent表、项目数等）由调用者写回
+int naivefs_dir_add_entry(struct naivefs *fs, struct naive_inode *dir,
+                          const char *name, int len, int ino,
+                          unsigned char type) {
+  int err;
+
+  if (dir->flags & NAIVE_INODE_FLAG_INLINE) {
+    err = insert_in_block(dir->inline_data, NAIVE_INLINE_DATA_LEN, name, len,
+                          ino, type);
+    if (err == 0) {
+      dir->dir_children_count++;
+      return 0;
+    }
+    err = dir_promote(fs, dir);
+    if (err)
+      return err;
+  }
+
+  if (!(dir->flags & NAIVE_INODE_FLAG_DX)) {
+    _Byte block[NAIVE_MAX_BLOCK_SIZE];
+    int block_no = dir_bread(fs, dir, 0, block);
+    if (block_no < 0)
+      return block_no;
+    err = insert_in_block(block, fs->dir_size, name, len, ino, type);
+    if (err == 0) {
+      dir->dir_children_count++;
+      return dir_bwrite(fs, block_no, block);
+    }
+    err = dx_make_indexed(fs, dir);
+    if (err)
+      return err;
+  }
+
+  err = dx_add_entry(fs, dir, name, len, ino, type);
+  if (!err)
+    dir->dir_children_count++;
+  return err;
+}
+
+// 在目录里按名字找，返回inode号
+int naivefs_lookup(struct naivefs *fs, struct naive_inode *dir,
+                   const char *name, int len) {
+  struct naive_dir_record rec;
+  int err;
+  if (!S_ISDIR(dir->mode))
+    return -ENOTDIR;
+  if (len > NAIVE_MAX_FILENAME_LEN)
+    return -ENAMETOOLONG;
+  err = dir_find_entry(fs, dir, name, len, &rec);
+  return err ? err : rec.i_ino;
+}
+
+// 从根目录开始逐级解析绝对路径，返回inode号
+int naivefs_namei(struct naivefs *fs, const char *path) {
+  struct naive_inode dir;
+  int ino = NAIVE_ROOT_INODE_NO, len, err;
+  while (*path != '\0') {
+    while (*path == '/')
+      path++;
+    for (len = 0; path[len] != '\0' && path[len] != '/'; len++)
+      ;
+    if (len == 0)
+      break;
+    err = naivefs_read_inode(fs, ino, &dir);
+    if (err)
+      return err;
+    ino = naivefs_lookup(fs, &dir, path, len);
+    if (ino < 0)
+      return ino;
+    path += len;
+  }
+  return ino;
+}
+
+// readdir排序用的目录项，name指向块缓冲区里的文件名
+struct readdir_item {
+  unsigned int hash;
+  const char *name;
+  int len;
+  int ino;
+  unsigned char file_type;
+};
+
+// readdir给到哪里了：组（见dir_pos）和这一组里的第几条
+struct readdir_cursor {
+  unsigned int group;
+  int k;
+};
+
+// 目录项在readdir中的位置，和内核的naive_dir_pos一样
+static unsigned int dir_pos(unsigned int hash) {
+  hash >>= 1;
+  return hash < NAIVE_DIR_POS_EOF ? hash : NAIVE_DIR_POS_EOF - 1;
+}
+
+static int readdir_cmp(const void *a, const void *b) {
+  const struct readdir_item *x = a, *y = b;
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  if (x->len != y->len)
+    return x->len - y->len;
+  return memcmp(x->name, y->name, x->len);
+}
+
+// 把目录块（或内联目录）里位置不早于from的目录项收进items，和内核的naive_readdir_collect一样
+static int readdir_collect(void *block, int size, unsigned int from,
+                           struct readdir_item *items) {
+  struct naive_dir_record *rec;
+  int off, count = 0;
+  for (off = 0; off < size; off += rec->rec_len) {
+    unsigned int hash;
+    rec = dir_at(block, off);
+    if (!dir_rec_ok(rec, off, size))
+      break;
+    if (rec->name_len == 0)
+      continue;
+    if (rec->filename[0] == '.' &&
+        (rec->name_len == 1 || (rec->name_len == 2 && rec->filename[1] == '.')))
+      hash = 0;
+    else
+      hash = naive_name_hash(rec->filename, rec->name_len);
+    if (dir_pos(hash) < from)
+      continue;
+    items[count].hash = hash;
+    items[count].name = rec->filename;
+    items[count].len = rec->name_len;
+    items[count].ino = rec->i_ino;
+    items[count++].file_type = rec->file_type;
+  }
+  return count;
+}
+
+// 排好序依次交给filldir，组from的前skip条上次已经给出去了，跳过
+// 给filldir的位置是(组 << 32) | 组内序号，filldir返回非0时*pos记下没给出去的那一条
+static int readdir_emit(struct readdir_item *items, int count,
+                        unsigned int from, int skip, struct readdir_cursor *cur,
+                        long long *pos, naivefs_filldir_t filldir, void *ctx) {
+  int i;
+  qsort(items, count, sizeof(struct readdir_item), readdir_cmp);
+  for (i = 0; i < count; i++) {
+    unsigned int group = dir_pos(items[i].hash);
+    long long at;
+    if (group != cur->group) {
+      cur->group = group;
+      cur->k = 0;
+    }
+    if (group == from && cur->k < skip) {
+      cur->k++;
+      continue;
+    }
+    at = (long long)group << 32 | cur->k;
+    if (filldir(ctx, items[i].name, items[i].len, at, items[i].ino,
+                items[i].file_type)) {
+      *pos = at;
+      return 1;
+    }
+    cur->k++;
+  }
+  return 0;
+}
+
+// 遍历目录，和内核一样按散列值的顺序给出目录项，*pos的高32位是组（和内核的f_pos一样），低32位是组内序号
+// 遍历途中目录改了格式、叶子分裂了，已经给出去的目录项也不会再给一遍
+// filldir返回非0时停下，*pos指向没给出去的那一条，下次从那里接着读
+int naivefs_readdir(struct naivefs *fs, struct naive_inode *dir,
+                    long long *pos, naivefs_filldir_t filldir, void *ctx) {
+  _Byte block[NAIVE_MAX_BLOCK_SIZE];
+  struct readdir_item items[2 * (NAIVE_MAX_BLOCK_SIZE / NAIVE_DIR_REC_LEN(1) + 1)];
+  struct dx_frame frames[NAIVE_DX_MAX_LEVELS + 1];
+  unsigned int from = *pos >> 32, hash, next;
+  int skip = *pos & 0xffffffff;
+  struct readdir_cursor cur = {from, 0};
+  int n, count, leaf, first, more, err;
+
+  if (from >= NAIVE_DIR_POS_EOF)
+    return 0;
+  if (dir->flags & NAIVE_INODE_FLAG_INLINE) {
+    count = readdir_collect(dir->inline_data, NAIVE_INLINE_DATA_LEN, from,
+                            items);
+    if (readdir_emit(items, count, from, skip, &cur, pos, filldir, ctx))
+      return 0;
+  } else if (!(dir->flags & NAIVE_INODE_FLAG_DX)) {
+    // 线性目录只有第0块
+    if ((err = dir_bread(fs, dir, 0, block)) < 0)
+      return err;
+    count = readdir_collect(block, fs->dir_size, from, items);
+    if (readdir_emit(items, count, from, skip, &cur, pos, filldir, ctx))
+      return 0;
+  } else {
+    // 从from所在的叶子开始往散列值大的方向一个叶子一个叶子地走，.和..在第0块里，和第一个叶子一起排
+    hash = from << 1;
+    for (first = 1;; first = 0) {
+      n = dx_probe(fs, dir, hash, frames);
+      if (n < 0)
+        return n;
+      leaf = frames[n - 1].entries[frames[n - 1].at].block;
+      for (more = 0, n--; n >= 0 && !more; n--) {
+        if (frames[n].at + 1 < *frames[n].count) {
+          next = frames[n].entries[frames[n].at + 1].hash;
+          more = 1;
+        }
+      }
+      count = 0;
+      if (first && from == 0)
+        count = readdir_collect(frames[0].block, fs->dir_size, from, items);
+      if ((err = dir_bread(fs, dir, leaf, block)) < 0)
+        return err;
+      count += readdir_collect(block, fs->dir_size, from, items + count);
+      if (readdir_emit(items, count, from, skip, &cur, pos, filldir, ctx))
+        return 0;
+      if (!more)
+        break;
+      if (next <= hash)
+        return -EIO;
+      hash = next;
+    }
+  }
+  *pos = (long long)NAIVE_DIR_POS_EOF << 32;
+  return 0;
+}
+
+// 在目录dir_ino下新建文件或目录，返回新inode号，和内核的naive_mknod一样
+int naivefs_mknod(struct naivefs *fs, int dir_ino, const char *name, int len,
+                  int mode, int uid, int gid) {
+  struct naive_inode dir, ninode;
+  struct naive_dir_record *dots;
+  _Byte block[NAIVE_MAX_BLOCK_SIZE];
+  int ino, err, group, goal;
+
+  if (len > NAIVE_MAX_FILENAME_LEN)
+    return -ENAMETOOLONG;
+  if (!S_ISDIR(mode) && !S_ISREG(mode))
+    return -EINVAL;
+  err = naivefs_read_inode(fs, dir_ino, &dir);
+  if (err)
+    return err;
+  err = naivefs_lookup(fs, &dir, name, len);
+  if (err >= 0)
+    return -EEXIST;
+  if (err != -ENOENT)
+    return err;
+
+  // 和内核模块一样，文件放在所在目录的块组里；目录往后散开，
+  // 用户态没有各块组的空闲计数，就从所在目录的下一个块组找起
+  goal = -1;
+  if (fs->nsb.group_blocks != 0) {
+    group = dir_ino / fs->nsb.group_inodes;
+    if (S_ISDIR(mode))
+      group = (group + 1) % fs->nsb.imap_blocks;
+    goal = group * fs->nsb.group_inodes;
+  }
+  ino = naivefs_alloc_inode(fs, goal);
+  if (ino < 0)
+    return ino;
+  memset(&ninode, 0, NAIVE_INODE_SIZE);
+  ninode.i_ino = ino;
+  ninode.mode = mode;
+  ninode.i_uid = uid;
+  ninode.i_gid = gid;
+  ninode.i_nlink = 1;
+  ninode.i_atime = ninode.i_ctime = ninode.i_mtime = time(NULL);
+  // 新文件和新目录都先内联在inode里，不占块
+  ninode.flags = NAIVE_INODE_FLAG_INLINE;
+
+  if (S_ISDIR(mode)) {
+    // .和..是内联目录的头两条，..的rec_len延伸到内联区末尾
+    // 目录项结构体按最长文件名算，比内联区大，先在块缓冲里拼好再拷进去
+    ninode.i_nlink = 2;
+    ninode.dir_children_count = 2;
+    memset(block, 0, fs->block_size);
+    dots = dir_at(block, 0);
+    dots->i_ino = ino;
+    dots->rec_len = NAIVE_DIR_REC_LEN(1);
+    dots->name_len = 1;
+    dots->file_type = NAIVE_FT_DIR;
+    memcpy(dots->filename, ".", 1);
+    dots = dir_at(block, NAIVE_DIR_REC_LEN(1));
+    dots->i_ino = dir_ino;
+    dots->rec_len = NAIVE_INLINE_DATA_LEN - NAIVE_DIR_REC_LEN(1);
+    dots->name_len = 2;
+    dots->file_type = NAIVE_FT_DIR;
+    memcpy(dots->filename, "..", 2);
+    memcpy(ninode.inline_data, block, NAIVE_INLINE_DATA_LEN);
+  }
+  err = naivefs_write_inode(fs, &ninode);
+  if (err)
+    goto out_free;
+
+  err = naivefs_dir_add_entry(fs, &dir, name, len, ino,
+                              S_ISDIR(mode) ? NAIVE_FT_DIR : NAIVE_FT_REG_FILE);
+  dir.i_mtime = dir.i_ctime = time(NULL);
+  if (!err)
+    err = naivefs_write_inode(fs, &dir);
+  else
+    naivefs_write_inode(fs, &dir);
+  if (err)
+    goto out_free;
+  return ino;
+
+out_free:
+  naivefs_free_inode(fs, ino);
+  return err;
+}
+
+// ============ data ============
+
+// 内联文件要超出inode了，把数据搬到新分配的第0块上，同内核的naive_inline_promote
+static int file_promote(struct naivefs *fs, struct naive_inode *ninode) {
+  _Byte block[NAIVE_MAX_BLOCK_SIZE];
+  int block_no;
+
+  memset(block, 0, fs->block_size);
+  memcpy(block, ninode->inline_data, NAIVE_INLINE_DATA_LEN);
+  memset(ninode->inline_data, 0, NAIVE_INLINE_DATA_LEN);
+  ninode->flags &= ~NAIVE_INODE_FLAG_INLINE;
+  if (ninode->file_size == 0)
+    return 0;
+  block_no = naivefs_add_block(fs, ninode, 0);
+  if (block_no < 0) {
+    memcpy(ninode->inline_data, block, NAIVE_INLINE_DATA_LEN);
+    ninode->flags |= NAIVE_INODE_FLAG_INLINE;
+    return block_no;
+  }
+  return naivefs_write_block(fs, block_no, block);
+}
+
+// 从文件偏移off处读最多size字节，返回读到的字节数，空洞读出来是0
+int naivefs_read(struct naivefs *fs, struct naive_inode *ninode, void *buf,
+                 int size, long long off) {
+  _Byte block[NAIVE_MAX_BLOCK_SIZE];
+  int done = 0, err;
+  if (off >= ninode->file_size)
+    return 0;
+  if (off + size > ninode->file_size)
+    size = ninode->file_size - off;
+  if (ninode->flags & NAIVE_INODE_FLAG_INLINE) {
+    memcpy(buf, ninode->inline_data + off, size);
+    return size;
+  }
+
+  while (done < size) {
+    int file_block = (off + done) / fs->block_size;
+    int in_block = (off + done) % fs->block_size;
+    int n = fs->block_size - in_block, count = 1;
+    int block_no = naivefs_map_block(fs, ninode, file_block, &count);
+    if (block_no < 0)
+      return block_no;
+    if (n > size - done)
+      n = size - done;
+    if (block_no == 0) {
+      memset((char *)buf + done, 0, n);
+    } else if (in_block == 0 && size - done >= fs->block_size) {
+      // 整块对齐的部分，把同一extent里连续的块一次读进来
+      int blocks = (size - done) / fs->block_size;
+      if (blocks > count)
+        blocks = count;
+      n = blocks * fs->block_size;
+      if (pread(fs->fd, (char *)buf + done, n,
+                (off_t)block_no * fs->block_size) != n)
+        return -EIO;
+    } else {
+      err = naivefs_read_block(fs, block_no, block);
+      if (err)
+        return err;
+      memcpy((char *)buf + done, block + in_block, n);
+    }
+    done += n;
+  }
+  return done;
+}
+
+// 从文件偏移off处写size字节，没有映射的块现分配，文件变长时更新file_size
+// ninode的extent表和大小会变，这里顺便写回
+int naivefs_write(struct naivefs *fs, struct naive_inode *ninode,
+                  const void *buf, int size, long long off) {
+  _Byte block[NAIVE_MAX_BLOCK_SIZE];
+  int done = 0, err = 0;
+
+  if (ninode->flags & NAIVE_INODE_FLAG_INLINE) {
+    if (off + size <= NAIVE_INLINE_DATA_LEN) {
+      memcpy(ninode->inline_data + off, buf, size);
+      done = size;
+    } else {
+      err = file_promote(fs, ninode);
+      if (err)
+        return err;
+    }
+  }
+
+  while (done < size) {
+    int file_block = (off + done) / fs->block_size;
+    int in_block = (off + done) % fs->block_size;
+    int n = fs->block_size - in_block;
+    int block_no = naivefs_map_block(fs, ninode, file_block, NULL);
+    int fresh = 0;
+    if (block_no < 0) {
+      err = block_no;
+      break;
+    }
+    if (block_no == 0) {
+      block_no = naivefs_add_block(fs, ninode, file_block);
+      if (block_no < 0) {
+        err = block_no;
+        break;
+      }
+      fresh = 1;
+    }
+    if (n > size - done)
+      n = size - done;
+    if (n < fs->block_size) {
+      // 不满一块，读改写；新分配的块上是旧数据，要先清零
+      if (fresh)
+        memset(block, 0, fs->block_size);
+      else if ((err = naivefs_read_block(fs, block_no, block)) != 0)
+        break;
+      memcpy(block + in_block, (const char *)buf + done, n);
+      err = naivefs_write_block(fs, block_no, block);
+    } else {
+      err = naivefs_write_block(fs, block_no, (const char *)buf + done);
+    }
+    if (err)
+      break;
+    done += n;
+  }
+
+  if (off + done > ninode->file_size)
+    ninode->file_size = off + done;
+  ninode->i_mtime = ninode->i_ctime = time(NULL);
+  if (done > 0 || err == 0) {
+    int werr = naivefs_write_inode(fs, ninode);
+    if (werr)
+      return werr;
+  }
+  return done > 0 ? done : err;
+}
+
+// 把文件截成size字节，多出来的块还给位图，留下的最后一块中超出size的部分清零
+int naivefs_truncate(struct naivefs *fs, struct naive_inode *ninode,
+                     long long size) {
+  _Byte block[NAIVE_MAX_BLOCK_SIZE];
+  int keep = (size + fs->block_size - 1) / fs->block_size;
+  int err;
+  if (!S_ISREG(ninode->mode))
+    return -EISDIR;
+  if (ninode->flags & NAIVE_INODE_FLAG_INLINE) {
+    if (size <= NAIVE_INLINE_DATA_LEN) {
+      if (size < ninode->file_size)
+        memset(ninode->inline_data + size, 0, ninode->file_size - size);
+    } else if ((err = file_promote(fs, ninode)) != 0) {
+      return err;
+    }
+  } else if (size < ninode->file_size) {
+    int tail = size % fs->block_size;
+    int block_no = naivefs_map_block(fs, ninode, size / fs->block_size, NULL);
+    if (tail != 0 && block_no > 0) {
+      err = naivefs_read_block(fs, block_no, block);
+      if (err)
+        return err;
+      memset(block + tail, 0, fs->block_size - tail);
+      err = naivefs_write_block(fs, block_no, block);
+      if (err)
+        return err;
+    }
+    err = truncate_blocks(fs, ninode, keep);
+    if (err)
+      return err;
+  }
+  ninode->file_size = size;
+  ninode->i_mtime = ninode->i_ctime = time(NULL);
+  return naivefs_write_inode(fs, ninode);
+}
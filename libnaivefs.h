@@ -0,0 +1,78 @@
+// =================
+// libnaivefs.h
+// 用户态的naivefs镜像读写库
+// =================
+
+#ifndef LIBNAIVEFS_H_
+#define LIBNAIVEFS_H_
+
+#include "naivefs.h"
+
+// 一个打开的naivefs镜像
+// 和内核模块一样，超级块和两张位图在打开时读进内存，之后的分配都在内存里做，naivefs_sync时写回
+struct naivefs {
+  int fd;                       // 镜像文件
+  int writable;                 // 是否以读写方式打开
+  struct naive_super_block nsb; // 超级块
+  int block_size;               // 块大小，打开时从超级块取
+  int dir_size;                 // 目录块里目录项能用的字节数，带校验和时块尾留给假目录项
+  _Byte *bmap;                  // 整张块位图
+  _Byte *imap;                  // 整张inode位图
+  int bmap_hint;                // 下次从哪个块号开始找空闲块
+  int imap_hint;                // 下次从哪个inode号开始找空闲inode
+  int dirty;                    // 超级块或位图改过，还没写回
+};
+
+// readdir的回调，返回非0表示不要再给了（和内核的filldir一样）
+typedef int (*naivefs_filldir_t)(void *ctx, const char *name, int len,
+                                 long long pos, int ino, int file_type);
+
+// 以下函数出错时都返回负的errno
+
+// 镜像
+int naivefs_open(struct naivefs *fs, const char *path, int writable);
+int naivefs_sync(struct naivefs *fs);
+int naivefs_close(struct naivefs *fs);
+int naivefs_read_block(struct naivefs *fs, int block_no, void *buf);
+int naivefs_write_block(struct naivefs *fs, int block_no, const void *buf);
+
+// 日志，返回恢复了几个事务
+int naivefs_journal_recover(struct naivefs *fs);
+
+// 位图
+int naivefs_alloc_block(struct naivefs *fs, int goal);
+void naivefs_free_block(struct naivefs *fs, int block_no);
+int naivefs_alloc_inode(struct naivefs *fs, int goal);
+void naivefs_free_inode(struct naivefs *fs, int ino);
+int naivefs_free_blocks(struct naivefs *fs);
+int naivefs_free_inodes(struct naivefs *fs);
+
+// inode
+int naivefs_read_inode(struct naivefs *fs, int ino, struct naive_inode *ninode);
+int naivefs_write_inode(struct naivefs *fs, const struct naive_inode *ninode);
+int naivefs_map_block(struct naivefs *fs, struct naive_inode *ninode,
+                      int file_block, int *count);
+int naivefs_add_block(struct naivefs *fs, struct naive_inode *ninode,
+                      int file_block);
+
+// 目录
+int naivefs_lookup(struct naivefs *fs, struct naive_inode *dir,
+                   const char *name, int len);
+int naivefs_namei(struct naivefs *fs, const char *path);
+int naivefs_readdir(struct naivefs *fs, struct naive_inode *dir,
+                    long long *pos, naivefs_filldir_t filldir, void *ctx);
+int naivefs_dir_add_entry(struct naivefs *fs, struct naive_inode *dir,
+                          const char *name, int len, int ino,
+                          unsigned char type);
+int naivefs_mknod(struct naivefs *fs, int dir_ino, const char *name, int len,
+                  int mode, int uid, int gid);
+
+// 数据
+int naivefs_read(struct naivefs *fs, struct naive_inode *ninode, void *buf,
+                 int size, long long off);
+int naivefs_write(struct naivefs *fs, struct naive_inode *ninode,
+                  const void *buf, int size, long long off);
+int naivefs_truncate(struct naivefs *fs, struct naive_inode *ninode,
+                     long long size);
+
+#endif
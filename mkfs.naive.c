@@ -3,99 +3,1119 @@
 // naivefs格式化工具
 // =================
 
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/fs.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 
 #include "naivefs.h"
 
+// 大块写的对齐单位，同时满足O_DIRECT对缓冲区、偏移和长度的要求
+#define MKFS_ALIGN 4096
+// 不得不手动写0时，每次写多少
+#define MKFS_ZERO_CHUNK (1 << 20)
+// 拷贝文件内容时每次读写多少
+#define MKFS_COPY_CHUNK (1 << 20)
+
 static struct naive_super_block nsb;
-static _Byte *bmap;
-static _Byte *imap;
-static int disk_size;
-static int inode_table_size;
+static _Byte *bmap; // 各块组的块位图，一个块组一块，依次排着
+static _Byte *imap; // 各块组的inode位图
+static struct naive_journal_header journal_header;
+static long long disk_size;
+static int groups;           // 块组数
+static int inode_table_size; // 每个块组的inode表占几块
+static int block_size = NAIVE_DEFAULT_BLOCK_SIZE; // -b：块大小
+static int bytes_per_inode = NAIVE_BYTES_PER_INODE;
+static int journal_blocks = -1; // -J：日志区块数，-1表示按磁盘大小定，0表示不要日志
+static int use_direct_io = 0; // -D：用O_DIRECT写元数据
+static int keep_blocks = 0;   // -K：不discard/打洞，只清零必须为0的区域
+static int use_csum = 1;      // -C为0：元数据不带校验和
+static const char *source_dir = NULL; // -d：把这个目录树拷进镜像
+static int nthreads = 0;      // -j：拷贝文件内容的线程数
+static int is_blockdev = 0;
+static int data_fd = -1;      // 写文件内容用，-D时另开一个不带O_DIRECT的
+
+// 位图置1，位序与内核中的ext2_set_bit一致
+static void mark_used(_Byte *map, int nr) { map[nr / 8] |= 1 << (nr % 8); }
+
+static long long align_down(long long x) { return x / MKFS_ALIGN * MKFS_ALIGN; }
+static long long align_up(long long x) { return align_down(x + MKFS_ALIGN - 1); }
+
+static double elapsed_ms(struct timespec *from) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - from->tv_sec) * 1e3 +
+         (now.tv_nsec - from->tv_nsec) / 1e6;
+}
+
+// 把盘上偏移obj_off处长obj_len的结构，与缓冲区buf所代表的[start, start+len)相交的部分拷进去
+static void overlay(_Byte *buf, long long start, long long len,
+                    long long obj_off, const void *obj, long long obj_len) {
+  long long lo = obj_off > start ? obj_off : start;
+  long long hi = obj_off + obj_len < start + len ? obj_off + obj_len : start + len;
+  if (lo < hi)
+    memcpy(buf + (lo - start), (const _Byte *)obj + (lo - obj_off), hi - lo);
+}
+
+// 块组g的第一块
+static long long group_start(int g) {
+  return nsb.bmap_block_no + (long long)g * nsb.group_blocks;
+}
+
+// 从目录树建镜像（-d），不带-d时就是只有根目录的树
+// 新盘上的分配都是从前往后顺着来的，不用查位图：每个块组的inode从第0个起依次用，
+// 目录块紧接着inode表排成一段，文件内容在目录块之后。inode表和目录块都在内存里拼好，
+// 和位图一起用几次大的pwrite写下去；文件内容由几个线程并行地从源文件拷到各自的extent上
+
+// 每个块组在内存里的inode表和目录块
+struct mkfs_group {
+  _Byte *itable;  // 整个块组的inode表，用到了才分配
+  int inodes;     // 用掉了前几个inode
+  _Byte *dirs;    // 数据区开头连续的目录块
+  int dir_blocks; // 目录块数
+  int dir_cap;    // dirs能放几块
+  int next_block; // 下一个空闲块在块组内的偏移
+  int end_block;  // 块组内能分配到哪为止（不含）
+};
+
+// 源目录树里的一项，按层序排在nodes里，目录的子项连续地排在一起
+struct mkfs_node {
+  char *path;       // 源路径
+  const char *name; // 镜像里的名字，指向path的最后一级
+  int len;
+  struct stat st;
+  int ino;          // 镜像里的inode号
+  int parent;       // 所在目录在nodes里的下标，根目录是它自己
+  int first, count; // 目录：子项在nodes里的范围
+  _Byte *eblock;    // 文件：超过NAIVE_INLINE_EXTENTS个extent时的间接extent块，链上的各块依次放在一起
+  int *eblock_no;   // 链上各块的块号
+  int eblocks;      // 链上有几块
+};
+
+// 目录里的一条目录项
+struct mkfs_dirent {
+  int ino;
+  unsigned char type;
+  const char *name;
+  int len;
+  unsigned int hash;
+};
+
+static struct mkfs_group *group_info;
+static struct mkfs_node *nodes;
+static int node_count, node_cap;
+static int next_job;          // 拷贝线程下一个要拷的nodes下标
+static int copy_failed;       // 有线程拷贝失败了
+static long long copied_bytes;
+
+static int itable_blocks(struct mkfs_group *grp) {
+  int per_block = NAIVE_INODES_PER_BLOCK(block_size);
+  return (grp->inodes + per_block - 1) / per_block;
+}
+
+// 块组g的数据区的第一块
+static long long group_data(int g) {
+  return group_start(g) + 2 + inode_table_size;
+}
+
+static struct naive_inode *inode_slot(int ino) {
+  struct mkfs_group *grp = &group_info[ino / nsb.group_inodes];
+  long long idx = ino % nsb.group_inodes;
+  return (struct naive_inode *)(grp->itable + idx * NAIVE_INODE_SIZE);
+}
+
+// 目录块都在所属块组的dirs里
+static _Byte *dir_block_at(int block_no) {
+  int g = (int)((block_no - nsb.bmap_block_no) / nsb.group_blocks);
+  return group_info[g].dirs + (block_no - group_data(g)) * block_size;
+}
+
+// 从块组goal起找一个还有空闲inode的块组，返回inode号
+static int alloc_inode(int goal) {
+  int i;
+  for (i = 0; i < groups; i++) {
+    int g = (goal + i) % groups;
+    struct mkfs_group *grp = &group_info[g];
+    if (grp->inodes == nsb.group_inodes)
+      continue;
+    if (grp->itable == NULL &&
+        (grp->itable = calloc(inode_table_size, block_size)) == NULL)
+      return -ENOMEM;
+    mark_used(imap + (long long)g * block_size, grp->inodes);
+    return g * nsb.group_inodes + grp->inodes++;
+  }
+  return -ENOSPC;
+}
+
+// 从块组goal起分配最多want个连续的块，起点放在*start，返回分到了几块
+static int alloc_blocks(int goal, int want, int *start) {
+  int i, k;
+  for (i = 0; i < groups; i++) {
+    int g = (goal + i) % groups;
+    struct mkfs_group *grp = &group_info[g];
+    int n = grp->end_block - grp->next_block;
+    if (n <= 0)
+      continue;
+    if (n > want)
+      n = want;
+    *start = (int)group_start(g) + grp->next_block;
+    for (k = 0; k < n; k++)
+      mark_used(bmap + (long long)g * block_size, grp->next_block + k);
+    grp->next_block += n;
+    return n;
+  }
+  return -ENOSPC;
+}
+
+// 文件extent表的第i项：前NAIVE_INLINE_EXTENTS项在inode里，其余的在node->eblock里链上的第几块
+static struct naive_extent *file_extent(struct mkfs_node *node,
+                                        struct naive_inode *ninode, int i) {
+  int per = NAIVE_EXTENTS_PER_BLOCK(block_size), k = i - NAIVE_INLINE_EXTENTS;
+  _Byte *eblock = node->eblock + (long long)(k / per) * block_size;
+  if (i < NAIVE_INLINE_EXTENTS)
+    return &ninode->extents[i];
+  return (struct naive_extent *)eblock + k % per;
+}
+
+// 给inode分配blocks块，记进extent表；目录块在这一步就放进dirs，并初始化成空的目录块
+static int alloc_extents(struct mkfs_node *node, struct naive_inode *ninode,
+                         int goal, int blocks) {
+  int is_dir = S_ISDIR(node->st.st_mode);
+  int per = NAIVE_EXTENTS_PER_BLOCK(block_size);
+  struct naive_extent *ext;
+  int start, n, k;
+  while (ninode->block_count < blocks) {
+    n = alloc_blocks(goal, blocks - ninode->block_count, &start);
+    if (n < 0)
+      return n;
+    goal = (int)((start - nsb.bmap_block_no) / nsb.group_blocks);
+    if (is_dir) {
+      struct mkfs_group *grp = &group_info[goal];
+      if (grp->dir_blocks + n > grp->dir_cap) {
+        int cap = grp->dir_cap ? grp->dir_cap : 16;
+        _Byte *dirs;
+        while (cap < grp->dir_blocks + n)
+          cap *= 2;
+        dirs = realloc(grp->dirs, (long long)cap * block_size);
+        if (dirs == NULL)
+          return -ENOMEM;
+        grp->dirs = dirs;
+        grp->dir_cap = cap;
+      }
+      grp->dir_blocks += n;
+      for (k = 0; k < n; k++) {
+        _Byte *block = dir_block_at(start + k);
+        memset(block, 0, block_size);
+        if (use_csum) {
+          struct naive_dir_tail *tail =
+              (struct naive_dir_tail *)(block + naive_dir_block_size(&nsb));
+          tail->rec_len = NAIVE_DIR_TAIL_SIZE;
+          tail->file_type = NAIVE_FT_CSUM;
+        }
+      }
+    }
+    // 目录的块都在一段里，跨了几个块组也不会多于inode里的extent，只有文件要间接extent块
+    // 文件每跨一个块组多一个extent，间接extent块装满了就再接一块（NAIVE_FEATURE_EXTENT_CHAIN）
+    if (is_dir && ninode->extent_count == NAIVE_INLINE_EXTENTS)
+      return -EFBIG;
+    k = ninode->extent_count - NAIVE_INLINE_EXTENTS;
+    if (k >= 0 && k % per == 0) {
+      int b = node->eblocks;
+      _Byte *eblock = realloc(node->eblock, (long long)(b + 1) * block_size);
+      int *eblock_no = realloc(node->eblock_no, (b + 1) * sizeof(int));
+      if (eblock != NULL)
+        node->eblock = eblock;
+      if (eblock_no != NULL)
+        node->eblock_no = eblock_no;
+      if (eblock == NULL || eblock_no == NULL)
+        return -ENOMEM;
+      if (alloc_blocks(goal, 1, &node->eblock_no[b]) < 0)
+        return -ENOSPC;
+      memset(node->eblock + (long long)b * block_size, 0, block_size);
+      if (b == 0)
+        ninode->extent_block = node->eblock_no[0];
+      else
+        NAIVE_EXTENT_NEXT(node->eblock + (long long)(b - 1) * block_size,
+                          block_size) = node->eblock_no[b];
+      node->eblocks++;
+    }
+    ext = file_extent(node, ninode, ninode->extent_count);
+    ext->file_block = ninode->block_count;
+    ext->start = start;
+    ext->len = n;
+    ninode->extent_count++;
+    ninode->block_count += n;
+  }
+  return 0;
+}
+
+// 目录的第lblock块；目录的extent都在inode里
+static _Byte *dir_lblock(struct naive_inode *ninode, int lblock) {
+  int i;
+  for (i = 0; i < ninode->extent_count; i++) {
+    struct naive_extent *ext = &ninode->extents[i];
+    if (lblock < ext->file_block + ext->len)
+      return dir_block_at(ext->start + (lblock - ext->file_block));
+  }
+  return NULL;
+}
+
+// 把items[from, to)紧凑地排进size字节的block，最后一条的rec_len延伸到末尾
+static void pack_dirents(_Byte *block, int size, struct mkfs_dirent *items,
+                         int from, int to) {
+  struct naive_dir_record *rec = NULL;
+  int off = 0, i;
+  for (i = from; i < to; i++) {
+    rec = (struct naive_dir_record *)(block + off);
+    rec->i_ino = items[i].ino;
+    rec->rec_len = NAIVE_DIR_REC_LEN(items[i].len);
+    rec->name_len = items[i].len;
+    rec->file_type = items[i].type;
+    memcpy(rec->filename, items[i].name, items[i].len);
+    off += rec->rec_len;
+  }
+  rec->rec_len += size - off;
+}
+
+static int dirent_cmp(const void *a, const void *b) {
+  const struct mkfs_dirent *x = a, *y = b;
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  if (x->len != y->len)
+    return x->len - y->len;
+  return memcmp(x->name, y->name, x->len);
+}
+
+// 大目录直接建成带索引的格式：按散列值排序后依次装满叶子，散列值相同的不拆到两个叶子里；
+// 叶子比根能放的索引项多时，中间加索引节点，一层不够就再加一层，最多NAIVE_DX_MAX_LEVELS层
+static int build_dx(struct mkfs_node *dir, struct naive_inode *ninode,
+                    struct mkfs_dirent *items, int n) {
+  int size = naive_dir_block_size(&nsb);
+  int root_limit = NAIVE_DX_ROOT_LIMIT(size);
+  int node_limit = NAIVE_DX_NODE_LIMIT(size);
+  int *leaf_first = malloc((n + 1) * sizeof(int));
+  // 第l层（第0层是叶子）有几块、每块管几个叶子、第一块的逻辑块号
+  int width[NAIVE_DX_MAX_LEVELS + 1], span[NAIVE_DX_MAX_LEVELS + 1];
+  int base[NAIVE_DX_MAX_LEVELS + 1];
+  int leaves = 0, levels = 0, blocks, first = 2, used = 0, i, k, l, err;
+  struct naive_dx_root *root;
+
+  if (leaf_first == NULL)
+    return -ENOMEM;
+  qsort(items + 2, n - 2, sizeof(struct mkfs_dirent), dirent_cmp);
+  for (i = 2; i < n; i++) {
+    int len = NAIVE_DIR_REC_LEN(items[i].len);
+    if (i > first && used + len > size) {
+      int cut = i;
+      while (cut > first && items[cut].hash == items[cut - 1].hash)
+        cut--;
+      if (cut == first) {
+        free(leaf_first);
+        return -EFBIG;
+      }
+      leaf_first[leaves++] = first;
+      for (first = cut, used = 0, k = cut; k < i; k++)
+        used += NAIVE_DIR_REC_LEN(items[k].len);
+    }
+    used += len;
+  }
+  leaf_first[leaves++] = first;
+  leaf_first[leaves] = n;
+  width[0] = leaves;
+  span[0] = 1;
+  while (width[levels] > root_limit) {
+    if (levels == NAIVE_DX_MAX_LEVELS) {
+      free(leaf_first);
+      return -EFBIG;
+    }
+    levels++;
+    width[levels] = (width[levels - 1] + node_limit - 1) / node_limit;
+    span[levels] = span[levels - 1] * node_limit;
+  }
+  // 第0块是根，后面从上往下依次是各层索引节点，最后是叶子
+  for (blocks = 1, l = levels; l >= 0; l--) {
+    base[l] = blocks;
+    blocks += width[l];
+  }
+  err = alloc_extents(dir, ninode, ninode->i_ino / nsb.group_inodes, blocks);
+  if (err) {
+    free(leaf_first);
+    return err;
+  }
+
+  // 第0块：.和..，..的rec_len延伸到块尾，索引根藏在它后面
+  root = (struct naive_dx_root *)dir_lblock(ninode, 0);
+  pack_dirents((_Byte *)root, size, items, 0, 2);
+  root->levels = levels;
+  root->limit = root_limit;
+  root->count = width[levels];
+  for (i = 0; i < root->count; i++) {
+    root->entries[i].hash =
+        i == 0 ? 0 : items[leaf_first[i * span[levels]]].hash;
+    root->entries[i].block = base[levels] + i;
+  }
+  // 第l层的第i块管着第l-1层的第i*node_limit块起的node_limit块
+  for (l = levels; l >= 1; l--) {
+    for (i = 0; i < width[l]; i++) {
+      struct naive_dx_node *node =
+          (struct naive_dx_node *)dir_lblock(ninode, base[l] + i);
+      node->fake.rec_len = size;
+      node->limit = node_limit;
+      node->count = 0;
+      for (k = i * node_limit; k < width[l - 1] && k < (i + 1) * node_limit;
+           k++) {
+        node->entries[node->count].hash = items[leaf_first[k * span[l - 1]]].hash;
+        node->entries[node->count++].block = base[l - 1] + k;
+      }
+    }
+  }
+  for (k = 0; k < leaves; k++)
+    pack_dirents(dir_lblock(ninode, base[0] + k), size, items, leaf_first[k],
+                 leaf_first[k + 1]);
+  ninode->flags = NAIVE_INODE_FLAG_DX;
+  free(leaf_first);
+  return 0;
+}
+
+// 属主、权限和时间照搬源文件
+static void fill_inode(struct mkfs_node *node, struct naive_inode *ninode) {
+  ninode->i_ino = node->ino;
+  ninode->mode = (S_ISDIR(node->st.st_mode) ? S_IFDIR : S_IFREG) |
+                 (node->st.st_mode & 07777);
+  ninode->i_uid = node->st.st_uid;
+  ninode->i_gid = node->st.st_gid;
+  ninode->i_atime = node->st.st_atime;
+  ninode->i_mtime = node->st.st_mtime;
+  ninode->i_ctime = node->st.st_ctime;
+}
+
+// 给目录的子项分配inode，再拼好目录的内容：放得进inode的内联，一块放得下的是线性目录，再多就建索引
+// 和内核模块一样，文件的inode放在所在目录的块组里，子目录放到下一个块组
+static int build_dir(struct mkfs_node *dir, int parent_ino) {
+  struct naive_inode *ninode = inode_slot(dir->ino);
+  int group = dir->ino / nsb.group_inodes;
+  int n = dir->count + 2, bytes = 0, i, err = 0;
+  struct mkfs_dirent *items = malloc(n * sizeof(struct mkfs_dirent));
+
+  if (items == NULL)
+    return -ENOMEM;
+  items[0] = (struct mkfs_dirent){dir->ino, NAIVE_FT_DIR, ".", 1, 0};
+  items[1] = (struct mkfs_dirent){parent_ino, NAIVE_FT_DIR, "..", 2, 0};
+  for (i = 0; i < dir->count; i++) {
+    struct mkfs_node *child = &nodes[dir->first + i];
+    int is_dir = S_ISDIR(child->st.st_mode);
+    child->ino = alloc_inode(is_dir ? (group + 1) % groups : group);
+    if (child->ino < 0) {
+      err = child->ino;
+      goto out;
+    }
+    items[2 + i] = (struct mkfs_dirent){
+        child->ino, is_dir ? NAIVE_FT_DIR : NAIVE_FT_REG_FILE, child->name,
+        child->len, naive_name_hash(child->name, child->len)};
+  }
+  for (i = 0; i < n; i++)
+    bytes += NAIVE_DIR_REC_LEN(items[i].len);
+
+  fill_inode(dir, ninode);
+  ninode->i_nlink = 2;
+  ninode->dir_children_count = n;
+  if (bytes <= NAIVE_INLINE_DATA_LEN) {
+    ninode->flags = NAIVE_INODE_FLAG_INLINE;
+    pack_dirents((_Byte *)ninode->inline_data, NAIVE_INLINE_DATA_LEN, items, 0,
+                 n);
+  } else if (bytes <= naive_dir_block_size(&nsb)) {
+    err = alloc_extents(dir, ninode, group, 1);
+    if (!err)
+      pack_dirents(dir_lblock(ninode, 0), naive_dir_block_size(&nsb), items, 0,
+                   n);
+  } else {
+    err = build_dx(dir, ninode, items, n);
+  }
+out:
+  free(items);
+  return err;
+}
+
+// 文件的块在inode所在的块组里连续地分配，内容由拷贝线程填；不超过内联长度的直接放进inode
+static int build_file(struct mkfs_node *file) {
+  struct naive_inode *ninode = inode_slot(file->ino);
+  long long blocks = (file->st.st_size + block_size - 1) / block_size;
+  fill_inode(file, ninode);
+  ninode->i_nlink = 1;
+  ninode->file_size = file->st.st_size;
+  if (file->st.st_size <= NAIVE_INLINE_DATA_LEN) {
+    ninode->flags = NAIVE_INODE_FLAG_INLINE;
+    return 0;
+  }
+  if (blocks > nsb.block_total)
+    return -ENOSPC;
+  return alloc_extents(file, ninode, file->ino / nsb.group_inodes, (int)blocks);
+}
+
+static int add_node(char *path) {
+  struct mkfs_node *node;
+  if (node_count == node_cap) {
+    int cap = node_cap ? node_cap * 2 : 1024;
+    struct mkfs_node *grown = realloc(nodes, cap * sizeof(struct mkfs_node));
+    if (grown == NULL)
+      return -ENOMEM;
+    nodes = grown;
+    node_cap = cap;
+  }
+  node = &nodes[node_count];
+  memset(node, 0, sizeof(struct mkfs_node));
+  node->path = path;
+  node->name = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+  node->len = strlen(node->name);
+  if (lstat(path, &node->st) != 0)
+    return -errno;
+  return node_count++;
+}
+
+static int node_cmp(const void *a, const void *b) {
+  return strcmp(((const struct mkfs_node *)a)->name,
+                ((const struct mkfs_node *)b)->name);
+}
+
+// 层序扫描源目录树，每个目录的子项按名字排好，同样的目录树每次生成的镜像都一样
+// 只支持普通文件和目录，其余的跳过；硬链接按各自独立的文件拷
+static int scan_tree(void) {
+  int i, err;
+  if (source_dir == NULL) {
+    // 没有-d时只有一个空的根目录，属主是运行mkfs的用户
+    err = add_node(strdup("/"));
+    if (err < 0)
+      return err;
+    memset(&nodes[0].st, 0, sizeof(struct stat));
+    nodes[0].st.st_mode = S_IFDIR;
+    nodes[0].st.st_uid = getuid();
+    nodes[0].st.st_gid = getgid();
+    nodes[0].st.st_atime = nodes[0].st.st_mtime = nodes[0].st.st_ctime =
+        time(NULL);
+    return 0;
+  }
+  err = add_node(strdup(source_dir));
+  if (err < 0 || !S_ISDIR(nodes[0].st.st_mode)) {
+    printf("[mkfs_naive] %s is not a directory.\n", source_dir);
+    return -1;
+  }
+  for (i = 0; i < node_count; i++) {
+    struct dirent *de;
+    DIR *d;
+    if (!S_ISDIR(nodes[i].st.st_mode))
+      continue;
+    d = opendir(nodes[i].path);
+    if (d == NULL) {
+      printf("[mkfs_naive] Cannot read %s: %s.\n", nodes[i].path,
+             strerror(errno));
+      return -1;
+    }
+    nodes[i].first = node_count;
+    while ((de = readdir(d)) != NULL) {
+      char *path;
+      if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+        continue;
+      if (asprintf(&path, "%s/%s", nodes[i].path, de->d_name) < 0) {
+        closedir(d);
+        return -1;
+      }
+      err = add_node(path);
+      if (err >= 0)
+        nodes[err].parent = i;
+      if (err >= 0 && nodes[err].len > NAIVE_MAX_FILENAME_LEN)
+        err = -ENAMETOOLONG;
+      if (err >= 0 && !S_ISREG(nodes[err].st.st_mode) &&
+          !S_ISDIR(nodes[err].st.st_mode)) {
+        printf("[mkfs_naive] Skipping %s: only regular files and directories "
+               "are supported.\n",
+               path);
+        node_count--;
+        free(path);
+        continue;
+      }
+      if (err < 0) {
+        printf("[mkfs_naive] Cannot add %s: %s.\n", path, strerror(-err));
+        closedir(d);
+        return -1;
+      }
+    }
+    closedir(d);
+    nodes[i].count = node_count - nodes[i].first;
+    qsort(nodes + nodes[i].first, nodes[i].count, sizeof(struct mkfs_node),
+          node_cmp);
+  }
+  return 0;
+}
+
+// 先给所有目录分配inode和目录块，目录块就挤在各块组inode表后面；
+// 再把各块组剩下的空间对齐到MKFS_ALIGN，给文件内容用，这样写元数据的大块不会盖到文件内容
+static int build_tree(void) {
+  int i, g, err;
+  group_info = calloc(groups, sizeof(struct mkfs_group));
+  if (group_info == NULL)
+    return -ENOMEM;
+  for (g = 0; g < groups; g++) {
+    group_info[g].next_block = 2 + inode_table_size;
+    group_info[g].end_block = nsb.block_total - group_start(g) < nsb.group_blocks
+                                  ? (int)(nsb.block_total - group_start(g))
+                                  : nsb.group_blocks;
+  }
+  if (scan_tree() != 0)
+    return -1;
+  nodes[0].ino = alloc_inode(0); // 根inode是块组0的第0个inode
+  for (i = 0; i < node_count; i++) {
+    if (!S_ISDIR(nodes[i].st.st_mode))
+      continue;
+    err = build_dir(&nodes[i], nodes[nodes[i].parent].ino);
+    if (err) {
+      printf("[mkfs_naive] Cannot add %s: %s.\n", nodes[i].path,
+             strerror(-err));
+      return -1;
+    }
+  }
+
+  for (g = 0; g < groups; g++) {
+    struct mkfs_group *grp = &group_info[g];
+    long long first = align_up((group_start(g) + grp->next_block) * block_size);
+    long long last = g + 1 < groups
+                         ? align_down(group_start(g + 1) * block_size)
+                         : (long long)nsb.block_total * block_size;
+    grp->next_block = (int)(first / block_size - group_start(g));
+    if (last / block_size - group_start(g) < grp->end_block)
+      grp->end_block = (int)(last / block_size - group_start(g));
+  }
+  for (i = 0; i < node_count; i++) {
+    if (!S_ISREG(nodes[i].st.st_mode))
+      continue;
+    err = build_file(&nodes[i]);
+    if (err) {
+      printf("[mkfs_naive] Cannot add %s: %s.\n", nodes[i].path,
+             strerror(-err));
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// 读满len字节，读到文件尾就补0（源文件在扫描之后变短了也照样按扫描时的大小放）
+static int read_full(int fd, _Byte *buf, long long len, long long off) {
+  long long done = 0;
+  while (done < len) {
+    ssize_t n = pread(fd, buf + done, len - done, off + done);
+    if (n < 0)
+      return -errno;
+    if (n == 0)
+      break;
+    done += n;
+  }
+  memset(buf + done, 0, len - done);
+  return 0;
+}
+
+static int write_full(int fd, const _Byte *buf, long long len, long long off) {
+  long long done = 0;
+  while (done < len) {
+    ssize_t n = pwrite(fd, buf + done, len - done, off + done);
+    if (n <= 0)
+      return n < 0 ? -errno : -EIO;
+    done += n;
+  }
+  return 0;
+}
+
+// 把一个源文件的内容拷到它的extent上；内联的读进inode表
+static int copy_file(struct mkfs_node *file, _Byte *buf) {
+  struct naive_inode *ninode = inode_slot(file->ino);
+  int fd, i, err = 0;
+  if (file->st.st_size == 0)
+    return 0;
+  fd = open(file->path, O_RDONLY);
+  if (fd < 0)
+    return -errno;
+  if (ninode->flags & NAIVE_INODE_FLAG_INLINE) {
+    err = read_full(fd, (_Byte *)ninode->inline_data, file->st.st_size, 0);
+    close(fd);
+    return err;
+  }
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  for (i = 0; i < ninode->extent_count && !err; i++) {
+    struct naive_extent *ext = file_extent(file, ninode, i);
+    long long off, len = (long long)ext->len * block_size;
+    for (off = 0; off < len && !err; off += MKFS_COPY_CHUNK) {
+      long long n = len - off < MKFS_COPY_CHUNK ? len - off : MKFS_COPY_CHUNK;
+      err = read_full(fd, buf, n, (long long)ext->file_block * block_size + off);
+      if (!err)
+        err = write_full(data_fd, buf, n,
+                         (long long)ext->start * block_size + off);
+    }
+  }
+  close(fd);
+  if (!err)
+    __atomic_add_fetch(&copied_bytes, file->st.st_size, __ATOMIC_RELAXED);
+  return err;
+}
+
+// 拷贝线程：按nodes的顺序（也就是分配的顺序）领文件，几个线程一起写，盘上大致是顺序推进的
+static void *copy_worker(void *arg) {
+  _Byte *buf;
+  int i, err;
+  if (posix_memalign((void **)&buf, MKFS_ALIGN, MKFS_COPY_CHUNK) != 0) {
+    __atomic_store_n(&copy_failed, 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+  while (!__atomic_load_n(&copy_failed, __ATOMIC_RELAXED) &&
+         (i = __atomic_fetch_add(&next_job, 1, __ATOMIC_RELAXED)) < node_count) {
+    if (!S_ISREG(nodes[i].st.st_mode))
+      continue;
+    err = copy_file(&nodes[i], buf);
+    if (err) {
+      printf("[mkfs_naive] Cannot copy %s: %s.\n", nodes[i].path,
+             strerror(-err));
+      __atomic_store_n(&copy_failed, 1, __ATOMIC_RELAXED);
+    }
+  }
+  free(buf);
+  return NULL;
+}
+
+static int copy_files(void) {
+  pthread_t *tids = calloc(nthreads, sizeof(pthread_t));
+  int i, k, files = 0, started = 0;
+  if (tids == NULL)
+    return -1;
+  for (i = 0; i < nthreads; i++)
+    if (pthread_create(&tids[i], NULL, copy_worker, NULL) == 0)
+      started++;
+  if (started == 0)
+    copy_worker(NULL);
+  for (i = 0; i < started; i++)
+    pthread_join(tids[i], NULL);
+  free(tids);
+  if (copy_failed)
+    return -1;
+  // 间接extent块很少，各自写一下
+  for (i = 0; i < node_count; i++) {
+    for (k = 0; k < nodes[i].eblocks; k++)
+      if (write_full(data_fd, nodes[i].eblock + (long long)k * block_size,
+                     block_size,
+                     (long long)nodes[i].eblock_no[k] * block_size) != 0) {
+        printf("[mkfs_naive] Write failed at block %d.\n",
+               nodes[i].eblock_no[k]);
+        return -1;
+      }
+    files += S_ISREG(nodes[i].st.st_mode);
+  }
+  printf("[mkfs_naive] Copied %d files, %d directories, %lld bytes from %s.\n",
+         files, node_count - files, copied_bytes, source_dir);
+  return 0;
+}
+
+// 内容都填好了，最后算各处的校验和
+static void seal_metadata(void) {
+  int g, i;
+  for (g = 0; g < groups && use_csum; g++) {
+    struct mkfs_group *grp = &group_info[g];
+    _Byte *gbmap = bmap + (long long)g * block_size;
+    _Byte *gimap = imap + (long long)g * block_size;
+    for (i = 0; i < grp->inodes; i++) {
+      struct naive_inode *ninode = inode_slot(g * nsb.group_inodes + i);
+      ninode->checksum = naive_inode_csum(ninode);
+    }
+    for (i = 0; i < grp->dir_blocks; i++) {
+      int block_no = (int)group_data(g) + i;
+      *naive_block_csum_at(dir_block_at(block_no), block_size) =
+          naive_block_csum(block_no, dir_block_at(block_no), block_size);
+    }
+    *naive_block_csum_at(gbmap, block_size) =
+        naive_block_csum((int)group_start(g), gbmap, block_size);
+    *naive_block_csum_at(gimap, block_size) =
+        naive_block_csum((int)group_start(g) + 1, gimap, block_size);
+  }
+  if (use_csum)
+    nsb.checksum = naive_super_csum(&nsb);
+}
+
+// 生成格式化后盘上[start, start+len)的内容：除了下面几样结构和文件内容，其余都是0
+static void render(_Byte *buf, long long start, long long len) {
+  int g;
+  memset(buf, 0, len);
+  overlay(buf, start, len, NAIVE_SUPER_BLOCK_OFFSET, &nsb,
+          NAIVE_SUPER_BLOCK_SIZE);
+  // 只看和这一段相交的块组
+  g = (int)((start / block_size - nsb.bmap_block_no) / nsb.group_blocks);
+  for (g = g > 0 ? g : 0;
+       g < groups && group_start(g) * block_size < start + len; g++) {
+    overlay(buf, start, len, group_start(g) * block_size,
+            bmap + (long long)g * block_size, block_size);
+    overlay(buf, start, len, (group_start(g) + 1) * block_size,
+            imap + (long long)g * block_size, block_size);
+    // inode表只有用到的前几块，数据区开头是连续的目录块
+    overlay(buf, start, len, (group_start(g) + 2) * block_size,
+            group_info[g].itable,
+            (long long)itable_blocks(&group_info[g]) * block_size);
+    overlay(buf, start, len, group_data(g) * block_size, group_info[g].dirs,
+            (long long)group_info[g].dir_blocks * block_size);
+  }
+  if (nsb.journal_blocks > 0)
+    overlay(buf, start, len, (long long)nsb.journal_block_no * block_size,
+            &journal_header, sizeof(journal_header));
+}
+
+// 在内存里生成[start, end)的内容，用一次pwrite写下去
+static int write_region(int fd, long long start, long long end) {
+  _Byte *buf;
+  long long len = end - start, done = 0;
+  if (posix_memalign((void **)&buf, MKFS_ALIGN, align_up(len)) != 0) {
+    printf("[mkfs_naive] Out of memory.\n");
+    return -1;
+  }
+  render(buf, start, len);
+  while (done < len) {
+    ssize_t n = pwrite(fd, buf + done, len - done, start + done);
+    if (n <= 0) {
+      printf("[mkfs_naive] Write failed at offset %lld: %s.\n", start + done,
+             n < 0 ? strerror(errno) : "short write");
+      free(buf);
+      return -1;
+    }
+    done += n;
+  }
+  free(buf);
+  return 0;
+}
+
+// 把[start, end)写成0，只在设备不能替我们清零时才用
+static int write_zeros(int fd, long long start, long long end) {
+  _Byte *zero;
+  if (posix_memalign((void **)&zero, MKFS_ALIGN, MKFS_ZERO_CHUNK) != 0)
+    return -1;
+  memset(zero, 0, MKFS_ZERO_CHUNK);
+  while (start < end) {
+    long long n = end - start < MKFS_ZERO_CHUNK ? end - start : MKFS_ZERO_CHUNK;
+    ssize_t res = pwrite(fd, zero, n, start);
+    if (res <= 0) {
+      printf("[mkfs_naive] Zeroing failed at offset %lld.\n", start);
+      free(zero);
+      return -1;
+    }
+    start += res;
+  }
+  free(zero);
+  return 0;
+}
+
+// 让[start, end)读出来是0：镜像文件直接打洞，块设备让设备自己清零，都不行才手动写0
+static int zero_range(int fd, long long start, long long end) {
+  if (start >= end)
+    return 0;
+  if (!is_blockdev) {
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start,
+                  end - start) == 0)
+      return 0;
+  } else {
+    unsigned long long range[2] = {start, end - start};
+    if (ioctl(fd, BLKZEROOUT, range) == 0)
+      return 0;
+  }
+  return write_zeros(fd, start, end);
+}
+
+// 丢掉整个设备上的旧数据：镜像文件打洞变成稀疏文件，块设备发discard
+// 返回1表示之后整个设备都读出0，不必再单独清零inode表
+static int discard_device(int fd) {
+  if (!is_blockdev)
+    return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+                     disk_size) == 0;
+  unsigned long long range[2] = {0, disk_size};
+  unsigned int zeroes = 0;
+  if (ioctl(fd, BLKDISCARD, range) != 0)
+    return 0;
+  // discard之后不一定读出0，要看设备的承诺
+  return ioctl(fd, BLKDISCARDZEROES, &zeroes) == 0 && zeroes;
+}
+
+// 块组g要写的两段，按MKFS_ALIGN对齐，O_DIRECT也能直接写：
+// [region[0], region[1])从块组开头（块组0从引导块）到inode表用到的最后一块，
+// [region[2], region[3])是数据区开头的目录块，没有目录块时是空的
+static void group_regions(int g, long long disk_end, long long region[4]) {
+  struct mkfs_group *grp = &group_info[g];
+  region[0] = g == 0 ? 0 : align_down(group_start(g) * block_size);
+  region[1] = align_up((group_start(g) + 2 + itable_blocks(grp)) * block_size);
+  region[2] = align_down(group_data(g) * block_size);
+  region[3] = align_up((group_data(g) + grp->dir_blocks) * block_size);
+  if (region[1] > disk_end)
+    region[1] = disk_end;
+  if (region[3] > disk_end)
+    region[3] = disk_end;
+  if (grp->dir_blocks == 0)
+    region[2] = region[3] = region[1];
+}
 
 // 按排布图来布局分区
-static void format_disk(int fd, const char *path) {
-  // 先获取设备（磁盘）的总大小
-  struct stat stat_;
-  stat(path, &stat_);
-  disk_size = stat_.st_size;
-  printf("[mkfs_naive] Capacity of disk: %lu bytes.\n", disk_size);
+// 引导块 | 超级块 | 日志区 | 块组0 | 块组1 | ...
+// 每个块组：块位图（1块） | inode位图（1块） | inode表 | 数据块，一个块组的块数正好是一个位图块能管理的位数
+// 带校验和时位图块的最后4字节放校验和，块组相应地少32块
+// 元数据先在内存里拼好，再用几次大的pwrite写下去；inode表没用到的部分都是0，不写，靠打洞或清零得到
+// 日志区除了日志头都是0，和前面的元数据一起写
+static int format_disk(int fd) {
+  int i, g, per_block = NAIVE_INODES_PER_BLOCK(block_size);
+  int map_bits = use_csum ? NAIVE_GROUP_MAX(block_size)
+                          : NAIVE_BITS_PER_BLOCK(block_size);
+  long long span, region[4];
 
   // 构建超级块
   nsb.magic = NAIVE_MAGIC;
-  nsb.block_total = (int)(disk_size / NAIVE_BLOCK_SIZE);
-  nsb.inode_total = 128; // FIXME
+  nsb.block_size = block_size;
+  nsb.block_total = (int)(disk_size / block_size);
+  // 新镜像的extent表都可以串成链，大文件跨多少个块组都放得下
+  nsb.features = NAIVE_FEATURE_EXTENT_CHAIN;
+  if (use_csum)
+    nsb.features |= NAIVE_FEATURE_CSUM;
 
-  // 构建数据块位图
-  bmap = (_Byte *)malloc(NAIVE_BLOCK_SIZE);
-  memset(bmap, 0, NAIVE_BLOCK_SIZE);
+  // 日志区默认占磁盘的1/64，限制在[NAIVE_JOURNAL_MIN_BLOCKS, NAIVE_JOURNAL_MAX_BLOCKS]之间
+  if (journal_blocks < 0) {
+    journal_blocks = nsb.block_total / 64;
+    if (journal_blocks < NAIVE_JOURNAL_MIN_BLOCKS)
+      journal_blocks = NAIVE_JOURNAL_MIN_BLOCKS;
+    if (journal_blocks > NAIVE_JOURNAL_MAX_BLOCKS)
+      journal_blocks = NAIVE_JOURNAL_MAX_BLOCKS;
+  }
+  // 超级块固定在第512字节，日志区从它后面的第一个整块开始：512B的块是第2块，更大的块是第1块
+  nsb.journal_block_no =
+      (NAIVE_SUPER_BLOCK_OFFSET + NAIVE_SUPER_BLOCK_SIZE + block_size - 1) /
+      block_size;
+  nsb.journal_blocks = journal_blocks;
+  // 序号从一个随机数开始，-K时残留的旧日志序号对不上，不会被当成要恢复的事务
+  memset(&journal_header, 0, sizeof(journal_header));
+  journal_header.magic = NAIVE_JOURNAL_MAGIC;
+  journal_header.sequence = (int)(time(NULL) ^ getpid() << 16) & 0x7fffffff;
 
-  // 构建inode位图
-  imap = (_Byte *)malloc(NAIVE_BLOCK_SIZE);
-  memset(imap, 0, NAIVE_BLOCK_SIZE);
+  // 划分块组，块组0紧跟在日志区后面
+  // 每个块组的inode数按每bytes_per_inode字节配一个来算，凑成整块的inode表，
+  // 同时是8的倍数，inode位图按字节对齐；盘比一个块组还小时按实际大小算，免得inode表比盘还大
+  nsb.bmap_block_no = nsb.journal_block_no + nsb.journal_blocks;
+  nsb.group_blocks = map_bits;
+  span = nsb.block_total - nsb.bmap_block_no;
+  if (span > nsb.group_blocks)
+    span = nsb.group_blocks;
+  int align = per_block > 8 ? per_block : 8;
+  long long group_inodes = span * block_size / bytes_per_inode;
+  group_inodes = (group_inodes + align - 1) / align * align;
+  if (group_inodes < align)
+    group_inodes = align;
+  if (group_inodes > map_bits)
+    group_inodes = map_bits / align * align;
+  nsb.group_inodes = (int)group_inodes;
+  inode_table_size = nsb.group_inodes / per_block;
 
-  // 构建inode表
-  inode_table_size = nsb.inode_total * NAIVE_INODE_SIZE / NAIVE_BLOCK_SIZE;
-  nsb.inode_table_block_no = NAIVE_IMAP_BLOCK + 1;
-  // FIXME: 这样似乎不能保证图10-4末尾两个组成部分均为n块
+  // 最后一个块组可以短些，但放不下位图、inode表和至少一个数据块的话就不要了
+  groups = (nsb.block_total - nsb.bmap_block_no + nsb.group_blocks - 1) /
+           nsb.group_blocks;
+  if (groups > 0 &&
+      nsb.block_total - group_start(groups - 1) < 2 + inode_table_size + 1) {
+    groups--;
+    nsb.block_total = (int)group_start(groups);
+  }
+  if (groups <= 0) {
+    printf("[mkfs_naive] Disk too small: %lld blocks needed for metadata.\n",
+           (long long)nsb.bmap_block_no + 2 + inode_table_size + 1);
+    return -1;
+  }
+  nsb.bmap_blocks = nsb.imap_blocks = groups;
+  nsb.imap_block_no = nsb.bmap_block_no + 1;
+  nsb.inode_table_block_no = nsb.bmap_block_no + 2;
   nsb.data_block_no = nsb.inode_table_block_no + inode_table_size;
+  nsb.inode_total = groups * nsb.group_inodes;
+  printf("[mkfs_naive] %d blocks of %d bytes, %d inodes, %d groups of %d "
+         "blocks and %d inodes, journal %d blocks, inode table %d blocks "
+         "per group.\n",
+         nsb.block_total, block_size, nsb.inode_total, groups,
+         nsb.group_blocks, nsb.group_inodes, nsb.journal_blocks,
+         inode_table_size);
 
-  // 引导块，如图所示，放空
-  _Byte _boot_padding[NAIVE_BLOCK_SIZE];
-  write(fd, _boot_padding, NAIVE_BLOCK_SIZE);
-  // 超级块
-  write(fd, &nsb, NAIVE_SUPER_BLOCK_SIZE);
-  // bmap
-  // 先把数据块以前的位图标记成已使用
-  // 用户只允许存放到后续的数据块内，不允许触碰其他类型的块
-  int i;
-  for (i = 0; i < nsb.data_block_no; i++) {
-    int line = i / 8;
-    int offset = i % 8;
-    bmap[line] |= (1 << offset);
-  }
-  write(fd, bmap,  NAIVE_BLOCK_SIZE);
-  // imap
-  imap[0] |= 2; // ., ..
-  write(fd, imap,  NAIVE_BLOCK_SIZE);
-
-  // 准备基本的inode
-  struct naive_inode root_inode;
-  root_inode.mode = S_IFDIR;
-  root_inode.i_ino = NAIVE_ROOT_INODE_NO;
-  root_inode.block_count = 1;
-  root_inode.block[0] = nsb.data_block_no;
-  root_inode.dir_children_count = 3;
-  root_inode.i_gid = getgid();
-  root_inode.i_uid = getuid();
-  root_inode.i_nlink = 2; // ., ..
-  root_inode.i_atime = root_inode.i_mtime = root_inode.i_ctime = time(NULL);
-  write(fd, &root_inode, NAIVE_INODE_SIZE);
-
-  // 准备几条目录记录写到数据块
-  struct naive_dir_record dir_dot;
-  strcpy(dir_dot.filename, ".");
-  dir_dot.i_ino = NAIVE_ROOT_INODE_NO;
-  struct naive_dir_record dir_dotdot;
-  strcpy(dir_dotdot.filename, "..");
-  dir_dotdot.i_ino = NAIVE_ROOT_INODE_NO;
-  // 挪指针
-  lseek(fd, nsb.data_block_no * NAIVE_BLOCK_SIZE, SEEK_SET);
-  write(fd, &dir_dot, NAIVE_DIR_RECORD_SIZE);
-  write(fd, &dir_dotdot, NAIVE_DIR_RECORD_SIZE);
-}
-
-int main(int argc, char const *argv[]) {
-  int fd;
-  if (argc != 2)
+  // 各块组的块位图和inode位图
+  bmap = (_Byte *)calloc(groups, block_size);
+  imap = (_Byte *)calloc(groups, block_size);
+  if (bmap == NULL || imap == NULL) {
+    printf("[mkfs_naive] Out of memory.\n");
+    return -1;
+  }
+  for (g = 0; g < groups; g++) {
+    _Byte *gbmap = bmap + (long long)g * block_size;
+    _Byte *gimap = imap + (long long)g * block_size;
+    // 块组开头的两张位图和inode表标记成已使用，用户只允许存放到后续的数据块内
+    for (i = 0; i < 2 + inode_table_size; i++)
+      mark_used(gbmap, i);
+    // 最后一个块组超出磁盘范围的位也标记成已使用，免得被当成空闲块
+    for (i = nsb.block_total - group_start(g); i < nsb.group_blocks; i++)
+      if (i >= 0)
+        mark_used(gbmap, i);
+    // inode位图只用前group_inodes位，其余的也标记上
+    for (i = nsb.group_inodes; i < map_bits; i++)
+      mark_used(gimap, i);
+  }
+
+  // 根目录（和-d给的整个目录树）的inode、目录块都在内存里分配、拼好
+  if (build_tree() != 0)
+    return -1;
+  long long disk_end = (long long)nsb.block_total * block_size;
+
+  // 先让各块组inode表没用到的部分读出来是0
+  // 默认顺便丢掉整个设备的旧数据，镜像文件会变成稀疏文件；-K时只处理inode表
+  int zeroed = !keep_blocks && discard_device(fd);
+  for (g = 0; g < groups && !zeroed; g++) {
+    group_regions(g, disk_end, region);
+    if (zero_range(fd, region[1],
+                   group_info[g].dir_blocks ? region[2]
+                                            : group_data(g) * block_size) != 0)
+      return -1;
+  }
+
+  // 文件内容写在元数据的大块之外，先写后写都行；校验和要等内联的文件读进inode之后再算
+  if (source_dir != NULL && copy_files() != 0)
+    return -1;
+  seal_metadata();
+  for (g = 0; g < groups; g++) {
+    group_regions(g, disk_end, region);
+    if (region[2] <= region[1]) {
+      if (write_region(fd, region[0],
+                       region[3] > region[1] ? region[3] : region[1]) != 0)
+        return -1;
+    } else if (write_region(fd, region[0], region[1]) != 0 ||
+               write_region(fd, region[2], region[3]) != 0) {
+      return -1;
+    }
+  }
+  if (fsync(fd) != 0 || (data_fd != fd && fsync(data_fd) != 0)) {
+    printf("[mkfs_naive] fsync failed: %s.\n", strerror(errno));
+    return -1;
+  }
+
+  for (g = 0; g < groups; g++) {
+    free(group_info[g].itable);
+    free(group_info[g].dirs);
+  }
+  free(group_info);
+  free(bmap);
+  free(imap);
+  return 0;
+}
+
+// 用法：mkfs.naive [-b block-size] [-i bytes-per-inode] [-J journal-blocks] [-C] [-D] [-K]
+//                  [-d source-dir [-j threads]] device
+// -b：块大小，512、1024、2048或4096，默认4096，和页一样大
+// -J：日志区块数，0表示不要日志
+// -d：把目录树source-dir原样拷进镜像（和mke2fs -d一样），只拷普通文件和目录
+// -j：-d时拷贝文件内容的线程数，默认是CPU数
+// -C：元数据不带校验和，给老的内核模块用，或者比较校验和的开销
+// -D：用O_DIRECT写元数据，绕过页缓存
+// -K：不discard设备、不把镜像文件打成稀疏文件
+int main(int argc, char *const argv[]) {
+  int fd, opt;
+  while ((opt = getopt(argc, argv, "b:i:J:CDKd:j:")) != -1) {
+    switch (opt) {
+    case 'b':
+      block_size = atoi(optarg);
+      if (block_size < NAIVE_MIN_BLOCK_SIZE ||
+          block_size > NAIVE_MAX_BLOCK_SIZE ||
+          (block_size & (block_size - 1)) != 0) {
+        printf("[mkfs_naive] Block size must be 512, 1024, 2048 or 4096.\n");
+        return 1;
+      }
+      break;
+    case 'i':
+      bytes_per_inode = atoi(optarg);
+      if (bytes_per_inode < NAIVE_INODE_SIZE) {
+        printf("[mkfs_naive] bytes-per-inode must be at least %d.\n",
+               (int)NAIVE_INODE_SIZE);
+        return 1;
+      }
+      break;
+    case 'J':
+      journal_blocks = atoi(optarg);
+      if (journal_blocks != 0 && journal_blocks < NAIVE_JOURNAL_MIN_BLOCKS) {
+        printf("[mkfs_naive] Journal must be 0 or at least %d blocks.\n",
+               NAIVE_JOURNAL_MIN_BLOCKS);
+        return 1;
+      }
+      break;
+    case 'C':
+      use_csum = 0;
+      break;
+    case 'D':
+      use_direct_io = 1;
+      break;
+    case 'K':
+      keep_blocks = 1;
+      break;
+    case 'd':
+      source_dir = optarg;
+      break;
+    case 'j':
+      nthreads = atoi(optarg);
+      break;
+    default:
+      printf("[mkfs_naive] Usage: %s [-b block-size] [-i bytes-per-inode] "
+             "[-J journal-blocks] [-C] [-D] [-K] [-d source-dir [-j threads]] "
+             "device\n",
+             argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
     printf("[mkfs_naive] No device specified.\n");
-  fd = open(argv[1], O_RDWR);
-  format_disk(fd, argv[1]);
+    return 1;
+  }
+  if (nthreads <= 0)
+    nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nthreads <= 0)
+    nthreads = 1;
+  fd = open(argv[optind], O_RDWR | (use_direct_io ? O_DIRECT : 0));
+  // 文件内容的长度、位置不一定对齐，-D时另开一个普通的描述符来写
+  data_fd = use_direct_io ? open(argv[optind], O_RDWR) : fd;
+  if (fd < 0 || data_fd < 0) {
+    printf("[mkfs_naive] Cannot open %s: %s.\n", argv[optind], strerror(errno));
+    return 1;
+  }
+
+  // 先获取设备（磁盘）的总大小，块设备的st_size是0，要问内核
+  struct stat stat_;
+  if (fstat(fd, &stat_) != 0) {
+    printf("[mkfs_naive] Cannot stat %s.\n", argv[optind]);
+    close(fd);
+    return 1;
+  }
+  is_blockdev = S_ISBLK(stat_.st_mode);
+  disk_size = stat_.st_size;
+  if (is_blockdev) {
+    unsigned long long bytes;
+    if (ioctl(fd, BLKGETSIZE64, &bytes) != 0) {
+      printf("[mkfs_naive] Cannot get size of %s.\n", argv[optind]);
+      close(fd);
+      return 1;
+    }
+    disk_size = bytes;
+  }
+  printf("[mkfs_naive] Capacity of disk: %lld bytes.\n", disk_size);
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  int ret = format_disk(fd);
+  if (ret == 0)
+    printf("[mkfs_naive] Formatted in %.3f ms.\n", elapsed_ms(&start));
+  if (data_fd != fd)
+    close(data_fd);
   close(fd);
+  return ret == 0 ? 0 : 1;
 }
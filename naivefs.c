@@ -12,10 +12,23 @@
 #include <linux/fs.h>
 #include <linux/module.h>
 #include <linux/pagemap.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
 #include <linux/types.h>
 #include <stdbool.h>
 
+// 缓冲区上naivefs自己用的标志位
+// NaiveDir：这是目录块，写下去之前要算块尾的校验和
+// NaiveChecked：目录块从盘上读进来后校验过了，之后它的内容以内存为准，不用再校验
+enum {
+  BH_NaiveDir = BH_PrivateStart,
+  BH_NaiveChecked,
+};
+BUFFER_FNS(NaiveDir, naive_dir)
+BUFFER_FNS(NaiveChecked, naive_checked)
+
 // 全部ops的预定义
 static struct super_operations naive_sops;
 static struct inode_operations naive_iops;
@@ -25,6 +38,79 @@ static struct address_space_operations naive_aops;
 
 // 全部相关函数的预定义
 // ================= dir.c =================
+struct naive_dx_frame;
+struct naive_dx_sort_item;
+struct naive_readdir_item;
+struct naive_stats;
+static unsigned char naive_file_type(int mode);
+static unsigned char naive_dir_type(unsigned char file_type);
+static struct naive_dir_record *naive_dir_at(void *block, int off);
+static bool naive_dir_rec_ok(struct naive_dir_record *rec, int off, int size);
+static struct buffer_head *naive_dir_bread(struct super_block *sb,
+                                           struct naive_inode *dir_ninode,
+                                           int lblock);
+static struct buffer_head *naive_dir_append_block(struct super_block *sb,
+                                                  struct naive_inode *dir_ninode,
+                                                  int *lblock);
+static struct naive_dir_record *naive_find_in_block(void *block, int size,
+                                                    const char *name, int len);
+static int naive_insert_rec(void *block, int size, const char *name, int len,
+                            int ino, unsigned char type);
+static int naive_insert_in_block(struct super_block *sb,
+                                 struct buffer_head *bh, const char *name,
+                                 int len, int ino, unsigned char type);
+static void naive_dir_pack(void *block, int size, char *buf,
+                           struct naive_dx_sort_item *items, int from, int to);
+static struct naive_dx_entry *naive_dx_search(struct naive_dx_entry *entries,
+                                              int count, unsigned int hash);
+static void naive_dx_release(struct naive_dx_frame *frames, int n);
+static bool naive_dx_frame_ok(int count, int limit, int expect);
+static int naive_dx_probe(struct super_block *sb, struct naive_inode *dir_ninode,
+                          unsigned int hash, struct naive_dx_frame *frames);
+static void naive_dx_insert(struct super_block *sb,
+                            struct naive_dx_frame *frame, unsigned int hash,
+                            int block);
+static struct buffer_head *naive_dir_find_entry(struct super_block *sb,
+                                                struct naive_inode *dir_ninode,
+                                                const char *name, int len,
+                                                struct naive_dir_record **res);
+static int naive_dx_make_indexed(struct super_block *sb,
+                                 struct naive_inode *dir_ninode);
+static struct buffer_head *naive_dx_new_node(struct super_block *sb,
+                                             struct naive_inode *dir_ninode,
+                                             int *lblock);
+static int naive_dx_make_room(struct super_block *sb,
+                              struct naive_inode *dir_ninode,
+                              struct naive_dx_frame *frames, int *n);
+static int naive_dx_sort_cmp(const void *a, const void *b);
+static int naive_dx_split_leaf(struct super_block *sb,
+                               struct naive_inode *dir_ninode,
+                               struct naive_dx_frame *frames, int n,
+                               struct buffer_head *leaf_bh, const char *name,
+                               int len, int ino, unsigned char type);
+static int naive_dx_add_entry(struct super_block *sb,
+                              struct naive_inode *dir_ninode, const char *name,
+                              int len, int ino, unsigned char type);
+static int naive_dir_promote(struct super_block *sb,
+                             struct naive_inode *dir_ninode);
+static int naive_dir_add_entry(struct super_block *sb,
+                               struct naive_inode *dir_ninode, const char *name,
+                               int len, int ino, unsigned char type);
+static void naive_readahead_inodes(struct super_block *sb, void *data, int off,
+                                   int size);
+static void naive_dx_readahead(struct super_block *sb,
+                               struct naive_inode *dir_ninode,
+                               struct naive_dx_frame *frame);
+static bool naive_dx_next_hash(struct naive_dx_frame *frames, int n,
+                               unsigned int *hash);
+static unsigned int naive_dir_pos(unsigned int hash);
+static int naive_readdir_cmp(const void *a, const void *b);
+static int naive_readdir_collect(void *data, int size, unsigned int from,
+                                 struct naive_readdir_item *items);
+static int naive_readdir_emit(struct file *filp, void *dirent,
+                              filldir_t filldir,
+                              struct naive_readdir_item *items, int count,
+                              unsigned int from, unsigned long *skip);
 static int naive_readdir(struct file *filp, void *dirent, filldir_t filldir);
 // ================= file.c =================
 static int naive_create(struct inode *dir, struct dentry *dentry, int mode,
@@ -32,26 +118,138 @@ static int naive_create(struct inode *dir, struct dentry *dentry, int mode,
 static int naive_mkdir(struct inode *dir, struct dentry *dentry, int mode,
                        struct nameidata *nd);
 static int naive_mknod(struct inode *dir, struct dentry *dentry, int mode);
-static void write_back_block(struct super_block *sb, int block_no, void *data,
-                             int size);
 static void write_back_ninode(struct super_block *sb,
                               struct naive_inode *ninode);
 // ================= inode.c =================
+static struct inode *naive_alloc_inode(struct super_block *sb);
+static void naive_destroy_inode(struct inode *inode);
+static void naive_clear_inode(struct inode *inode);
+static void naive_init_once(void *foo, struct kmem_cache *cachep,
+                            unsigned long flags);
+static int naive_init_inodecache(void);
+static void naive_destroy_inodecache(void);
 static struct buffer_head *naive_update_inode(struct inode *inode);
 static int naive_write_inode(struct inode *inode, int wait);
 static void naive_read_inode(struct inode *inode);
-static struct naive_inode *naive_get_inode(struct super_block *sb, int ino);
+static struct naive_inode *naive_get_inode(struct super_block *sb, int ino,
+                                           struct buffer_head **p);
+static int naive_meta_blocks(struct inode *inode, int n);
+static int naive_reserve_block(struct inode *inode);
+static void naive_release_blocks(struct inode *inode, int n);
+static bool naive_block_delayed(struct inode *inode, sector_t block);
+static int naive_get_block(struct inode *inode, sector_t iblock,
+                           struct buffer_head *bh_result, int create);
+static int naive_get_block_delay(struct inode *inode, sector_t iblock,
+                                 struct buffer_head *bh_result, int create);
+static bool naive_inline_lock(struct inode *inode);
+static void naive_inline_fill_page(struct inode *inode, struct page *page);
+static int naive_inline_promote(struct inode *inode);
+static int naive_readpage(struct file *file, struct page *page);
+static int naive_readpages(struct file *file, struct address_space *mapping,
+                           struct list_head *pages, unsigned nr_pages);
+static int naive_writepage(struct page *page, struct writeback_control *wbc);
+static int naive_writepages(struct address_space *mapping,
+                            struct writeback_control *wbc);
+static int naive_prepare_write(struct file *file, struct page *page,
+                               unsigned from, unsigned to);
+static int naive_commit_write(struct file *file, struct page *page,
+                              unsigned from, unsigned to);
+static void naive_invalidatepage(struct page *page, unsigned long offset);
+static sector_t naive_bmap(struct address_space *mapping, sector_t block);
+static ssize_t naive_direct_IO(int rw, struct kiocb *iocb,
+                               const struct iovec *iov, loff_t offset,
+                               unsigned long nr_segs);
+static int naive_page_mkwrite(struct vm_area_struct *vma, struct page *page);
+static int naive_file_mmap(struct file *file, struct vm_area_struct *vma);
 struct dentry *naive_lookup(struct inode *dir, struct dentry *dentry,
                             struct nameidata *nd);
 void my_inode_init_owner(struct inode *inode, const struct inode *dir,
                          umode_t mode);
 // ================= bitmap.c =================
-static int naive_new_block_no(struct super_block *sb);
-static int naive_new_inode_no(struct super_block *sb);
-static void set_bmap_bit(struct super_block *sb, int block_no, bool to);
-static void set_imap_bit(struct super_block *sb, int block_no, bool to);
+struct naive_bitmap;
+static int naive_count_free_bits(void *map, int bits);
+static int naive_load_bitmap(struct super_block *sb, struct naive_bitmap *map,
+                             int start_block, int stride, int blocks, int bits,
+                             int first, int low, int size);
+static void naive_release_bitmap(struct naive_bitmap *map);
+static int naive_find_free_bit(struct naive_bitmap *map, int goal);
+static bool naive_set_bit(struct super_block *sb, struct naive_bitmap *map,
+                          int nr, bool to);
+static int naive_run_length(struct naive_bitmap *map, int start, int max);
+static int naive_find_free_run(struct naive_bitmap *map, int goal, int want,
+                               int *len);
+static int naive_new_blocks(struct super_block *sb, int goal, int *count,
+                            bool reserved);
+static int naive_new_inode_no(struct super_block *sb, int goal);
+static int naive_inode_goal(struct super_block *sb, struct inode *dir,
+                            int mode);
+static bool set_bmap_bit(struct super_block *sb, int block_no, bool to);
+static bool set_imap_bit(struct super_block *sb, int inode_no, bool to);
+// ================= extent.c =================
+static bool naive_extent_chain(struct super_block *sb);
+static int naive_extent_blocks(struct super_block *sb, int n);
+static struct naive_extent *naive_extent_at(struct naive_inode *ninode,
+                                            struct buffer_head *ebh, int i);
+static struct naive_extent *naive_extent_next(struct super_block *sb,
+                                              struct naive_inode *ninode,
+                                              struct buffer_head **ebh, int i);
+static int naive_new_extent_block(struct super_block *sb, int goal,
+                                  bool reserved, struct buffer_head **ebh);
+static int naive_map_block(struct super_block *sb, struct naive_inode *ninode,
+                           int file_block, int *count);
+static int naive_add_blocks(struct super_block *sb, struct naive_inode *ninode,
+                            int file_block, int *count, int goal,
+                            bool reserved);
+static int naive_extent_append(struct super_block *sb,
+                               struct naive_inode *ninode,
+                               struct buffer_head **ebh,
+                               struct naive_extent *ext, bool reserved);
+// ================= journal.c =================
+static int naive_journal_load(struct super_block *sb);
+static bool naive_journal_desc_ok(struct super_block *sb,
+                                  struct naive_journal_block *desc, int pos);
+static int naive_journal_replay(struct super_block *sb);
+static struct buffer_head *naive_journal_getblk(struct super_block *sb, int pos,
+                                                const void *src);
+static int naive_journal_write(struct buffer_head **bhs, int n);
+static int naive_journal_checkpoint(struct super_block *sb);
+static int __naive_journal_commit(struct super_block *sb);
+static int naive_journal_commit(struct super_block *sb);
+static void naive_journal_start(struct super_block *sb);
+static void naive_journal_stop(struct super_block *sb);
+static void naive_journal_dirty(struct super_block *sb, struct buffer_head *bh);
+// ================= csum.c =================
+static bool naive_has_csum(struct super_block *sb);
+static void naive_csum_error(struct super_block *sb, const char *what, int nr);
+static void naive_csum_inode_set(struct super_block *sb,
+                                 struct naive_inode *ninode);
+static bool naive_csum_inode_ok(struct super_block *sb,
+                                struct naive_inode *ninode, int ino);
+static bool naive_csum_bitmap_ok(struct super_block *sb,
+                                 struct buffer_head *bh);
+static void naive_csum_dir_init(struct super_block *sb, struct buffer_head *bh);
+static bool naive_csum_dir_ok(struct super_block *sb, struct buffer_head *bh);
+static void naive_csum_meta_set(struct super_block *sb, struct buffer_head *bh);
+// ================= stats.c =================
+static u64 naive_now_ns(void);
+static void naive_stat_end(struct super_block *sb, int op, u64 start);
+static struct buffer_head *naive_bread(struct super_block *sb, sector_t block);
+static void naive_breadahead(struct super_block *sb, sector_t block);
+static void naive_stats_show_bitmap(struct seq_file *m, const char *name,
+                                    struct naive_bitmap *map);
+static int naive_stats_show(struct seq_file *m, void *v);
+static int naive_stats_open(struct inode *inode, struct file *file);
+static void naive_stats_reset(struct super_block *sb);
+static ssize_t naive_stats_write(struct file *file, const char __user *buf,
+                                 size_t count, loff_t *ppos);
+static void naive_stats_setup(struct naive_stats *stats);
+static void naive_stats_init(struct super_block *sb);
+static void naive_stats_exit(struct super_block *sb);
 // ================= naivefs.c =================
 static void naive_put_super(struct super_block *sb);
+static void naive_write_super(struct super_block *sb);
+static int naive_sync_fs(struct super_block *sb, int wait);
+static int naive_statfs(struct dentry *dentry, struct kstatfs *buf);
 static int naive_fill_super(struct super_block *sb, void *data, int silent);
 static int naive_get_sb(struct file_system_type *fs_type, int flags,
                         const char *dev_name, void *data, struct vfsmount *mnt);
@@ -59,169 +257,1959 @@ static struct file_system_type naive_fs_type;
 static int __init init_naivefs(void);
 static void __exit exit_naivefs(void);
 
+// 找连续空闲块时最多看几段，位图很碎时不至于把整张位图扫一遍
+#define NAIVE_RUN_TRIES 64
+// 写回时一次最多给多少个连续的延迟分配块分配盘上的块
+#define NAIVE_MAX_ALLOC_RUN 1024
+// readdir时提前读后面的几个目录块
+#define NAIVE_DIR_READAHEAD 8
+
+// 一张常驻内存的位图，可以跨越多个块
+// 每个位图块另外记一个空闲位计数，分配时直接跳过已满的块，磁盘再大也不用从头扫到尾
+// 分了块组的镜像上每个位图块就是一个块组的位图，每块各有一把锁（即ext2的分组锁），
+// 置位、清位和该块的空闲计数都在锁里改，
+// 找空闲位时不加锁，找到了再去抢，抢的时候发现已经被别人置位了就接着找，
+// 不同的分配落在不同的块组上时互不等待
+struct naive_bitmap {
+  struct buffer_head **bh; // 每个位图块的缓冲区，挂载期间一直持有
+  spinlock_t *locks;       // 每个位图块的锁
+  int *free;               // 每个位图块中还剩多少个0位
+  atomic_t total_free;     // 整张位图还剩多少个0位
+  int blocks;              // 位图占多少块
+  int bits;                // 每个位图块管理多少位
+  int first;               // 第0个位图块的第0位对应的编号
+  int low;                 // 允许分配的最小编号
+  int size;                // 位图管理的编号上限（不含）
+  int hint;                // 下次从哪个编号开始找
+  atomic_long_t allocs;    // 统计：置位了多少次
+  atomic_long_t scans;     // 统计：找了多少次空闲位
+  atomic_long_t scanned;   // 统计：找空闲位一共扫过多少字节
+};
+
+// 一次元数据操作（mknod、给文件分配一块、写回一个inode）最多改多少个元数据块
+// 最坏的是往满了的两层索引目录里加项：inode位图1块、新inode所在的inode表1块、
+// 目录块8块（根、长高时新加的索引节点、两层索引节点分裂前后各2块、分裂前后的叶子2块）、
+// 给新目录块置位的块位图最多4块、间接extent块3块（前一个extent所在的、表尾的、新接上的），一共17块，留点余量
+// 日志区至少NAIVE_JOURNAL_MIN_BLOCKS块，一个事务至少能记这么多块，单个操作总放得下
+#define NAIVE_JOURNAL_CREDITS 20
+
+// 挂载期间的日志状态
+// 正在运行的事务就是一串登记过的缓冲区，多次操作攒在一起，满了或者到时间了才一起提交
+struct naive_journal {
+  struct rw_semaphore j_barrier; // 操作期间持读锁，提交时持写锁，保证提交时没人在改元数据
+  spinlock_t j_lock;             // 保护下面的计数和j_bh
+  int j_start;    // 日志区起始块号
+  int j_blocks;   // 日志区块数，0表示没有日志，元数据直接写原位
+  int j_max;      // 一个事务最多记几块
+  int j_head;     // 下一个事务写在日志区的第几块
+  int j_sequence; // 正在运行的事务的序号
+  int j_reserved; // 进行中的操作一共预留了几块
+  int j_count;    // 正在运行的事务登记了几块
+  // j_bh是登记的元数据缓冲区，j_log是提交时写日志区用的缓冲区
+  // 按最大的块大小开数组，一个事务实际最多记j_max块
+  struct buffer_head *j_bh[NAIVE_JOURNAL_TAGS(NAIVE_MAX_BLOCK_SIZE)];
+  struct buffer_head *j_log[NAIVE_JOURNAL_TAGS(NAIVE_MAX_BLOCK_SIZE) + 1];
+};
+
+// 延迟直方图的格数：第0格是不到1微秒的调用，第i格是[2^(i-1), 2^i)微秒的，最后一格兜底
+// 这里1微秒按1024纳秒算，移位就够了，不用做64位除法
+#define NAIVE_STAT_BUCKETS 16
+
+// 统计调用次数和耗时的入口
+enum {
+  NAIVE_OP_LOOKUP,
+  NAIVE_OP_CREATE,
+  NAIVE_OP_MKDIR,
+  NAIVE_OP_READDIR,
+  NAIVE_OP_READ_INODE,
+  NAIVE_OP_WRITE_INODE,
+  NAIVE_OP_COMMIT,
+  NAIVE_OPS
+};
+
+// 一个入口的统计，几个数要一起改，用自旋锁保护，32位机器上也不会很快回绕
+struct naive_op_stat {
+  spinlock_t lock;
+  u64 calls;
+  u64 ns; // 总耗时（纳秒）
+  u64 hist[NAIVE_STAT_BUCKETS];
+};
+
+// 挂载期间的统计，在/proc/fs/naivefs/<设备名>/stats里看，往里写任何内容就清零
+struct naive_stats {
+  struct naive_op_stat ops[NAIVE_OPS];
+  atomic_long_t bread;         // sb_bread的次数，命中缓存的也算
+  atomic_long_t readahead;     // sb_breadahead的次数
+  atomic_long_t csum_errors;   // 校验和对不上的次数
+  struct proc_dir_entry *proc; // 本次挂载在/proc下的目录
+  struct proc_dir_entry *entry; // 目录下的stats文件
+};
+
+// naivefs在内存中的超级块私有信息，挂在super_block的私有域上
+// 块位图和inode位图在挂载时读入，之后一直持有其缓冲区，分配时直接在缓冲区上搜索和置位
+struct naive_sb_info {
+  // 自定义超级块的内存副本，挂载时拷一份，之后不再持有超级块所在的缓冲区
+  // 运行时没有东西会改它，空闲块数、空闲inode数都由两张位图各自的计数给出
+  struct naive_super_block s_nsb;
+  int s_inodes_per_block;          // inode表每块放几个inode
+  int s_dir_size;                  // 目录块里目录项能用的字节数，带校验和时块尾要留给假目录项
+  int s_overhead;                  // 元数据（含引导块、超级块、日志区）一共占多少块
+  struct naive_bitmap s_bmap;      // 块位图
+  struct naive_bitmap s_imap;      // inode位图
+  struct naive_journal s_journal;  // 元数据日志
+  spinlock_t s_resv_lock;          // 保护s_reserved和各inode的预留计数
+  int s_reserved;                  // 延迟分配预留了、还没真正分配的块数
+  struct naive_stats s_stats;      // 各入口的调用统计
+};
+
 // 用于取super_block上的私有域
-static struct naive_super_block *NAIVE_SB(struct super_block *sb) {
+static struct naive_sb_info *NAIVE_SBI(struct super_block *sb) {
   return sb->s_fs_info;
 }
 
+// 用于取自定义超级块
+static struct naive_super_block *NAIVE_SB(struct super_block *sb) {
+  return &NAIVE_SBI(sb)->s_nsb;
+}
+
+// naivefs在内存中的inode，把原生inode包在里面，从专用的slab里分配
+// read_inode时把盘上的自定义inode解码一次放进i_ninode，此后extent表、大小等都直接读这份，
+// 改了之后mark_inode_dirty，由write_inode整个写回inode表
+// 文件写入时只预留块（延迟分配），写回时才分配，i_reserved记着预留了还没分配的块数
+struct naive_inode_info {
+  struct naive_inode i_ninode; // 自定义inode的内存副本
+  // 保护i_ninode里的extent表、内联数据和目录项，延迟分配的写回、get_block、write_inode都可能同时改它们
+  struct mutex i_map_lock;
+  int i_goal;          // 文件还没有块时，第一块从哪里找起，-1表示不在乎
+  int i_reserved;      // 延迟分配预留的块数
+  int i_meta_reserved; // 替间接extent块预留了几块
+  struct inode vfs_inode;      // 原生inode
+};
+
+// 用于从原生inode取naivefs的inode
+static struct naive_inode_info *NAIVE_I(struct inode *inode) {
+  return container_of(inode, struct naive_inode_info, vfs_inode);
+}
+
+static struct kmem_cache *naive_inode_cachep;
+static struct proc_dir_entry *naive_proc_root; // /proc/fs/naivefs
+// 保护stats文件的data（指向super_block）：卸载时清空，读写stats时拿着它再看一眼
+// remove_proc_entry不会等已经打开的stats文件，只能靠这个挡住对已释放的sb的访问
+static DEFINE_MUTEX(naive_stats_mutex);
+
 // ============ bitmap.c ============
 
-// 获取一个可用的空data_block编号
-static int naive_new_block_no(struct super_block *sb) {
-  struct naive_super_block *nsb = NAIVE_SB(sb);
-  int bmap_size = nsb->block_total / 8;
-  _Byte *bmap = kmalloc(bmap_size, GFP_KERNEL);
-  struct buffer_head *bh = sb_bread(sb, NAIVE_BMAP_BLOCK);
-  memcpy(bmap, (_Byte *)(bh->b_data), bmap_size);
+// 位序与mkfs.naive一致（第i位在第i/8字节的第i%8位），正好是ext2的小端位序，
+// 所以下面都直接用ext2_*_bit系列，其中ext2_find_next_zero_bit一次比较一个unsigned long
+
+// 数一个位图块中[0, bits)范围内有几个0位
+static int naive_count_free_bits(void *map, int bits) {
+  unsigned long *word = map;
+  int i, used = 0;
+  for (i = 0; i < bits / BITS_PER_LONG; i++)
+    used += hweight_long(word[i]);
+  for (i = i * BITS_PER_LONG; i < bits; i++)
+    used += ext2_test_bit(i, map) ? 1 : 0;
+  return bits - used;
+}
+
+// 挂载时把位图读进内存，第i块在start_block + i * stride，管理从first + i * bits开始的bits个编号
+// 编号[low, size)可供分配
+static int naive_load_bitmap(struct super_block *sb, struct naive_bitmap *map,
+                             int start_block, int stride, int blocks, int bits,
+                             int first, int low, int size) {
+  int i;
+  map->bh = kzalloc(blocks * sizeof(struct buffer_head *), GFP_KERNEL);
+  map->locks = kzalloc(blocks * sizeof(spinlock_t), GFP_KERNEL);
+  map->free = kzalloc(blocks * sizeof(int), GFP_KERNEL);
+  map->blocks = blocks;
+  map->bits = bits;
+  map->first = first;
+  map->low = low;
+  map->size = size;
+  map->hint = low;
+  atomic_set(&map->total_free, 0);
+  if (map->bh == NULL || map->locks == NULL || map->free == NULL)
+    return -ENOMEM;
+
+  for (i = 0; i < blocks; i++) {
+    int base = first + i * map->bits;
+    spin_lock_init(&map->locks[i]);
+    map->bh[i] = naive_bread(sb, start_block + i * stride);
+    if (map->bh[i] == NULL || !naive_csum_bitmap_ok(sb, map->bh[i]))
+      return -EIO;
+    if (base < size)
+      map->free[i] = naive_count_free_bits(
+          map->bh[i]->b_data, min(size - base, map->bits));
+    atomic_add(map->free[i], &map->total_free);
+  }
+  return 0;
+}
+
+// 卸载（或挂载失败）时释放位图，脏的缓冲区会在释放前由系统写回
+static void naive_release_bitmap(struct naive_bitmap *map) {
+  int i;
+  if (map->bh != NULL)
+    for (i = 0; i < map->blocks; i++)
+      brelse(map->bh[i]);
+  kfree(map->bh);
+  kfree(map->locks);
+  kfree(map->free);
+  map->bh = NULL;
+  map->locks = NULL;
+  map->free = NULL;
+}
+
+// 在位图中找一个为0的位，从goal（goal<0时用hint）所在的块开始，跳过已满的块，找一圈回来为止
+// 找不到返回-1
+static int naive_find_free_bit(struct naive_bitmap *map, int goal) {
+  int hint = goal >= 0 ? max(goal, map->low) : map->hint;
+  int first, i;
+  atomic_long_inc(&map->scans);
+  if (hint < map->low || hint >= map->size)
+    hint = map->low;
+  first = (hint - map->first) / map->bits;
+
+  // 多走一步是为了回到hint所在的块，再看看hint之前的部分
+  for (i = 0; i <= map->blocks; i++) {
+    int idx = (first + i) % map->blocks;
+    int base = map->first + idx * map->bits;
+    int lo = max(base, map->low);
+    int hi = min(base + map->bits, map->size);
+    int bit;
+    if (map->free[idx] == 0)
+      continue;
+    if (i == 0)
+      lo = hint;
+    if (i == map->blocks)
+      hi = hint;
+    if (lo >= hi)
+      continue;
+    bit = ext2_find_next_zero_bit(map->bh[idx]->b_data, hi - base, lo - base);
+    atomic_long_add(DIV_ROUND_UP(min(bit + 1, hi - base) - (lo - base), 8),
+                    &map->scanned);
+    if (bit < hi - base)
+      return base + bit;
+  }
+  return -1;
+}
+
+// 把位图中的某位置值，同步更新空闲计数，并把所在的块登记到日志里
+// 返回这一位是不是真的变了；置位时返回false说明这一位已经被别人抢走了
+static bool naive_set_bit(struct super_block *sb, struct naive_bitmap *map,
+                          int nr, bool to) {
+  int idx = (nr - map->first) / map->bits;
+  int bit = (nr - map->first) % map->bits;
+  struct buffer_head *bh = map->bh[idx];
+  bool changed;
+  spin_lock(&map->locks[idx]);
+  if (to)
+    changed = !ext2_set_bit(bit, bh->b_data);
+  else
+    changed = ext2_clear_bit(bit, bh->b_data);
+  if (changed)
+    map->free[idx] += to ? -1 : 1;
+  spin_unlock(&map->locks[idx]);
+  if (!changed)
+    return false;
+  if (to) {
+    atomic_dec(&map->total_free);
+    atomic_long_inc(&map->allocs);
+    // 刚分配出去的位后面大概率也是空的，下次从这里接着找；几个线程同时改也无妨，只是个提示
+    map->hint = nr + 1;
+  } else {
+    atomic_inc(&map->total_free);
+  }
+  naive_journal_dirty(sb, bh);
+  return true;
+}
+
+// 从start开始数连续的0位，最多数到max个
+static int naive_run_length(struct naive_bitmap *map, int start, int max) {
+  int nr;
+  for (nr = start; nr < map->size && nr - start < max; nr++)
+    if (ext2_test_bit((nr - map->first) % map->bits,
+                      map->bh[(nr - map->first) / map->bits]->b_data))
+      break;
+  atomic_long_add(DIV_ROUND_UP(nr - start + 1, 8), &map->scanned);
+  return nr - start;
+}
+
+// 找一段连续的空闲位，最多want个，返回起点，长度由*len带回，一个空闲位都没有返回-1
+// goal本身空闲就从goal开始，哪怕短一点，能接上文件已有的块最要紧；
+// 否则从goal往后找第一段够want长的，最多看NAIVE_RUN_TRIES段，都不够长就用其中最长的
+static int naive_find_free_run(struct naive_bitmap *map, int goal, int want,
+                               int *len) {
+  int start = naive_find_free_bit(map, goal), first = start;
+  int best = start, best_len = 0, wrapped = 0, tries, next, n;
+  for (tries = 0; start >= 0 && tries < NAIVE_RUN_TRIES; tries++) {
+    n = naive_run_length(map, start, want);
+    if (n >= want || start == goal) {
+      *len = n;
+      return start;
+    }
+    if (n > best_len) {
+      best = start;
+      best_len = n;
+    }
+    next = naive_find_free_bit(map, start + n);
+    // 越过位图末尾绕回了开头，再走到第一段就是转了一圈
+    if (next <= start)
+      wrapped = 1;
+    if (next < 0 || (wrapped && next >= first))
+      break;
+    start = next;
+  }
+  *len = best_len;
+  return best;
+}
+
+// 分配盘上连续的一段块（绝对块号）并在块位图上置位，尽量从goal开始，goal<0表示不在乎位置，
+// 返回起点，*count带回实际的块数
+// 延迟分配在写入时已经预留过块（reserved），其他分配要给这些预留让路，不能把它们的块占了，
+// 所以先临时预留要的块数，抢到之后再还掉，免得和并发的预留算重
+// 找到的一段在抢之前可能已经被别人拿走了一部分，从头逐位抢，抢到几位算几位，一位都没抢到就重找
+// 没有空闲块时返回-ENOSPC
+static int naive_new_blocks(struct super_block *sb, int goal, int *count,
+                            bool reserved) {
+  struct naive_sb_info *sbi = NAIVE_SBI(sb);
+  int want = *count, res, n;
+  if (!reserved) {
+    spin_lock(&sbi->s_resv_lock);
+    want = min(want, atomic_read(&sbi->s_bmap.total_free) - sbi->s_reserved);
+    if (want <= 0) {
+      spin_unlock(&sbi->s_resv_lock);
+      return -ENOSPC;
+    }
+    sbi->s_reserved += want;
+    spin_unlock(&sbi->s_resv_lock);
+  }
+  for (;;) {
+    res = naive_find_free_run(&sbi->s_bmap, goal, want, count);
+    if (res < 0) {
+      res = -ENOSPC;
+      break;
+    }
+    for (n = 0; n < *count && set_bmap_bit(sb, res + n, true); n++)
+      ;
+    if (n > 0) {
+      *count = n;
+      break;
+    }
+  }
+  if (!reserved) {
+    spin_lock(&sbi->s_resv_lock);
+    sbi->s_reserved -= want;
+    spin_unlock(&sbi->s_resv_lock);
+  }
+  return res;
+}
+
+// 获取一个可用的空inode编号并在inode位图上置位，与自带的new_inode不同的是，该方法采用bitmap确定空闲inode编号
+// 从goal开始找，goal<0表示不在乎位置；和分配块一样，找到的位被别人抢先置位了就接着找
+// 没有空闲inode时返回-ENOSPC
+static int naive_new_inode_no(struct super_block *sb, int goal) {
+  int res;
+  do {
+    res = naive_find_free_bit(&NAIVE_SBI(sb)->s_imap, goal);
+    if (res < 0)
+      return -ENOSPC;
+  } while (!set_imap_bit(sb, res, true));
+  return res;
+}
+
+// 给dir下新建的inode挑块组，返回从哪个inode号找起
+// 文件放在所在目录的块组里，inode、数据和目录块挨在一起，一个目录下的文件读起来不用满盘寻道
+// 目录则往别的块组散开（仿照ext2的find_group_dir）：在空闲inode不少于平均数的块组里挑空闲块最多的，
+// 免得所有东西都挤在块组0里，新目录下的文件也有地方放；块组各有各的锁，散开之后分配也互不等待
+// 老镜像不分块组，返回-1，按位图的hint找
+static int naive_inode_goal(struct super_block *sb, struct inode *dir,
+                            int mode) {
+  struct naive_sb_info *sbi = NAIVE_SBI(sb);
+  int group_inodes = sbi->s_nsb.group_inodes;
+  int groups = sbi->s_imap.blocks, avg, best = -1, g;
+  if (sbi->s_nsb.group_blocks == 0)
+    return -1;
+  if (!S_ISDIR(mode))
+    return dir->i_ino / group_inodes * group_inodes;
+  avg = atomic_read(&sbi->s_imap.total_free) / groups;
+  for (g = 0; g < groups; g++) {
+    if (sbi->s_imap.free[g] == 0 || sbi->s_imap.free[g] < avg)
+      continue;
+    if (best < 0 || sbi->s_bmap.free[g] > sbi->s_bmap.free[best])
+      best = g;
+  }
+  return best < 0 ? -1 : best * group_inodes;
+}
+
+// 把某块的bmap对应bit置值
+static bool set_bmap_bit(struct super_block *sb, int block_no, bool to) {
+  return naive_set_bit(sb, &NAIVE_SBI(sb)->s_bmap, block_no, to);
+}
+
+// 把某inode的imap对应bit置值
+static bool set_imap_bit(struct super_block *sb, int inode_no, bool to) {
+  return naive_set_bit(sb, &NAIVE_SBI(sb)->s_imap, inode_no, to);
+}
+
+// ============ extent.c ============
+
+// 带NAIVE_FEATURE_EXTENT_CHAIN的镜像上间接extent块可以串成链，新的extent追加在表尾（格式见naivefs.h）
+// 老镜像的extent表最多NAIVE_MAX_EXTENTS项，按file_block升序插入
+static bool naive_extent_chain(struct super_block *sb) {
+  return NAIVE_SB(sb)->features & NAIVE_FEATURE_EXTENT_CHAIN;
+}
+
+// 装下n个extent要几个间接extent块
+static int naive_extent_blocks(struct super_block *sb, int n) {
+  if (n <= NAIVE_INLINE_EXTENTS)
+    return 0;
+  if (!naive_extent_chain(sb))
+    return 1;
+  return DIV_ROUND_UP(n - NAIVE_INLINE_EXTENTS,
+                      NAIVE_EXTENTS_PER_BLOCK(sb->s_blocksize));
+}
+
+// 取extent表的第i项：前NAIVE_INLINE_EXTENTS项直接放在inode里，其余的在间接extent块ebh里
+// 只用于老镜像，那时间接extent块只有一块
+static struct naive_extent *naive_extent_at(struct naive_inode *ninode,
+                                            struct buffer_head *ebh, int i) {
+  if (i < NAIVE_INLINE_EXTENTS)
+    return &ninode->extents[i];
+  return (struct naive_extent *)ebh->b_data + (i - NAIVE_INLINE_EXTENTS);
+}
+
+// 从头顺序走extent表时取第i项，i必须从0起逐个加1
+// *ebh是当前走到的间接extent块，走进下一块时换掉，调用者最后brelse；读不出来返回NULL
+static struct naive_extent *naive_extent_next(struct super_block *sb,
+                                              struct naive_inode *ninode,
+                                              struct buffer_head **ebh, int i) {
+  int per = NAIVE_EXTENTS_PER_BLOCK(sb->s_blocksize);
+  int k = i - NAIVE_INLINE_EXTENTS, next;
+  if (i < NAIVE_INLINE_EXTENTS)
+    return &ninode->extents[i];
+  if (k % per != 0)
+    return (struct naive_extent *)(*ebh)->b_data + k % per;
+  next = k == 0 ? ninode->extent_block
+                : NAIVE_EXTENT_NEXT((*ebh)->b_data, sb->s_blocksize);
+  brelse(*ebh);
+  *ebh = next == 0 ? NULL : naive_bread(sb, next);
+  if (*ebh == NULL)
+    return NULL;
+  return (struct naive_extent *)(*ebh)->b_data;
+}
+
+// 分配一个清零的间接extent块，尽量靠近goal，缓冲区由*ebh带回
+static int naive_new_extent_block(struct super_block *sb, int goal,
+                                  bool reserved, struct buffer_head **ebh) {
+  int one = 1;
+  int eblock_no = naive_new_blocks(sb, goal, &one, reserved);
+  if (eblock_no < 0)
+    return eblock_no;
+  *ebh = sb_getblk(sb, eblock_no);
+  if (*ebh == NULL) {
+    set_bmap_bit(sb, eblock_no, false);
+    return -EIO;
+  }
+  lock_buffer(*ebh);
+  memset((*ebh)->b_data, 0, sb->s_blocksize);
+  set_buffer_uptodate(*ebh);
+  unlock_buffer(*ebh);
+  clear_buffer_naive_dir(*ebh);
+  return eblock_no;
+}
+
+// 把文件内的逻辑块号file_block映射为物理块号，没有映射（空洞或越界）时返回0
+// 物理块0是引导块，不会被分给文件，所以可以用0表示没有映射
+// count不为NULL时，顺便给出从file_block开始、在盘上连续的块数，方便一次读多块
+static int naive_map_block(struct super_block *sb, struct naive_inode *ninode,
+                           int file_block, int *count) {
+  struct buffer_head *ebh = NULL;
+  bool sorted = !naive_extent_chain(sb);
+  int i, res = 0;
+  for (i = 0; i < ninode->extent_count; i++) {
+    // inode里的extent都没找到，才去读间接extent块
+    struct naive_extent *ext = naive_extent_next(sb, ninode, &ebh, i);
+    if (ext == NULL)
+      break;
+    // 有序的extent表过头了就说明是空洞，链式的表要看完
+    if (file_block < ext->file_block) {
+      if (sorted)
+        break;
+      continue;
+    }
+    if (file_block < ext->file_block + ext->len) {
+      res = ext->start + (file_block - ext->file_block);
+      if (count != NULL)
+        *count = ext->len - (file_block - ext->file_block);
+      break;
+    }
+  }
+  brelse(ebh);
+  return res;
+}
+
+// 链式extent表：把ext追加到表尾，*ebh是表尾所在的间接extent块（表还没出inode时为NULL），
+// 那块满了就新分配一块接在链上，*ebh换成新块
+static int naive_extent_append(struct super_block *sb,
+                               struct naive_inode *ninode,
+                               struct buffer_head **ebh,
+                               struct naive_extent *ext, bool reserved) {
+  int per = NAIVE_EXTENTS_PER_BLOCK(sb->s_blocksize);
+  int k = ninode->extent_count - NAIVE_INLINE_EXTENTS, eblock_no;
+  struct buffer_head *nbh;
+  if (k < 0) {
+    ninode->extents[ninode->extent_count++] = *ext;
+    return 0;
+  }
+  if (k % per == 0) {
+    eblock_no = naive_new_extent_block(sb, ext->start + ext->len, reserved, &nbh);
+    if (eblock_no < 0)
+      return eblock_no;
+    if (k == 0) {
+      ninode->extent_block = eblock_no;
+    } else {
+      NAIVE_EXTENT_NEXT((*ebh)->b_data, sb->s_blocksize) = eblock_no;
+      naive_journal_dirty(sb, *ebh);
+    }
+    brelse(*ebh);
+    *ebh = nbh;
+  }
+  ((struct naive_extent *)(*ebh)->b_data)[k % per] = *ext;
+  naive_journal_dirty(sb, *ebh);
+  ninode->extent_count++;
+  return 0;
+}
+
+// 给文件从逻辑块file_block开始的*count个块分配盘上连续的一段并记进extent表，返回第一个物理块号，
+// *count带回实际分到的块数（至少1块）；失败返回负的错误码
+// 优先接在前一个extent的物理末尾，这样顺序写的文件在盘上是连续的，extent表也不会变长；
+// 文件还没有块时从goal找起，goal<0表示不在乎位置
+// reserved表示这些块在写入时已经预留过（延迟分配），见naive_new_blocks
+// 这里只改ninode本身，ninode所在的缓冲区由调用者负责标脏
+// 改到的间接extent块最多是前一个extent所在的块、表尾的块和新接上的块，加上位图都在NAIVE_JOURNAL_CREDITS以内
+static int naive_add_blocks(struct super_block *sb, struct naive_inode *ninode,
+                            int file_block, int *count, int goal,
+                            bool reserved) {
+  struct buffer_head *ebh = NULL, *pbh = NULL;
+  struct naive_extent *prev = NULL, *ext, new;
+  int i, j, pos = 0, next = INT_MAX, block_no, err;
+
+  // 找前一个extent（起点不超过file_block的里面起点最大的）和后一个extent的起点，
+  // 老镜像的表有序，插入位置就在前一个之后；整张表走完后ebh停在表尾所在的块
+  for (i = 0; i < ninode->extent_count; i++) {
+    ext = naive_extent_next(sb, ninode, &ebh, i);
+    if (ext == NULL) {
+      block_no = -EIO;
+      goto out;
+    }
+    if (ext->file_block > file_block) {
+      next = min(next, ext->file_block);
+      continue;
+    }
+    if (prev == NULL || ext->file_block > prev->file_block) {
+      // 前一个extent可能在后面走过去的块里，留着它所在块的引用
+      prev = ext;
+      pos = i + 1;
+      brelse(pbh);
+      pbh = i < NAIVE_INLINE_EXTENTS ? NULL : ebh;
+      if (pbh != NULL)
+        get_bh(pbh);
+    }
+  }
+  if (prev != NULL) {
+    if (file_block < prev->file_block + prev->len) {
+      // 已经有映射了
+      block_no = prev->start + (file_block - prev->file_block);
+      *count = min(*count, prev->file_block + prev->len - file_block);
+      goto out;
+    }
+    goal = prev->start + (file_block - prev->file_block);
+  }
+  // 不能盖到后一个extent上
+  if (next != INT_MAX)
+    *count = min(*count, next - file_block);
+
+  block_no = naive_new_blocks(sb, goal, count, reserved);
+  if (block_no < 0)
+    goto out;
+
+  if (prev != NULL && prev->file_block + prev->len == file_block &&
+      prev->start + prev->len == block_no) {
+    // 正好接得上，延长前一个extent即可
+    prev->len += *count;
+    if (pbh != NULL)
+      naive_journal_dirty(sb, pbh);
+  } else if (naive_extent_chain(sb)) {
+    // 接不上，在表尾新开一个extent
+    new.file_block = file_block;
+    new.start = block_no;
+    new.len = *count;
+    err = naive_extent_append(sb, ninode, &ebh, &new, reserved);
+    if (err)
+      goto out_free;
+  } else {
+    // 接不上，要在前一个extent之后新开一个
+    if (ninode->extent_count == NAIVE_MAX_EXTENTS(sb->s_blocksize)) {
+      err = -EFBIG;
+      goto out_free;
+    }
+    if (ninode->extent_count == NAIVE_INLINE_EXTENTS) {
+      // inode里放满了，分配一个间接extent块
+      err = naive_new_extent_block(sb, block_no + *count, reserved, &ebh);
+      if (err < 0)
+        goto out_free;
+      ninode->extent_block = err;
+    }
+    // 把第pos项及以后的extent往后挪一格，腾出位置
+    for (j = ninode->extent_count; j > pos; j--)
+      *naive_extent_at(ninode, ebh, j) = *naive_extent_at(ninode, ebh, j - 1);
+    ext = naive_extent_at(ninode, ebh, pos);
+    ext->file_block = file_block;
+    ext->start = block_no;
+    ext->len = *count;
+    ninode->extent_count++;
+    if (ebh != NULL)
+      naive_journal_dirty(sb, ebh);
+  }
+  ninode->block_count += *count;
+  goto out;
+
+out_free:
+  for (j = 0; j < *count; j++)
+    set_bmap_bit(sb, block_no + j, false);
+  block_no = err;
+out:
+  brelse(pbh);
+  brelse(ebh);
+  return block_no;
+}
+
+// ============ journal.c ============
+
+// 元数据的修改都包在naive_journal_start/stop之间，改过的缓冲区用naive_journal_dirty登记进正在运行的事务，
+// 而不是直接标脏。提交时先把这些块的副本顺序写进日志区，提交块落盘后才把原缓冲区标脏，由系统择机写回原位
+// 这样无论何时掉电，盘上的元数据要么停在某个事务之前，要么能用日志补齐到某个事务之后
+// 原位的块在检查点之前都不会被覆盖成未提交的样子：没标脏的缓冲区不会被写回，
+// 标过脏的说明它在前面某个已提交的事务里，恢复时会被日志里的副本盖掉
+
+// 挂载时读日志头，把上次没来得及写回原位的事务恢复出来
+static int naive_journal_load(struct super_block *sb) {
+  struct naive_super_block *nsb = NAIVE_SB(sb);
+  struct naive_journal *j = &NAIVE_SBI(sb)->s_journal;
+  struct naive_journal_header *jh;
+  struct buffer_head *bh;
+  int replayed;
+
+  init_rwsem(&j->j_barrier);
+  spin_lock_init(&j->j_lock);
+  j->j_start = nsb->journal_block_no;
+  j->j_blocks = nsb->journal_blocks;
+  j->j_head = 1;
+  // 老的镜像没有日志区，元数据照旧直接写原位
+  if (j->j_blocks == 0)
+    return 0;
+  // 分了块组的镜像日志区紧挨在块组0前面，老镜像在inode位图和inode表之间
+  if (j->j_blocks < NAIVE_JOURNAL_MIN_BLOCKS ||
+      (nsb->group_blocks != 0 &&
+       j->j_start + j->j_blocks != nsb->bmap_block_no) ||
+      (nsb->group_blocks == 0 &&
+       (j->j_start != nsb->imap_block_no + nsb->imap_blocks ||
+        j->j_start + j->j_blocks != nsb->inode_table_block_no)))
+    return -EINVAL;
+  j->j_max = min_t(int, NAIVE_JOURNAL_TAGS(sb->s_blocksize), j->j_blocks - 3);
+  if (j->j_max < NAIVE_JOURNAL_CREDITS)
+    return -EINVAL;
+
+  bh = naive_bread(sb, j->j_start);
+  if (bh == NULL)
+    return -EIO;
+  jh = (struct naive_journal_header *)bh->b_data;
+  if (jh->magic != NAIVE_JOURNAL_MAGIC) {
+    brelse(bh);
+    return -EINVAL;
+  }
+  j->j_sequence = jh->sequence;
+  brelse(bh);
+
+  replayed = naive_journal_replay(sb);
+  if (replayed <= 0)
+    return replayed;
+  printk(KERN_INFO "naivefs: %s: replayed %d transactions\n", sb->s_id,
+         replayed);
+  // 恢复出来的块写回原位后日志就没用了
+  return naive_journal_checkpoint(sb);
+}
+
+// 检查日志区第pos块的描述块是否属于正在等待恢复的那个事务，记的块号也都在元数据区里
+static bool naive_journal_desc_ok(struct super_block *sb,
+                                  struct naive_journal_block *desc, int pos) {
+  struct naive_super_block *nsb = NAIVE_SB(sb);
+  struct naive_journal *j = &NAIVE_SBI(sb)->s_journal;
+  int i;
+  if (desc->magic != NAIVE_JOURNAL_MAGIC || desc->type != NAIVE_JOURNAL_DESC ||
+      desc->sequence != j->j_sequence || desc->count <= 0 ||
+      desc->count > j->j_max || pos + desc->count + 1 >= j->j_blocks)
+    return false;
+  for (i = 0; i < desc->count; i++)
+    if (desc->blocks[i] < nsb->bmap_block_no ||
+        desc->blocks[i] >= nsb->block_total ||
+        (desc->blocks[i] >= j->j_start &&
+         desc->blocks[i] < j->j_start + j->j_blocks))
+      return false;
+  return true;
+}
+
+// 从日志区第1块开始，按序号依次找完整的事务（描述块和提交块都在、序号对得上），把副本拷回原位
+// 第一个不完整的事务说明提交块没写下去，它连同后面的都当没发生过
+// 返回恢复了几个事务，出错返回负的错误码
+static int naive_journal_replay(struct super_block *sb) {
+  struct naive_journal *j = &NAIVE_SBI(sb)->s_journal;
+  struct naive_journal_block *desc, *commit;
+  struct buffer_head *dbh, *cbh, *lbh, *bh;
+  int pos = 1, replayed = 0, i;
+
+  while (pos < j->j_blocks) {
+    dbh = naive_bread(sb, j->j_start + pos);
+    if (dbh == NULL)
+      return -EIO;
+    desc = (struct naive_journal_block *)dbh->b_data;
+    if (!naive_journal_desc_ok(sb, desc, pos)) {
+      brelse(dbh);
+      break;
+    }
+    cbh = naive_bread(sb, j->j_start + pos + desc->count + 1);
+    if (cbh == NULL) {
+      brelse(dbh);
+      return -EIO;
+    }
+    commit = (struct naive_journal_block *)cbh->b_data;
+    if (commit->magic != NAIVE_JOURNAL_MAGIC ||
+        commit->type != NAIVE_JOURNAL_COMMIT ||
+        commit->sequence != desc->sequence || commit->count != desc->count) {
+      brelse(cbh);
+      brelse(dbh);
+      break;
+    }
+    brelse(cbh);
+
+    for (i = 0; i < desc->count; i++) {
+      lbh = naive_bread(sb, j->j_start + pos + 1 + i);
+      bh = sb_getblk(sb, desc->blocks[i]);
+      if (lbh == NULL || bh == NULL) {
+        brelse(lbh);
+        brelse(bh);
+        brelse(dbh);
+        return -EIO;
+      }
+      lock_buffer(bh);
+      memcpy(bh->b_data, lbh->b_data, sb->s_blocksize);
+      set_buffer_uptodate(bh);
+      unlock_buffer(bh);
+      mark_buffer_dirty(bh);
+      brelse(lbh);
+      brelse(bh);
+    }
+    pos += desc->count + 2;
+    j->j_sequence++;
+    replayed++;
+    brelse(dbh);
+  }
+  return replayed;
+}
+
+// 取日志区第pos块的缓冲区，内容从src拷过来，src为NULL时清零，返回时已经标脏
+static struct buffer_head *naive_journal_getblk(struct super_block *sb, int pos,
+                                                const void *src) {
+  struct buffer_head *bh =
+      sb_getblk(sb, NAIVE_SBI(sb)->s_journal.j_start + pos);
+  if (bh == NULL)
+    return NULL;
+  lock_buffer(bh);
+  if (src != NULL)
+    memcpy(bh->b_data, src, sb->s_blocksize);
+  else
+    memset(bh->b_data, 0, sb->s_blocksize);
+  set_buffer_uptodate(bh);
+  unlock_buffer(bh);
+  mark_buffer_dirty(bh);
+  return bh;
+}
+
+// 把n个脏缓冲区一起提交写盘，等它们都写完
+static int naive_journal_write(struct buffer_head **bhs, int n) {
+  int i, err = 0;
+  ll_rw_block(SWRITE, n, bhs);
+  for (i = 0; i < n; i++) {
+    wait_on_buffer(bhs[i]);
+    if (!buffer_uptodate(bhs[i]))
+      err = -EIO;
+  }
+  return err;
+}
+
+// 检查点：等所有已提交的元数据写回原位，再在日志头记下下一个事务的序号，日志从第1块重新开始
+// 调用者持有j_barrier的写锁，或者在挂载、卸载中，总之此时没有未提交的修改
+static int naive_journal_checkpoint(struct super_block *sb) {
+  struct naive_journal *j = &NAIVE_SBI(sb)->s_journal;
+  struct naive_journal_header *jh;
+  struct buffer_head *bh;
+  int err = sync_blockdev(sb->s_bdev);
+  if (err)
+    return err;
+  bh = naive_journal_getblk(sb, 0, NULL);
+  if (bh == NULL)
+    return -EIO;
+  jh = (struct naive_journal_header *)bh->b_data;
+  jh->magic = NAIVE_JOURNAL_MAGIC;
+  jh->sequence = j->j_sequence;
+  err = naive_journal_write(&bh, 1);
+  brelse(bh);
+  if (!err)
+    j->j_head = 1;
+  return err;
+}
+
+// 提交正在运行的事务，调用者持有j_barrier的写锁
+// 描述块和各块的副本一次写下去，等它们落盘后再写提交块，提交块在盘上时副本一定是完整的
+static int __naive_journal_commit(struct super_block *sb) {
+  struct naive_journal *j = &NAIVE_SBI(sb)->s_journal;
+  struct naive_journal_block *jb;
+  int n = j->j_count, err = -EIO, i;
+
+  if (n == 0)
+    return 0;
+  memset(j->j_log, 0, sizeof(j->j_log));
+  j->j_log[0] = naive_journal_getblk(sb, j->j_head, NULL);
+  if (j->j_log[0] == NULL)
+    goto out;
+  jb = (struct naive_journal_block *)j->j_log[0]->b_data;
+  jb->magic = NAIVE_JOURNAL_MAGIC;
+  jb->type = NAIVE_JOURNAL_DESC;
+  jb->sequence = j->j_sequence;
+  jb->count = n;
+  for (i = 0; i < n; i++) {
+    jb->blocks[i] = j->j_bh[i]->b_blocknr;
+    naive_csum_meta_set(sb, j->j_bh[i]);
+    j->j_log[i + 1] =
+        naive_journal_getblk(sb, j->j_head + 1 + i, j->j_bh[i]->b_data);
+    if (j->j_log[i + 1] == NULL)
+      goto out;
+  }
+  err = naive_journal_write(j->j_log, n + 1);
+  if (err)
+    goto out;
+  for (i = 0; i <= n; i++) {
+    brelse(j->j_log[i]);
+    j->j_log[i] = NULL;
+  }
+
+  j->j_log[0] = naive_journal_getblk(sb, j->j_head + n + 1, NULL);
+  if (j->j_log[0] == NULL) {
+    err = -EIO;
+    goto out;
+  }
+  jb = (struct naive_journal_block *)j->j_log[0]->b_data;
+  jb->magic = NAIVE_JOURNAL_MAGIC;
+  jb->type = NAIVE_JOURNAL_COMMIT;
+  jb->sequence = j->j_sequence;
+  jb->count = n;
+  err = naive_journal_write(j->j_log, 1);
+
+out:
+  for (i = 0; i <= n; i++)
+    brelse(j->j_log[i]);
+  // 事务里的块现在可以写回原位了；提交失败时也只能照常写回，退化成没有日志
+  for (i = 0; i < n; i++) {
+    mark_buffer_dirty(j->j_bh[i]);
+    brelse(j->j_bh[i]);
+  }
+  j->j_count = 0;
+  if (err) {
+    printk(KERN_ERR "naivefs: %s: failed to commit transaction %d\n",
+           sb->s_id, j->j_sequence);
+    return err;
+  }
+  j->j_head += n + 2;
+  j->j_sequence++;
+  // 剩下的地方放不下一个最大的事务了，做检查点
+  if (j->j_head + j->j_max + 2 > j->j_blocks)
+    return naive_journal_checkpoint(sb);
+  return 0;
+}
+
+// 等进行中的操作都结束后提交正在运行的事务
+static int naive_journal_commit(struct super_block *sb) {
+  struct naive_journal *j = &NAIVE_SBI(sb)->s_journal;
+  u64 start;
+  int err;
+  if (j->j_blocks == 0)
+    return 0;
+  start = naive_now_ns();
+  down_write(&j->j_barrier);
+  err = __naive_journal_commit(sb);
+  up_write(&j->j_barrier);
+  naive_stat_end(sb, NAIVE_OP_COMMIT, start);
+  return err;
+}
+
+// 开始一次元数据操作，给它预留NAIVE_JOURNAL_CREDITS块；正在运行的事务放不下了就先提交掉
+static void naive_journal_start(struct super_block *sb) {
+  struct naive_journal *j = &NAIVE_SBI(sb)->s_journal;
+  if (j->j_blocks == 0)
+    return;
+  for (;;) {
+    down_read(&j->j_barrier);
+    spin_lock(&j->j_lock);
+    if (j->j_count + j->j_reserved + NAIVE_JOURNAL_CREDITS <= j->j_max) {
+      j->j_reserved += NAIVE_JOURNAL_CREDITS;
+      spin_unlock(&j->j_lock);
+      return;
+    }
+    spin_unlock(&j->j_lock);
+    up_read(&j->j_barrier);
+    naive_journal_commit(sb);
+  }
+}
+
+// 结束一次元数据操作，它改过的块留在事务里，等攒够了或者到时间了再一起提交
+static void naive_journal_stop(struct super_block *sb) {
+  struct naive_journal *j = &NAIVE_SBI(sb)->s_journal;
+  if (j->j_blocks == 0)
+    return;
+  spin_lock(&j->j_lock);
+  j->j_reserved -= NAIVE_JOURNAL_CREDITS;
+  spin_unlock(&j->j_lock);
+  up_read(&j->j_barrier);
+}
+
+// 代替mark_buffer_dirty，把改过的元数据缓冲区登记进正在运行的事务，同一块在一个事务里只记一次
+// 事务持有缓冲区的引用，提交时记下的是提交那一刻的内容
+static void naive_journal_dirty(struct super_block *sb, struct buffer_head *bh) {
+  struct naive_journal *j = &NAIVE_SBI(sb)->s_journal;
+  int i;
+  if (j->j_blocks == 0) {
+    naive_csum_meta_set(sb, bh);
+    mark_buffer_dirty(bh);
+    return;
+  }
+  // 让pdflush定期调write_super，把攒着的事务提交掉
+  sb->s_dirt = 1;
+  spin_lock(&j->j_lock);
+  for (i = 0; i < j->j_count; i++)
+    if (j->j_bh[i] == bh)
+      break;
+  if (i == j->j_count) {
+    // journal_start给每个操作预留了NAIVE_JOURNAL_CREDITS块，事务满了说明有操作改的块比预留的多，
+    // 这时既不能在事务里提交（还持有j_barrier），也不能不经日志直接写原位（操作就不原子了），只能停下
+    if (i == j->j_max) {
+      spin_unlock(&j->j_lock);
+      printk(KERN_CRIT "naivefs: %s: transaction overflow, %d blocks\n",
+             sb->s_id, j->j_max);
+      BUG();
+    }
+    get_bh(bh);
+    j->j_bh[j->j_count++] = bh;
+  }
+  spin_unlock(&j->j_lock);
+}
+
+// ============ csum.c ============
+
+// 带NAIVE_FEATURE_CSUM的镜像上，超级块、位图块、inode、目录块都带CRC32C校验和（格式见naivefs.h）
+// 读的时候校验，对不上就当读盘出错，让fsck.naive去修；写的时候更新：
+// inode在拷进inode表时就算好；位图块、目录块一次操作要改好几处，等提交事务时（没有日志的话在标脏时）再算
+// 所以缓冲区里的位图块、目录块在提交之前校验和是旧的，只能在刚从盘上读进来时校验：
+// 位图在挂载时读一次就常驻内存，目录块校验过就打上NaiveChecked，之后以内存为准
+
+static bool naive_has_csum(struct super_block *sb) {
+  return NAIVE_SB(sb)->features & NAIVE_FEATURE_CSUM;
+}
+
+static void naive_csum_error(struct super_block *sb, const char *what, int nr) {
+  atomic_long_inc(&NAIVE_SBI(sb)->s_stats.csum_errors);
+  printk(KERN_ERR "naivefs: %s: checksum error in %s %d, run fsck.naive\n",
+         sb->s_id, what, nr);
+}
+
+// inode拷进inode表之前算好校验和
+static void naive_csum_inode_set(struct super_block *sb,
+                                 struct naive_inode *ninode) {
+  if (naive_has_csum(sb))
+    ninode->checksum = naive_inode_csum(ninode);
+}
+
+static bool naive_csum_inode_ok(struct super_block *sb,
+                                struct naive_inode *ninode, int ino) {
+  if (!naive_has_csum(sb) || ninode->checksum == naive_inode_csum(ninode))
+    return true;
+  naive_csum_error(sb, "inode", ino);
+  return false;
+}
+
+// 块尾放着校验和的块（位图块、目录块）是否完好
+static bool naive_csum_block_ok(struct super_block *sb,
+                                struct buffer_head *bh) {
+  return *naive_block_csum_at(bh->b_data, sb->s_blocksize) ==
+         naive_block_csum(bh->b_blocknr, bh->b_data, sb->s_blocksize);
+}
+
+// 挂载时读进来的位图块
+static bool naive_csum_bitmap_ok(struct super_block *sb,
+                                 struct buffer_head *bh) {
+  if (!naive_has_csum(sb) || naive_csum_block_ok(sb, bh))
+    return true;
+  naive_csum_error(sb, "bitmap block", bh->b_blocknr);
+  return false;
+}
+
+// 新的目录块：块尾放好假目录项，内容以内存为准
+static void naive_csum_dir_init(struct super_block *sb, struct buffer_head *bh) {
+  struct naive_dir_tail *tail;
+  set_buffer_naive_dir(bh);
+  set_buffer_naive_checked(bh);
+  if (!naive_has_csum(sb))
+    return;
+  tail = (struct naive_dir_tail *)(bh->b_data + NAIVE_SBI(sb)->s_dir_size);
+  tail->i_ino = 0;
+  tail->rec_len = NAIVE_DIR_TAIL_SIZE;
+  tail->name_len = 0;
+  tail->file_type = NAIVE_FT_CSUM;
+}
+
+// 读出来的目录块，第一次用时校验
+// 同一目录的lookup、readdir、create都由VFS拿着目录的i_mutex，不会有人一边改一边校验
+static bool naive_csum_dir_ok(struct super_block *sb, struct buffer_head *bh) {
+  set_buffer_naive_dir(bh);
+  if (!naive_has_csum(sb) || buffer_naive_checked(bh))
+    return true;
+  if (!naive_csum_block_ok(sb, bh)) {
+    naive_csum_error(sb, "directory block", bh->b_blocknr);
+    return false;
+  }
+  set_buffer_naive_checked(bh);
+  return true;
+}
+
+// 元数据块写下去之前算好块尾的校验和，提交事务时没人在改元数据
+// 没有日志时标脏就是写回，别的线程可能正在同一个位图块上分配，拿着该块的锁算
+static void naive_csum_meta_set(struct super_block *sb, struct buffer_head *bh) {
+  struct naive_sb_info *sbi = NAIVE_SBI(sb);
+  struct naive_super_block *nsb = &sbi->s_nsb;
+  struct naive_bitmap *map;
+  int off = bh->b_blocknr - nsb->bmap_block_no;
+  unsigned int csum;
+
+  if (!naive_has_csum(sb))
+    return;
+  if (buffer_naive_dir(bh)) {
+    *naive_block_csum_at(bh->b_data, sb->s_blocksize) =
+        naive_block_csum(bh->b_blocknr, bh->b_data, sb->s_blocksize);
+    return;
+  }
+  // 带校验和的镜像都分了块组，每个块组的头两块是它的块位图和inode位图；inode表不用管
+  if (off < 0 || off % nsb->group_blocks > 1)
+    return;
+  map = off % nsb->group_blocks == 0 ? &sbi->s_bmap : &sbi->s_imap;
+  spin_lock(&map->locks[off / nsb->group_blocks]);
+  csum = naive_block_csum(bh->b_blocknr, bh->b_data, sb->s_blocksize);
+  *naive_block_csum_at(bh->b_data, sb->s_blocksize) = csum;
+  spin_unlock(&map->locks[off / nsb->group_blocks]);
+}
+
+// ============ dir.c ============
+
+// 沿目录索引往下走时，每一层索引块的信息
+struct naive_dx_frame {
+  struct buffer_head *bh;         // 索引块的缓冲区
+  struct naive_dx_entry *entries; // 该块的索引项
+  int *count;                     // 指向该块的索引项个数
+  int limit;                      // 该块最多放几个索引项
+  struct naive_dx_entry *at;      // 要找的散列值落在哪一项
+};
+
+// 分裂叶子块时用来排序的目录项
+struct naive_dx_sort_item {
+  unsigned int hash; // 文件名的散列值
+  int off;           // 目录项在暂存区里的偏移
+  int len;           // 目录项实际占的字节数
+};
+
+// readdir排序用的目录项，name指向目录块里的文件名
+struct naive_readdir_item {
+  unsigned int hash;       // 文件名的散列值，.和..记成0
+  const char *name;        // 文件名
+  int len;                 // 文件名长度
+  int ino;                 // inode号
+  unsigned char file_type; // 文件类型
+};
+
+// 目录项中记录的文件类型
+static unsigned char naive_file_type(int mode) {
+  if (S_ISDIR(mode))
+    return NAIVE_FT_DIR;
+  if (S_ISREG(mode))
+    return NAIVE_FT_REG_FILE;
+  return NAIVE_FT_UNKNOWN;
+}
+
+// 目录项中的文件类型换成readdir要报告的d_type
+static unsigned char naive_dir_type(unsigned char file_type) {
+  static const unsigned char types[] = {
+      [NAIVE_FT_UNKNOWN] = DT_UNKNOWN,
+      [NAIVE_FT_REG_FILE] = DT_REG,
+      [NAIVE_FT_DIR] = DT_DIR,
+  };
+  if (file_type >= sizeof(types))
+    return DT_UNKNOWN;
+  return types[file_type];
+}
+
+// 取目录块中偏移off处的目录项
+static struct naive_dir_record *naive_dir_at(void *block, int off) {
+  return (struct naive_dir_record *)((char *)block + off);
+}
+
+// 检查偏移off处的目录项头是否合理，坏掉的目录块不至于让遍历死循环或越界
+// size是目录项所在区域的大小，目录块是s_dir_size，内联目录是NAIVE_INLINE_DATA_LEN
+static bool naive_dir_rec_ok(struct naive_dir_record *rec, int off, int size) {
+  return rec->rec_len >= NAIVE_DIR_REC_LEN(0) && rec->rec_len % 4 == 0 &&
+         off + rec->rec_len <= size &&
+         NAIVE_DIR_REC_LEN(rec->name_len) <= rec->rec_len;
+}
+
+// 读目录的第lblock个逻辑块，没有这一块或读盘失败返回NULL
+static struct buffer_head *naive_dir_bread(struct super_block *sb,
+                                           struct naive_inode *dir_ninode,
+                                           int lblock) {
+  int block_no = naive_map_block(sb, dir_ninode, lblock, NULL);
+  struct buffer_head *bh;
+  if (block_no == 0)
+    return NULL;
+  bh = naive_bread(sb, block_no);
+  if (bh != NULL && !naive_csum_dir_ok(sb, bh)) {
+    brelse(bh);
+    return NULL;
+  }
+  return bh;
+}
+
+// 给目录追加一个空的逻辑块（只有一条占满整块的空目录项，带校验和时后面跟着假目录项），逻辑块号由*lblock带回
+// dir_ninode的extent表会变，其所在的缓冲区由调用者负责标脏
+static struct buffer_head *naive_dir_append_block(struct super_block *sb,
+                                                  struct naive_inode *dir_ninode,
+                                                  int *lblock) {
+  struct buffer_head *bh;
+  int block_no;
+  // 目录的逻辑块是连续的，没有空洞，新块的逻辑块号就是现有块数
+  *lblock = dir_ninode->block_count;
+  int count = 1;
+  // 目录块放在目录inode所在的块组里
+  block_no = naive_add_blocks(
+      sb, dir_ninode, *lblock, &count,
+      naive_inode_group_start(NAIVE_SB(sb), dir_ninode->i_ino), false);
+  if (block_no < 0)
+    return ERR_PTR(block_no);
+  bh = sb_getblk(sb, block_no);
+  if (bh == NULL)
+    return ERR_PTR(-EIO);
+  lock_buffer(bh);
+  memset(bh->b_data, 0, sb->s_blocksize);
+  naive_dir_at(bh->b_data, 0)->rec_len = NAIVE_SBI(sb)->s_dir_size;
+  naive_csum_dir_init(sb, bh);
+  set_buffer_uptodate(bh);
+  unlock_buffer(bh);
+  naive_journal_dirty(sb, bh);
+  return bh;
+}
+
+// 在目录块（或内联目录）里找名为name的目录项，找不到返回NULL
+static struct naive_dir_record *naive_find_in_block(void *block, int size,
+                                                    const char *name, int len) {
+  struct naive_dir_record *rec;
+  int off;
+  for (off = 0; off < size; off += rec->rec_len) {
+    rec = naive_dir_at(block, off);
+    if (!naive_dir_rec_ok(rec, off, size))
+      break;
+    if (rec->name_len == len && memcmp(rec->filename, name, len) == 0)
+      return rec;
+  }
+  return NULL;
+}
+
+// 在目录块（或内联目录）里找一段够大的空闲空间放下新目录项，放不下返回-ENOSPC
+// 空闲空间要么是空目录项，要么是某条目录项rec_len里超出自身长度的部分（把它切开）
+static int naive_insert_rec(void *block, int size, const char *name, int len,
+                            int ino, unsigned char type) {
+  int need = NAIVE_DIR_REC_LEN(len);
+  struct naive_dir_record *rec;
+  int off;
+  for (off = 0; off < size; off += rec->rec_len) {
+    int used;
+    rec = naive_dir_at(block, off);
+    if (!naive_dir_rec_ok(rec, off, size))
+      break;
+    used = rec->name_len ? NAIVE_DIR_REC_LEN(rec->name_len) : 0;
+    if (rec->rec_len - used < need)
+      continue;
+    if (used) {
+      struct naive_dir_record *next = naive_dir_at(rec, used);
+      next->rec_len = rec->rec_len - used;
+      rec->rec_len = used;
+      rec = next;
+    }
+    rec->i_ino = ino;
+    rec->name_len = len;
+    rec->file_type = type;
+    memcpy(rec->filename, name, len);
+    return 0;
+  }
+  return -ENOSPC;
+}
+
+// 在目录块里插入新目录项，插进去了就把块登记到日志里
+static int naive_insert_in_block(struct super_block *sb,
+                                 struct buffer_head *bh, const char *name,
+                                 int len, int ino, unsigned char type) {
+  int err = naive_insert_rec(bh->b_data, NAIVE_SBI(sb)->s_dir_size, name, len,
+                             ino, type);
+  if (!err)
+    naive_journal_dirty(sb, bh);
+  return err;
+}
+
+// 把暂存区buf里items[from, to)这些目录项紧凑地排进block，最后一条的rec_len延伸到块尾
+static void naive_dir_pack(void *block, int size, char *buf,
+                           struct naive_dx_sort_item *items, int from, int to) {
+  struct naive_dir_record *rec = NULL;
+  int off = 0, i;
+  memset(block, 0, size);
+  for (i = from; i < to; i++) {
+    rec = naive_dir_at(block, off);
+    memcpy(rec, buf + items[i].off, items[i].len);
+    rec->rec_len = items[i].len;
+    off += items[i].len;
+  }
+  if (rec == NULL) {
+    // 一条都没有，就是一个空块
+    naive_dir_at(block, 0)->rec_len = size;
+    return;
+  }
+  rec->rec_len += size - off;
+}
+
+// 在一个索引块的索引项里二分查找最后一个hash不大于给定值的项
+// 第0项覆盖该块负责的最小散列值，所以从第1项开始比
+static struct naive_dx_entry *naive_dx_search(struct naive_dx_entry *entries,
+                                              int count, unsigned int hash) {
+  int lo = 1, hi = count - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    if (entries[mid].hash > hash)
+      hi = mid - 1;
+    else
+      lo = mid + 1;
+  }
+  return entries + lo - 1;
+}
+
+// 释放沿途读出的索引块
+static void naive_dx_release(struct naive_dx_frame *frames, int n) {
+  int i;
+  for (i = 0; i < n; i++)
+    brelse(frames[i].bh);
+}
+
+// 检查索引块头里的count和limit，坏掉的索引块不至于让二分查找越界
+static bool naive_dx_frame_ok(int count, int limit, int expect) {
+  return limit == expect && count > 0 && count <= limit;
+}
+
+// 从索引根往下找散列值hash所在的叶子块，沿途的索引块依次记在frames里（由调用者释放）
+// frames[返回值-1].at->block就是叶子块的逻辑块号；出错返回负的错误码
+static int naive_dx_probe(struct super_block *sb, struct naive_inode *dir_ninode,
+                          unsigned int hash, struct naive_dx_frame *frames) {
+  struct buffer_head *bh = naive_dir_bread(sb, dir_ninode, 0);
+  int size = NAIVE_SBI(sb)->s_dir_size;
+  struct naive_dx_root *root;
+  struct naive_dx_node *node;
+  int i;
+  if (bh == NULL)
+    return -EIO;
+  root = (struct naive_dx_root *)bh->b_data;
+  if (root->levels < 0 || root->levels > NAIVE_DX_MAX_LEVELS ||
+      !naive_dx_frame_ok(root->count, root->limit, NAIVE_DX_ROOT_LIMIT(size))) {
+    brelse(bh);
+    return -EIO;
+  }
+  frames[0].bh = bh;
+  frames[0].entries = root->entries;
+  frames[0].count = &root->count;
+  frames[0].limit = root->limit;
+  frames[0].at = naive_dx_search(root->entries, root->count, hash);
+
+  for (i = 1; i <= root->levels; i++) {
+    bh = naive_dir_bread(sb, dir_ninode, frames[i - 1].at->block);
+    if (bh == NULL) {
+      naive_dx_release(frames, i);
+      return -EIO;
+    }
+    node = (struct naive_dx_node *)bh->b_data;
+    if (!naive_dx_frame_ok(node->count, node->limit, NAIVE_DX_NODE_LIMIT(size))) {
+      brelse(bh);
+      naive_dx_release(frames, i);
+      return -EIO;
+    }
+    frames[i].bh = bh;
+    frames[i].entries = node->entries;
+    frames[i].count = &node->count;
+    frames[i].limit = node->limit;
+    frames[i].at = naive_dx_search(node->entries, node->count, hash);
+  }
+  return root->levels + 1;
+}
+
+// 在frame->at之后插入一个索引项，调用者保证还有空位
+static void naive_dx_insert(struct super_block *sb,
+                            struct naive_dx_frame *frame, unsigned int hash,
+                            int block) {
+  struct naive_dx_entry *pos = frame->at + 1;
+  memmove(pos + 1, pos,
+          (frame->entries + *frame->count - pos) * sizeof(struct naive_dx_entry));
+  pos->hash = hash;
+  pos->block = block;
+  (*frame->count)++;
+  naive_journal_dirty(sb, frame->bh);
+}
+
+// 在目录中按名字找目录项，找到时返回所在块的缓冲区（由调用者释放），*res指向该目录项
+// 带索引的目录只需读索引路径上的块和一个叶子块；.和..由VFS自己处理，不会走到这里
+static struct buffer_head *naive_dir_find_entry(struct super_block *sb,
+                                                struct naive_inode *dir_ninode,
+                                                const char *name, int len,
+                                                struct naive_dir_record **res) {
+  struct buffer_head *bh;
+  int size = NAIVE_SBI(sb)->s_dir_size, i;
+
+  if (dir_ninode->flags & NAIVE_INODE_FLAG_DX) {
+    struct naive_dx_frame frames[NAIVE_DX_MAX_LEVELS + 1];
+    int n = naive_dx_probe(sb, dir_ninode, naive_name_hash(name, len), frames);
+    int leaf;
+    if (n < 0)
+      return NULL;
+    leaf = frames[n - 1].at->block;
+    naive_dx_release(frames, n);
+    bh = naive_dir_bread(sb, dir_ninode, leaf);
+    if (bh == NULL)
+      return NULL;
+    *res = naive_find_in_block(bh->b_data, size, name, len);
+    if (*res != NULL)
+      return bh;
+    brelse(bh);
+    return NULL;
+  }
+
+  // 线性目录，挨个块找
+  for (i = 0; i < dir_ninode->block_count; i++) {
+    bh = naive_dir_bread(sb, dir_ninode, i);
+    if (bh == NULL)
+      return NULL;
+    *res = naive_find_in_block(bh->b_data, size, name, len);
+    if (*res != NULL)
+      return bh;
+    brelse(bh);
+  }
+  return NULL;
+}
+
+// 线性目录的第0块满了，改成带索引的格式：
+// 第0块只留.和..，..延伸到块尾，腾出来的地方放索引根；其他目录项紧凑地搬到新的叶子块，由根的第0项指向它
+static int naive_dx_make_indexed(struct super_block *sb,
+                                 struct naive_inode *dir_ninode) {
+  struct buffer_head *root_bh, *leaf_bh;
+  struct naive_dx_root *root;
+  struct naive_dir_record *rec, *last = NULL;
+  int size = NAIVE_SBI(sb)->s_dir_size, leaf, off, leaf_off = 0;
+
+  root_bh = naive_dir_bread(sb, dir_ninode, 0);
+  if (root_bh == NULL)
+    return -EIO;
+  leaf_bh = naive_dir_append_block(sb, dir_ninode, &leaf);
+  if (IS_ERR(leaf_bh)) {
+    brelse(root_bh);
+    return PTR_ERR(leaf_bh);
+  }
+
+  // .和..总是第0块的头两条目录项，跳过它们，其余的依次搬走
+  root = (struct naive_dx_root *)root_bh->b_data;
+  off = root->dot.rec_len + naive_dir_at(root_bh->b_data, root->dot.rec_len)->rec_len;
+  for (; off < size; off += rec->rec_len) {
+    rec = naive_dir_at(root_bh->b_data, off);
+    if (!naive_dir_rec_ok(rec, off, size))
+      break;
+    if (rec->name_len == 0)
+      continue;
+    last = naive_dir_at(leaf_bh->b_data, leaf_off);
+    memcpy(last, rec, NAIVE_DIR_REC_LEN(rec->name_len));
+    last->rec_len = NAIVE_DIR_REC_LEN(rec->name_len);
+    leaf_off += last->rec_len;
+  }
+  if (last != NULL)
+    last->rec_len += size - leaf_off;
+
+  root->dot.rec_len = NAIVE_DIR_REC_LEN(1);
+  root->dotdot.rec_len = size - NAIVE_DIR_REC_LEN(1);
+  memset(&root->levels, 0,
+         size - offsetof(struct naive_dx_root, levels));
+  root->levels = 0;
+  root->limit = NAIVE_DX_ROOT_LIMIT(size);
+  root->count = 1;
+  root->entries[0].hash = 0;
+  root->entries[0].block = leaf;
+  dir_ninode->flags |= NAIVE_INODE_FLAG_DX;
+
+  naive_journal_dirty(sb, leaf_bh);
+  naive_journal_dirty(sb, root_bh);
+  brelse(leaf_bh);
+  brelse(root_bh);
+  return 0;
+}
+
+// 给目录追加一个索引节点块，开头是一条占满整块的空目录项
+static struct buffer_head *naive_dx_new_node(struct super_block *sb,
+                                             struct naive_inode *dir_ninode,
+                                             int *lblock) {
+  struct buffer_head *bh = naive_dir_append_block(sb, dir_ninode, lblock);
+  struct naive_dx_node *node;
+  if (IS_ERR(bh))
+    return bh;
+  node = (struct naive_dx_node *)bh->b_data;
+  node->count = 0;
+  node->limit = NAIVE_DX_NODE_LIMIT(NAIVE_SBI(sb)->s_dir_size);
+  naive_journal_dirty(sb, bh);
+  return bh;
+}
+
+// 保证frames[*n-1]（叶子的父索引块）还能再插一项，满了就往上分裂：
+// 从下往上找到第一个还有空位的索引块，它下面满了的各层从上往下依次对半分裂，新节点挂到上一层；
+// 一路满到根时，把根的索引项整体下移到一个新的索引节点，树长高一层，已经有NAIVE_DX_MAX_LEVELS层就只能放弃
+// 层数变了*n跟着变，frames[0, *n)总是由调用者释放
+static int naive_dx_make_room(struct super_block *sb,
+                              struct naive_inode *dir_ninode,
+                              struct naive_dx_frame *frames, int *n) {
+  struct naive_dx_frame *frame;
+  struct naive_dx_node *node;
+  struct buffer_head *bh;
+  int i, lblock, half, at;
+
+  for (i = *n - 1; i >= 0 && *frames[i].count >= frames[i].limit; i--)
+    ;
+  if (i < 0) {
+    // 根也满了，树长高一层；索引节点比根多放两项，下移后还有空位
+    struct naive_dx_root *root = (struct naive_dx_root *)frames[0].bh->b_data;
+    if (root->levels >= NAIVE_DX_MAX_LEVELS)
+      return -ENOSPC;
+    bh = naive_dx_new_node(sb, dir_ninode, &lblock);
+    if (IS_ERR(bh))
+      return PTR_ERR(bh);
+    node = (struct naive_dx_node *)bh->b_data;
+    node->count = root->count;
+    memcpy(node->entries, root->entries,
+           root->count * sizeof(struct naive_dx_entry));
+    naive_journal_dirty(sb, bh);
+    memmove(&frames[2], &frames[1], (*n - 1) * sizeof(struct naive_dx_frame));
+    frames[1].bh = bh;
+    frames[1].entries = node->entries;
+    frames[1].count = &node->count;
+    frames[1].limit = node->limit;
+    frames[1].at = node->entries + (frames[0].at - root->entries);
+    root->levels++;
+    root->count = 1;
+    root->entries[0].hash = 0;
+    root->entries[0].block = lblock;
+    frames[0].at = root->entries;
+    naive_journal_dirty(sb, frames[0].bh);
+    (*n)++;
+    i = 1;
+  }
+
+  // frames[i]有空位，它下面的各层都满了，依次对半分裂，后一半搬到新节点
+  for (i++; i < *n; i++) {
+    frame = &frames[i];
+    bh = naive_dx_new_node(sb, dir_ninode, &lblock);
+    if (IS_ERR(bh))
+      return PTR_ERR(bh);
+    node = (struct naive_dx_node *)bh->b_data;
+    half = *frame->count / 2;
+    node->count = *frame->count - half;
+    memcpy(node->entries, frame->entries + half,
+           node->count * sizeof(struct naive_dx_entry));
+    naive_journal_dirty(sb, bh);
+    *frame->count = half;
+    naive_journal_dirty(sb, frame->bh);
+    naive_dx_insert(sb, &frames[i - 1], node->entries[0].hash, lblock);
+
+    at = frame->at - frame->entries;
+    if (at >= half) {
+      // 要找的位置在后一半，换到新节点上，上一层也改指新插的那一项
+      brelse(frame->bh);
+      frame->bh = bh;
+      frame->entries = node->entries;
+      frame->count = &node->count;
+      frame->limit = node->limit;
+      frame->at = node->entries + at - half;
+      frames[i - 1].at++;
+    } else {
+      brelse(bh);
+    }
+  }
+  return 0;
+}
+
+static int naive_dx_sort_cmp(const void *a, const void *b) {
+  unsigned int ha = ((const struct naive_dx_sort_item *)a)->hash;
+  unsigned int hb = ((const struct naive_dx_sort_item *)b)->hash;
+  return ha < hb ? -1 : (ha > hb ? 1 : 0);
+}
+
+// 叶子块满了：把原有目录项和新目录项按散列值排序，按字节数对半分，后一半搬到新叶子块，
+// 再把新叶子挂到父索引块上
+// 散列值相同的目录项不会被分到两个叶子里，保证按散列值总能找到唯一的叶子
+static int naive_dx_split_leaf(struct super_block *sb,
+                               struct naive_inode *dir_ninode,
+                               struct naive_dx_frame *frames, int n,
+                               struct buffer_head *leaf_bh, const char *name,
+                               int len, int ino, unsigned char type) {
+  struct naive_dx_sort_item *items = NULL;
+  struct naive_dir_record *rec;
+  struct buffer_head *new_bh;
+  char *buf = NULL;
+  int size = NAIVE_SBI(sb)->s_dir_size;
+  int i, off, count = 0, mid, lblock, err, total = 0, left = 0;
+
+  err = naive_dx_make_room(sb, dir_ninode, frames, &n);
+  if (err) {
+    naive_dx_release(frames, n);
+    return err;
+  }
+
+  // 把叶子块和新目录项拷到暂存区，新目录项接在块尾
+  buf = kmalloc(sb->s_blocksize + NAIVE_DIR_REC_LEN(NAIVE_MAX_FILENAME_LEN),
+                GFP_NOFS);
+  items = kmalloc((sb->s_blocksize / NAIVE_DIR_REC_LEN(1) + 1) *
+                      sizeof(struct naive_dx_sort_item),
+                  GFP_NOFS);
+  if (buf == NULL || items == NULL) {
+    err = -ENOMEM;
+    goto out;
+  }
+  memcpy(buf, leaf_bh->b_data, size);
+  rec = naive_dir_at(buf, size);
+  rec->i_ino = ino;
+  rec->name_len = len;
+  rec->file_type = type;
+  memcpy(rec->filename, name, len);
+
+  for (off = 0; off < size; off += rec->rec_len) {
+    rec = naive_dir_at(buf, off);
+    if (!naive_dir_rec_ok(rec, off, size))
+      break;
+    if (rec->name_len == 0)
+      continue;
+    items[count].hash = naive_name_hash(rec->filename, rec->name_len);
+    items[count].off = off;
+    items[count].len = NAIVE_DIR_REC_LEN(rec->name_len);
+    total += items[count++].len;
+  }
+  items[count].hash = naive_name_hash(name, len);
+  items[count].off = size;
+  items[count].len = NAIVE_DIR_REC_LEN(len);
+  total += items[count++].len;
+  sort(items, count, sizeof(struct naive_dx_sort_item), naive_dx_sort_cmp,
+       NULL);
+
+  // 按字节数找中点，再挪到一个散列值变化的位置作为分界
+  for (mid = 0; mid < count && left + items[mid].len <= total / 2; mid++)
+    left += items[mid].len;
+  if (mid == 0)
+    mid = 1;
+  i = mid;
+  while (mid < count && items[mid].hash == items[mid - 1].hash)
+    mid++;
+  if (mid == count) {
+    mid = i;
+    while (mid > 0 && items[mid].hash == items[mid - 1].hash)
+      mid--;
+  }
+  for (left = 0, i = 0; i < mid; i++)
+    left += items[i].len;
+  if (mid == 0 || left > size || total - left > size) {
+    err = -ENOSPC;
+    goto out;
+  }
+
+  new_bh = naive_dir_append_block(sb, dir_ninode, &lblock);
+  if (IS_ERR(new_bh)) {
+    err = PTR_ERR(new_bh);
+    goto out;
+  }
+  naive_dir_pack(leaf_bh->b_data, size, buf, items, 0, mid);
+  naive_dir_pack(new_bh->b_data, size, buf, items, mid, count);
+  naive_journal_dirty(sb, leaf_bh);
+  naive_journal_dirty(sb, new_bh);
+  brelse(new_bh);
+  naive_dx_insert(sb, &frames[n - 1], items[mid].hash, lblock);
+
+out:
+  naive_dx_release(frames, n);
+  kfree(items);
+  kfree(buf);
+  return err;
+}
 
-  int res = nsb->data_block_no;
-  _Byte *bmap_ptr = bmap;
-  while (*(bmap_ptr++) == 0x00ff)
-    res += 8;
-  _Byte detector = 1;
-  while ((*bmap_ptr) & detector == 1) {
-    detector <<= 1;
-    res += 1;
+// 往带索引的目录里加一条目录项
+static int naive_dx_add_entry(struct super_block *sb,
+                              struct naive_inode *dir_ninode, const char *name,
+                              int len, int ino, unsigned char type) {
+  struct naive_dx_frame frames[NAIVE_DX_MAX_LEVELS + 1];
+  struct buffer_head *bh;
+  int n, err;
+
+  n = naive_dx_probe(sb, dir_ninode, naive_name_hash(name, len), frames);
+  if (n < 0)
+    return n;
+  bh = naive_dir_bread(sb, dir_ninode, frames[n - 1].at->block);
+  if (bh == NULL) {
+    naive_dx_release(frames, n);
+    return -EIO;
   }
+  err = naive_insert_in_block(sb, bh, name, len, ino, type);
+  if (err == -ENOSPC) {
+    // 叶子满了，分裂（frames在里面释放）
+    err = naive_dx_split_leaf(sb, dir_ninode, frames, n, bh, name, len, ino,
+                              type);
+  } else {
+    naive_dx_release(frames, n);
+  }
+  brelse(bh);
+  return err;
+}
 
+// 内联目录放不下了，搬到新分配的第0块上，目录项原样拷过去，最后一条的rec_len延伸到块尾
+// 目录项的偏移不变，readdir记着的位置搬完之后照样有效
+static int naive_dir_promote(struct super_block *sb,
+                             struct naive_inode *dir_ninode) {
+  char data[NAIVE_INLINE_DATA_LEN];
+  struct buffer_head *bh;
+  struct naive_dir_record *rec, *last = NULL;
+  int lblock, off;
+
+  memcpy(data, dir_ninode->inline_data, NAIVE_INLINE_DATA_LEN);
+  memset(dir_ninode->inline_data, 0, NAIVE_INLINE_DATA_LEN);
+  dir_ninode->flags &= ~NAIVE_INODE_FLAG_INLINE;
+  bh = naive_dir_append_block(sb, dir_ninode, &lblock);
+  if (IS_ERR(bh)) {
+    memcpy(dir_ninode->inline_data, data, NAIVE_INLINE_DATA_LEN);
+    dir_ninode->flags |= NAIVE_INODE_FLAG_INLINE;
+    return PTR_ERR(bh);
+  }
+  memcpy(bh->b_data, data, NAIVE_INLINE_DATA_LEN);
+  for (off = 0; off < NAIVE_INLINE_DATA_LEN; off += rec->rec_len) {
+    rec = naive_dir_at(bh->b_data, off);
+    if (!naive_dir_rec_ok(rec, off, NAIVE_INLINE_DATA_LEN))
+      break;
+    last = rec;
+  }
+  if (last != NULL)
+    last->rec_len = NAIVE_SBI(sb)->s_dir_size - ((char *)last - bh->b_data);
+  else
+    naive_dir_at(bh->b_data, 0)->rec_len = NAIVE_SBI(sb)->s_dir_size;
+  naive_journal_dirty(sb, bh);
   brelse(bh);
-  kfree(bmap);
-  return res;
+  return 0;
 }
 
-// 获取一个可用的空inode编号，与自带的new_inode不同的是，该方法采用bitmap确定空闲inode编号
-static int naive_new_inode_no(struct super_block *sb) {
-  // 取超级块
-  struct naive_super_block *nsb = NAIVE_SB(sb);
+// 往目录中加一条目录项，dir_ninode的修改（extent表、项目数等）由调用者写回
+// 新目录的目录项内联在inode里，放不下了搬到第0块；只有一块的小目录保持线性格式，
+// 第0块放不下了才改成带索引的格式
+static int naive_dir_add_entry(struct super_block *sb,
+                               struct naive_inode *dir_ninode, const char *name,
+                               int len, int ino, unsigned char type) {
+  int err;
+
+  if (dir_ninode->flags & NAIVE_INODE_FLAG_INLINE) {
+    err = naive_insert_rec(dir_ninode->inline_data, NAIVE_INLINE_DATA_LEN, name,
+                           len, ino, type);
+    if (err == 0) {
+      dir_ninode->dir_children_count++;
+      return 0;
+    }
+    err = naive_dir_promote(sb, dir_ninode);
+    if (err)
+      return err;
+  }
 
-  // 先把imap读进内存
-  int imap_size = nsb->block_total / 8; // 1bit每块，故除以8为字节数
-  _Byte *imap = kmalloc(imap_size, GFP_KERNEL);
-  // 根据布局图，inode_table_block之前为imap_block，且只有一块
-  // naivefs不考虑磁盘空间非常大，使得一块不足以支持imap存放的情况
-  struct buffer_head *bh = sb_bread(sb, NAIVE_IMAP_BLOCK);
-  memcpy(imap, (_Byte *)(bh->b_data), imap_size);
-
-  // 现在，只需要在imap找到首个为0（未使用）的位即可
-  // 简单的二进制
-  int res = NAIVE_ROOT_INODE_NO + 1;
-  _Byte *imap_ptr = imap;
-  while (*(imap_ptr++) == 0x00ff)
-    res += 8;
-  _Byte detector = 1;
-  while ((*imap_ptr) & detector == 1) {
-    detector <<= 1;
-    res += 1;
-  }
-
-  // 搞定
-  brelse(bh);
-  kfree(imap);
-  return res;
+  if (!(dir_ninode->flags & NAIVE_INODE_FLAG_DX)) {
+    struct buffer_head *bh = naive_dir_bread(sb, dir_ninode, 0);
+    if (bh == NULL)
+      return -EIO;
+    err = naive_insert_in_block(sb, bh, name, len, ino, type);
+    brelse(bh);
+    if (err == 0) {
+      dir_ninode->dir_children_count++;
+      return 0;
+    }
+    err = naive_dx_make_indexed(sb, dir_ninode);
+    if (err)
+      return err;
+  }
+
+  err = naive_dx_add_entry(sb, dir_ninode, name, len, ino, type);
+  if (!err)
+    dir_ninode->dir_children_count++;
+  return err;
 }
 
-// 把某块的bmap对应bit置值
-static void set_bmap_bit(struct super_block *sb, int block_no, bool to) {
-  // 取自定义超级块
+// 对目录块（或内联目录）中从off开始的各条目录项，预读它们的inode所在的inode表块
+// ls -l、rsync在readdir之后会逐个stat，到时候naive_get_inode大多能命中缓存，不用一个个同步等盘
+// 相邻的目录项多半是相邻创建的，inode也在同一块上，连着的同一块只发一次
+static void naive_readahead_inodes(struct super_block *sb, void *data, int off,
+                                   int size) {
   struct naive_super_block *nsb = NAIVE_SB(sb);
-  // 读出整个bmap
-  // FIXME: 在不对naivefs数据块的数量进行限制的前提下，并不一定保证bmap只占一块
-  int bmap_size = nsb->block_total / 8;
-  _Byte *bmap = kmalloc(bmap_size, GFP_KERNEL);
-  struct buffer_head *bh = sb_bread(sb, NAIVE_BMAP_BLOCK);
-  memcpy(bmap, (_Byte *)(bh->b_data), bmap_size);
-
-  // 做点数学
-  int line = block_no / 8;   // 在第几个Byte
-  int offset = block_no % 8; // 在第line个Byte的第几bit
-  int bit = to == true ? 1 : 0;
-  *(bmap + line) |= (bit << offset);
-
-  // 改完拷回去
-  // FIXME: 有没有必要一次写整块？
-  memcpy(bh->b_data, bmap, NAIVE_BLOCK_SIZE);
-  map_bh(bh, sb, NAIVE_BMAP_BLOCK);
+  struct naive_dir_record *rec;
+  int last = -1;
+  for (; off < size; off += rec->rec_len) {
+    int block_no;
+    rec = naive_dir_at(data, off);
+    if (!naive_dir_rec_ok(rec, off, size))
+      break;
+    if (rec->name_len == 0 || rec->i_ino < 0 ||
+        rec->i_ino >= nsb->inode_total)
+      continue;
+    block_no = naive_inode_block(nsb, rec->i_ino);
+    if (block_no != last)
+      naive_breadahead(sb, block_no);
+    last = block_no;
+  }
+}
 
-  brelse(bh);
+// 预读索引块frame中at之后的几个叶子块，readdir按散列值走叶子时，叶子在目录里的位置是乱的
+static void naive_dx_readahead(struct super_block *sb,
+                               struct naive_inode *dir_ninode,
+                               struct naive_dx_frame *frame) {
+  struct naive_dx_entry *e = frame->at + 1;
+  struct naive_dx_entry *end = frame->entries + *frame->count;
+  int i;
+  for (i = 0; e < end && i < NAIVE_DIR_READAHEAD; e++, i++) {
+    int count = 1;
+    int block_no = naive_map_block(sb, dir_ninode, e->block, &count);
+    if (block_no != 0)
+      naive_breadahead(sb, block_no);
+  }
 }
 
-// 把某块的imap对应bit置值
-static void set_imap_bit(struct super_block *sb, int block_no, bool to) {
-  struct naive_super_block *nsb = NAIVE_SB(sb);
-  int imap_size = nsb->block_total / 8;
-  _Byte *imap = kmalloc(imap_size, GFP_KERNEL);
-  struct buffer_head *bh = sb_bread(sb, NAIVE_IMAP_BLOCK);
-  memcpy(imap, (_Byte *)(bh->b_data), imap_size);
+// 找下一个叶子块覆盖的最小散列值，frames是刚才probe走过的路径；已经是最后一个叶子了返回false
+static bool naive_dx_next_hash(struct naive_dx_frame *frames, int n,
+                               unsigned int *hash) {
+  int i;
+  for (i = n - 1; i >= 0; i--) {
+    if (frames[i].at + 1 < frames[i].entries + *frames[i].count) {
+      *hash = frames[i].at[1].hash;
+      return true;
+    }
+  }
+  return false;
+}
 
-  int line = block_no / 8;
-  int offset = block_no % 8;
-  int bit = to == true ? 1 : 0;
-  *(imap + line) |= (bit << offset);
+// 目录项在readdir中的位置：散列值去掉最低位，32位用户态的d_off也放得下，NAIVE_DIR_POS_EOF留给目录末尾
+static unsigned int naive_dir_pos(unsigned int hash) {
+  hash >>= 1;
+  return hash < NAIVE_DIR_POS_EOF ? hash : NAIVE_DIR_POS_EOF - 1;
+}
 
-  memcpy(bh->b_data, imap, NAIVE_BLOCK_SIZE);
-  map_bh(bh, sb, NAIVE_BMAP_BLOCK);
+// readdir按散列值、再按名字排序，同一个目录每次排出来的顺序都一样
+static int naive_readdir_cmp(const void *a, const void *b) {
+  const struct naive_readdir_item *x = a, *y = b;
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  if (x->len != y->len)
+    return x->len - y->len;
+  return memcmp(x->name, y->name, x->len);
+}
 
-  brelse(bh);
+// 把目录块（或内联目录）里位置不早于from的目录项收进items，返回收了几条
+// .和..的散列值记成0，目录在内联、线性、带索引的格式之间转换时它们的位置也不变
+// 索引根块里..延伸到块尾，索引节点是一条空目录项，收出来的只有真正的目录项
+static int naive_readdir_collect(void *data, int size, unsigned int from,
+                                 struct naive_readdir_item *items) {
+  struct naive_dir_record *rec;
+  int off, count = 0;
+  for (off = 0; off < size; off += rec->rec_len) {
+    unsigned int hash;
+    rec = naive_dir_at(data, off);
+    if (!naive_dir_rec_ok(rec, off, size))
+      break;
+    if (rec->name_len == 0)
+      continue;
+    if (rec->filename[0] == '.' &&
+        (rec->name_len == 1 || (rec->name_len == 2 && rec->filename[1] == '.')))
+      hash = 0;
+    else
+      hash = naive_name_hash(rec->filename, rec->name_len);
+    if (naive_dir_pos(hash) < from)
+      continue;
+    items[count].hash = hash;
+    items[count].name = rec->filename;
+    items[count].len = rec->name_len;
+    items[count].ino = rec->i_ino;
+    items[count++].file_type = rec->file_type;
+  }
+  return count;
 }
 
-// ============ dir.c ============
+// 把排好序的items依次交给filldir，位置为from的那一组先跳过*skip条（上次已经给出去了）
+// 每给出一条，f_pos记下它所在的组，f_version记下这一组已经给出去几条；用户的缓冲区满了返回非0
+static int naive_readdir_emit(struct file *filp, void *dirent,
+                              filldir_t filldir,
+                              struct naive_readdir_item *items, int count,
+                              unsigned int from, unsigned long *skip) {
+  int i;
+  sort(items, count, sizeof(struct naive_readdir_item), naive_readdir_cmp,
+       NULL);
+  for (i = 0; i < count; i++) {
+    unsigned int pos = naive_dir_pos(items[i].hash);
+    if (pos == from && *skip > 0) {
+      (*skip)--;
+      continue;
+    }
+    // 目录项里还记着文件类型，ls、find不必再逐个stat就能区分文件和目录
+    if (filldir(dirent, items[i].name, items[i].len, pos, items[i].ino,
+                naive_dir_type(items[i].file_type)))
+      return 1;
+    if (pos != filp->f_pos) {
+      filp->f_pos = pos;
+      filp->f_version = 0;
+    }
+    filp->f_version++;
+  }
+  return 0;
+}
 
 // 这个函数说明了如何遍历一个目录，获取其中的文件信息，实现它，文件系统就可以支持ls命令
 // 注意，这里filp指向的是目录，而不是一个文件（这也是为什么它归在dops中）
 // 但在linux里万物皆文件，所以这里用的仍是file*，这略有歧义，在此说明
 // 另外，filldir_t是一个函数指针类型，也就是说filldir是一个回调函数
+// 目录项按散列值的顺序给出，f_pos记的是散列值（见naive_dir_pos），和目录项存在哪一块无关：
+// 遍历途中有文件创建，内联目录搬到块上、线性目录改成带索引的、叶子分裂，已经给出去的目录项都不会再给一遍
+// 散列值相同的目录项算一组，f_version记这一组已经给出去几条；lseek会把f_version清零
+// 用户的缓冲区满了（filldir返回非0）就停下，下次getdents从f_pos接着读，不用从头再来
 static int naive_readdir(struct file *filp, void *dirent, filldir_t filldir) {
   // 先把超级块拿到
   struct super_block *sb = filp->f_dentry->d_inode->i_sb;
   // 这样就可以拿到目录的inode了
-  int ino_of_file = filp->f_dentry->d_inode->i_ino;
-  struct naive_inode *ninode = naive_get_inode(sb, ino_of_file);
-
-  // 先考虑没有下属文件（请树立目录也是文件的概念）的情况
-  if (ninode->dir_children_count == 0 || ninode->block_count == 0)
-    return 0;
+  struct naive_inode *ninode = &NAIVE_I(filp->f_dentry->d_inode)->i_ninode;
+  struct naive_dx_frame frames[NAIVE_DX_MAX_LEVELS + 1];
+  struct naive_readdir_item *items;
+  struct buffer_head *bh, *root_bh;
+  int size = NAIVE_SBI(sb)->s_dir_size;
+  int per_block = size / NAIVE_DIR_REC_LEN(1) + 1;
+  unsigned int from, hash, next;
+  unsigned long skip, version = filp->f_version;
+  int n, leaf, count, ra = 0, stop = 0, err = 0, ret = 0;
+  bool first, more;
+  u64 start = naive_now_ns();
+
+  if (filp->f_pos >= NAIVE_DIR_POS_EOF)
+    goto out;
+  from = filp->f_pos;
+  skip = filp->f_version;
+  // 一次排一个叶子，再加上第0块里的.和..；readdir不在日志事务里，可以用GFP_KERNEL
+  items = kmalloc(2 * per_block * sizeof(struct naive_readdir_item),
+                  GFP_KERNEL);
+  if (items == NULL) {
+    ret = -ENOMEM;
+    goto out;
+  }
 
-  // 现在进入正题，读出所有文件
-  struct naive_dir_record *dir_records =
-      kmalloc(ninode->dir_children_count * NAIVE_DIR_RECORD_SIZE, GFP_KERNEL);
-  // 开始向缓冲区填信息
-  struct buffer_head *bh;
-  int i, unread_children = ninode->dir_children_count;
-  // 由于可能出现一个文件（child）占多个块的情况，因此这里的循环条件要做双重判断
-  for (i = 0; i < ninode->block_count && unread_children > 0; i++) {
-    // 读出数据块
-    bh = sb_bread(sb, ninode->block[i]);
-    // 剩下没读的record占多少字节
-    int tail_rest = unread_children * NAIVE_DIR_RECORD_SIZE;
-    // 已经读的record数
-    int head_done_records = ninode->dir_children_count - unread_children;
-    // 已经读的占多少字节
-    int head_done_bytes =
-        (ninode->dir_children_count - unread_children) * NAIVE_DIR_RECORD_SIZE;
-    if (tail_rest < NAIVE_BLOCK_SIZE) {
-      // 剩下没读的已经不足一个块，这说明sb_bread发生了超读，要进行仔细的收尾处理
-      memcpy(dir_records + head_done_records, bh->b_data, tail_rest);
-      break;
+  if (ninode->flags & NAIVE_INODE_FLAG_INLINE) {
+    // 内联目录的目录项就在inode的内存副本里
+    count = naive_readdir_collect(ninode->inline_data, NAIVE_INLINE_DATA_LEN,
+                                  from, items);
+    stop = naive_readdir_emit(filp, dirent, filldir, items, count, from, &skip);
+  } else if (!(ninode->flags & NAIVE_INODE_FLAG_DX)) {
+    // 线性目录只有第0块
+    bh = naive_dir_bread(sb, ninode, 0);
+    if (bh == NULL) {
+      err = -EIO;
     } else {
-      // 其他情况直接读即可，不用特别控制长度
-      memcpy(dir_records + head_done_records, bh->b_data, NAIVE_BLOCK_SIZE);
-      unread_children -= NAIVE_BLOCK_SIZE / NAIVE_DIR_RECORD_SIZE;
+      naive_readahead_inodes(sb, bh->b_data, 0, size);
+      count = naive_readdir_collect(bh->b_data, size, from, items);
+      stop = naive_readdir_emit(filp, dirent, filldir, items, count, from,
+                                &skip);
+      brelse(bh);
+    }
+  } else {
+    // 带索引的目录从from所在的叶子开始，一个叶子一个叶子地往散列值大的方向走，一次只持有一个叶子
+    // .和..在第0块里，和第一个叶子一起排
+    hash = from << 1;
+    for (first = true;; first = false) {
+      n = naive_dx_probe(sb, ninode, hash, frames);
+      if (n < 0) {
+        err = n;
+        break;
+      }
+      leaf = frames[n - 1].at->block;
+      // 每走NAIVE_DIR_READAHEAD个叶子，按索引预读后面的一批
+      if (ra-- == 0) {
+        naive_dx_readahead(sb, ninode, &frames[n - 1]);
+        ra = NAIVE_DIR_READAHEAD - 1;
+      }
+      more = naive_dx_next_hash(frames, n, &next);
+      root_bh = NULL;
+      count = 0;
+      if (first && from == 0) {
+        root_bh = frames[0].bh;
+        get_bh(root_bh);
+        count = naive_readdir_collect(root_bh->b_data, size, from, items);
+      }
+      naive_dx_release(frames, n);
+      bh = naive_dir_bread(sb, ninode, leaf);
+      if (bh == NULL) {
+        brelse(root_bh);
+        err = -EIO;
+        break;
+      }
+      naive_readahead_inodes(sb, bh->b_data, 0, size);
+      count += naive_readdir_collect(bh->b_data, size, from, items + count);
+      stop = naive_readdir_emit(filp, dirent, filldir, items, count, from,
+                                &skip);
+      brelse(bh);
+      brelse(root_bh);
+      if (stop || !more)
+        break;
+      // 索引里的散列值一定是递增的，不然索引坏了，再走下去可能绕圈
+      if (next <= hash) {
+        err = -EIO;
+        break;
+      }
+      hash = next;
     }
   }
-
-  // 之后，调用filldir来告知系统目录下有哪些文件
-  // 可以看到，由于我们利用dir_record来接管目录下的文件记录，此时取文件名和inode号变得无比简单
-  // 全程不需要与系统原生的dentry互动
-  loff_t pos = filp->f_pos;
-  for (i = 0; i < ninode->dir_children_count; i++) {
-    filldir(dirent, dir_records[i].filename, strlen(dir_records[i].filename),
-            pos++, dir_records[i].i_ino, DT_REG); // FIXME: DT_DIR / DT_REG？
+  kfree(items);
+  // 走到头了
+  if (!stop && !err) {
+    filp->f_pos = NAIVE_DIR_POS_EOF;
+    filp->f_version = 0;
   }
-
-  // 释放资源，搞定
-  brelse(bh);
-  kfree(dir_records);
-  return 0;
+  // 读盘失败或者校验和不对：已经给出去一些了就先返回0，f_pos停在出错之前，下次getdents再从这里读、再报错；
+  // 一条都没给出去（f_pos和f_version都没动）就报错，免得调用者把读了一半的目录当成完整的
+  if (err && filp->f_pos == from && filp->f_version == version)
+    ret = err;
+
+out:
+  naive_stat_end(sb, NAIVE_OP_READDIR, start);
+  return ret;
 }
 
 // ============ file.c ============
@@ -229,7 +2217,10 @@ static int naive_readdir(struct file *filp, void *dirent, filldir_t filldir) {
 // 创建文件
 static int naive_create(struct inode *dir, struct dentry *dentry, int mode,
                         struct nameidata *nd) {
-  return naive_mknod(dir, dentry, mode);
+  u64 start = naive_now_ns();
+  int err = naive_mknod(dir, dentry, mode);
+  naive_stat_end(dir->i_sb, NAIVE_OP_CREATE, start);
+  return err;
 }
 
 // 创建目录
@@ -238,7 +2229,10 @@ static int naive_mkdir(struct inode *dir, struct dentry *dentry, int mode,
   // 注意！根据资料，虽然naive_mkdir会被系统在创建文件夹时调用，
   // 但是调用时系统给的mode并不激活IFDIR位！这大概是一个bug。
   // 不管怎样，手动与上IFDIR。
-  return naive_mknod(dir, dentry, mode | S_IFDIR);
+  u64 start = naive_now_ns();
+  int err = naive_mknod(dir, dentry, mode | S_IFDIR);
+  naive_stat_end(dir->i_sb, NAIVE_OP_MKDIR, start);
+  return err;
 }
 
 // 该函数将帮助我们创建目录和文件，这里考虑更普遍的情况——创建结点（mknod）
@@ -248,124 +2242,152 @@ static int naive_mkdir(struct inode *dir, struct dentry *dentry, int mode,
 static int naive_mknod(struct inode *dir, struct dentry *dentry, int mode) {
   // 按照惯例，先拿超级块
   struct super_block *sb = dir->i_sb;
-
-  // 为新文件分配一个inode号
-  // FIXME: 系统是否保证create的不可重入性？
-  int inode_no_to_use = naive_new_inode_no(sb);
+  int err;
+
+  // 目录项里的name_len只有一个字节，更长的名字放不下
+  if (dentry->d_name.len > NAIVE_MAX_FILENAME_LEN)
+    return -ENAMETOOLONG;
+
+  // 新inode、两张位图、目录块、所在目录的inode都要改，整个操作作为一个整体进日志
+  naive_journal_start(sb);
+
+  // 为新文件分配一个inode号，inode位图上当场就置位了，并发的create不会拿到同一个号
+  // 后面失败了要记得把这一位清掉
+  int inode_no_to_use =
+      naive_new_inode_no(sb, naive_inode_goal(sb, dir, mode));
+  if (inode_no_to_use < 0) {
+    err = inode_no_to_use;
+    goto out_stop;
+  }
 
   // 拼装这个inode
-  struct inode *inode;
-  struct naive_inode ninode;
-  inode = new_inode(sb);
+  struct inode *inode = new_inode(sb);
+  if (inode == NULL) {
+    err = -ENOMEM;
+    goto out_ino;
+  }
+  // 自定义inode就用新inode里的内存副本，extent表等一开始都是空的
+  struct naive_inode *ninode = &NAIVE_I(inode)->i_ninode;
+  memset(ninode, 0, NAIVE_INODE_SIZE);
   inode->i_ino = inode_no_to_use;
-  ninode.i_ino = inode->i_ino;
+  ninode->i_ino = inode->i_ino;
+  // new_inode拿到的inode不在散列表里，2.6.21的__mark_inode_dirty对不在散列表里的inode什么都不做，
+  // 它既不会被write_inode写回，脏页也不会被pdflush、sync写回，要像iget得到的inode一样挂进散列表
+  insert_inode_hash(inode);
   // 这里的dir可不能给NULL了，因为已经不是根目录了
   my_inode_init_owner(inode, dir, mode);
   // 其余属性也填上去
   inode->i_op = &naive_iops;
   inode->i_atime = inode->i_ctime = inode->i_mtime = CURRENT_TIME;
-  ninode.i_atime = ninode.i_ctime = ninode.i_mtime = (inode->i_atime.tv_sec);
+  ninode->i_atime = ninode->i_ctime = ninode->i_mtime = (inode->i_atime.tv_sec);
   // inode的uid、gid等属性不用手动填，在init_owner时会继承dir的
-  ninode.i_uid = inode->i_uid;
-  ninode.i_gid = inode->i_gid;
-  ninode.i_nlink = inode->i_nlink;
-  ninode.mode = mode;
+  ninode->i_uid = inode->i_uid;
+  ninode->i_gid = inode->i_gid;
+  ninode->i_nlink = inode->i_nlink;
+  ninode->mode = mode;
 
   // 再来分类讨论一下类型
   if (S_ISDIR(mode)) {
-    inode->i_size = 1; // FIXME: 正确吗？
-    inode->i_blocks = 1;
+    inode->i_blocks = 0;
     inode->i_fop = &naive_dops;
-    ninode.block_count = 1;
-    ninode.dir_children_count = 2; // .和..
+    inode->i_mapping->a_ops = &naive_aops;
+    ninode->dir_children_count = 2; // .和..
+    // 目录的i_size记的是项目数，和read_inode保持一致，否则write_inode会把1写回去
+    inode->i_size = ninode->dir_children_count;
     // 把.和..加进去
-    // 先处理.，分配这个inode管辖的第一个块
-    int block_no_to_use = naive_new_block_no(sb);
-    ninode.block[0] = block_no_to_use;
-    // 然后把这条记录准备一下
-    struct naive_dir_record dir_dots[2];
-    strcpy(dir_dots[0].filename, ".");
-    dir_dots[0].i_ino = inode_no_to_use;
+    // 新目录先不分配块，.和..内联在inode里，..的rec_len延伸到内联区末尾，新目录项从它后面切出去
+    // 空目录和只有一两项的小目录就省下了一个块，mkdir也不用读写目录块
+    ninode->flags |= NAIVE_INODE_FLAG_INLINE;
+    struct naive_dir_record *dir_dots = naive_dir_at(ninode->inline_data, 0);
+    dir_dots->i_ino = inode_no_to_use;
+    dir_dots->rec_len = NAIVE_DIR_REC_LEN(1);
+    dir_dots->name_len = 1;
+    dir_dots->file_type = NAIVE_FT_DIR;
+    memcpy(dir_dots->filename, ".", 1);
     // 再处理..
-    strcpy(dir_dots[1].filename, "..");
+    dir_dots = naive_dir_at(ninode->inline_data, NAIVE_DIR_REC_LEN(1));
     // 注意，它归属的inode是上级目录的inode，不是该目录的inode
-    dir_dots[1].i_ino = dir->i_ino;
-    // 把自定义inode信息和目录记录都写进磁盘
-    write_back_ninode(sb, &ninode);
-    write_back_block(sb, block_no_to_use, dir_dots, 2 * NAIVE_DIR_RECORD_SIZE);
-    // 更新block的位图
-    set_bmap_bit(sb, block_no_to_use, true);
-
-    // FIXME: 应把整个文件系统的空闲块减1
+    dir_dots->i_ino = dir->i_ino;
+    dir_dots->rec_len = NAIVE_INLINE_DATA_LEN - NAIVE_DIR_REC_LEN(1);
+    dir_dots->name_len = 2;
+    dir_dots->file_type = NAIVE_FT_DIR;
+    memcpy(dir_dots->filename, "..", 2);
+    // 把自定义inode信息写进磁盘
+    write_back_ninode(sb, ninode);
   } else if (S_ISREG(mode)) {
     // 建立新的文件（空文件）并不占据数据块，这样就简单多了，不需要和块打交道
     inode->i_size = 0;
     inode->i_blocks = 0;
     inode->i_fop = &naive_fops;
     inode->i_mapping->a_ops = &naive_aops;
-    ninode.block_count = 0;
-    ninode.file_size = 0;
-    write_back_ninode(sb, &ninode);
+    ninode->file_size = 0;
+    // 新文件先内联，写的内容不超过NAIVE_INLINE_DATA_LEN就一直放在inode里
+    ninode->flags |= NAIVE_INODE_FLAG_INLINE;
+    // 第一块放在所在目录的块附近，同一目录下的文件在盘上挨得近些
+    // 分了块组的话新inode就在目录的块组里，从块组开头找；老镜像找目录的第一块，内联目录没有块，不在乎位置
+    if (NAIVE_SB(sb)->group_blocks != 0)
+      NAIVE_I(inode)->i_goal =
+          naive_inode_group_start(NAIVE_SB(sb), inode_no_to_use);
+    else if (NAIVE_I(dir)->i_ninode.flags & NAIVE_INODE_FLAG_INLINE)
+      NAIVE_I(inode)->i_goal = -1;
+    else
+      NAIVE_I(inode)->i_goal = NAIVE_I(dir)->i_ninode.extents[0].start;
+    write_back_ninode(sb, ninode);
   } else {
+    // 已经挂进散列表了，i_nlink清零后iput才会把它删掉，不然这个inode号再分出去时iget会找到它
     make_bad_inode(inode);
-    return 0;
+    inode->i_nlink = 0;
+    iput(inode);
+    err = 0;
+    goto out_ino;
   }
 
   // 处理完新文件自身，我们还得处理它所在的目录
-  // 先给所在目录加一条dir_record，关联到这个新文件
-  struct naive_dir_record new_dir_record;
-  strcpy(new_dir_record.filename, dentry->d_name.name);
-  new_dir_record.i_ino = inode_no_to_use;
-  // 写回
-  struct naive_inode *dir_ninode = naive_get_inode(sb, dir->i_ino);
-  struct buffer_head *bh = sb_bread(sb, dir_ninode->block[0]);
-  // 追加在原有的children记录末尾
-  memcpy(bh->b_data + dir_ninode->dir_children_count * NAIVE_DIR_RECORD_SIZE,
-         &new_dir_record, NAIVE_DIR_RECORD_SIZE);
-  map_bh(bh, sb, ninode.block[0]);
-  brelse(bh);
-  // 再给目录的自定义inode增加一个children
-  dir_ninode->dir_children_count++;
-  write_back_ninode(sb, dir_ninode);
-
-  // 告诉系统这些inode是脏的
-  mark_inode_dirty(inode);
+  // 给所在目录加一条dir_record，关联到这个新文件
+  // 同一目录下的create由VFS的i_mutex串起来，这里再拿目录的i_map_lock，挡住同时在写回目录的write_inode
+  struct naive_inode *dir_ninode = &NAIVE_I(dir)->i_ninode;
+  mutex_lock(&NAIVE_I(dir)->i_map_lock);
+  err = naive_dir_add_entry(sb, dir_ninode, dentry->d_name.name,
+                            dentry->d_name.len, inode_no_to_use,
+                            naive_file_type(mode));
+  // 目录的extent表、项目数可能都变了，它们都在dir的内存副本里，标脏后由write_inode写回
+  // 原生inode的i_size记的也是项目数，同步一下，免得write_inode时写回旧值
+  dir->i_size = dir_ninode->dir_children_count;
+  mutex_unlock(&NAIVE_I(dir)->i_map_lock);
   mark_inode_dirty(dir);
+  if (err)
+    goto out_free;
 
-  // 更新inode的位图，因为我们新拿了一个inode且分配了
-  set_imap_bit(sb, inode_no_to_use, true);
+  // 告诉系统新inode是脏的
+  mark_inode_dirty(inode);
 
   // 把新文件的inode关联到dentry上
   d_instantiate(dentry, inode);
+  naive_journal_stop(sb);
   return 0;
-}
 
-// 把变化的数据块写回盘
-static void write_back_block(struct super_block *sb, int block_no, void *data,
-                             int size) {
-  struct naive_super_block *nsb = NAIVE_SB(sb);
-  struct buffer_head *bh = sb_bread(sb, nsb->data_block_no + block_no);
-  memcpy(bh->b_data, data, size);
-  map_bh(bh, sb, nsb->data_block_no + block_no);
-  brelse(bh);
+out_free:
+  // 目录项没加上；新目录的.和..内联在inode里，没有块要还
+  inode->i_nlink = 0;
+  iput(inode);
+out_ino:
+  set_imap_bit(sb, inode_no_to_use, false);
+out_stop:
+  naive_journal_stop(sb);
+  return err;
 }
 
 // 把自定义inode写回盘
 static void write_back_ninode(struct super_block *sb,
                               struct naive_inode *ninode) {
-  struct naive_super_block *nsb = NAIVE_SB(sb);
-
-  // 应该放到inode表的哪个块
-  int block_no = nsb->inode_table_block_no + ninode->i_ino;
-
-  // 现在开始上盘
-  struct buffer_head *bh = sb_bread(sb, block_no);
-  // 块首指针
-  struct naive_inode *block_head = (struct naive_inode *)bh->b_data;
-  memcpy(block_head, ninode, NAIVE_INODE_SIZE);
-  // sb_bread只是读出来放到内存，前面更改的也是内存，并没有写回盘
-  // 建立映射
-  map_bh(bh, sb, block_no);
+  // 找到这个inode在inode表中的位置，拷进去后登记到日志里
+  struct buffer_head *bh;
+  struct naive_inode *slot = naive_get_inode(sb, ninode->i_ino, &bh);
+  if (slot == NULL)
+    return;
+  naive_csum_inode_set(sb, ninode);
+  memcpy(slot, ninode, NAIVE_INODE_SIZE);
+  naive_journal_dirty(sb, bh);
 
   // 完事
   brelse(bh);
@@ -389,11 +2411,66 @@ void my_inode_init_owner(struct inode *inode, const struct inode *dir,
 }
 
 // 相当于naive_write_inode的实现
+// 系统要新的inode时从我们的slab里分配，这样每个原生inode都带着自定义inode的内存副本
+// mknod是在日志事务里调new_inode的，用GFP_KERNEL的话直接回收可能去写naivefs的脏页，
+// 写页时分配块又要开事务，再次down_read(j_barrier)会排在等着提交的down_write后面，死锁；和ext3一样用GFP_NOFS
+static struct inode *naive_alloc_inode(struct super_block *sb) {
+  struct naive_inode_info *ni = kmem_cache_alloc(naive_inode_cachep, GFP_NOFS);
+  if (ni == NULL)
+    return NULL;
+  ni->i_goal = -1;
+  ni->i_reserved = 0;
+  ni->i_meta_reserved = 0;
+  return &ni->vfs_inode;
+}
+
+static void naive_destroy_inode(struct inode *inode) {
+  kmem_cache_free(naive_inode_cachep, NAIVE_I(inode));
+}
+
+// inode要从内存里清掉了，页缓存已经作废，这时还记着的预留（比如页没经过invalidatepage就被丢掉了）都还回去
+static void naive_clear_inode(struct inode *inode) {
+  struct naive_inode_info *ni = NAIVE_I(inode);
+  if (ni->i_reserved != 0 || ni->i_meta_reserved != 0)
+    naive_release_blocks(inode, ni->i_reserved);
+}
+
+// slab对象第一次构造时初始化原生inode中只需初始化一次的部分（锁、链表等）
+static void naive_init_once(void *foo, struct kmem_cache *cachep,
+                            unsigned long flags) {
+  struct naive_inode_info *ni = foo;
+  if ((flags & (SLAB_CTOR_VERIFY | SLAB_CTOR_CONSTRUCTOR)) ==
+      SLAB_CTOR_CONSTRUCTOR) {
+    inode_init_once(&ni->vfs_inode);
+    mutex_init(&ni->i_map_lock);
+  }
+}
+
+// 模块加载时建好inode的slab，卸载时销毁
+static int naive_init_inodecache(void) {
+  naive_inode_cachep = kmem_cache_create(
+      "naive_inode_cache", sizeof(struct naive_inode_info), 0,
+      SLAB_RECLAIM_ACCOUNT | SLAB_MEM_SPREAD, naive_init_once, NULL);
+  if (naive_inode_cachep == NULL)
+    return -ENOMEM;
+  return 0;
+}
+
+static void naive_destroy_inodecache(void) {
+  kmem_cache_destroy(naive_inode_cachep);
+}
+
+// 先把原生inode上的属性同步到内存副本，再把整个副本拷进inode表
 static struct buffer_head *naive_update_inode(struct inode *inode) {
   struct buffer_head *bh;
-  struct naive_inode *ninode = naive_get_inode(inode->i_sb, inode->i_ino);
+  struct naive_inode *ninode = &NAIVE_I(inode)->i_ninode;
+  struct naive_inode *slot = naive_get_inode(inode->i_sb, inode->i_ino, &bh);
+  if (slot == NULL)
+    return NULL;
 
   // 就是反过来填信息，不加注释了
+  // extent表、内联数据可能正被写回线程改着，拷贝时拿着i_map_lock，盘上不会出现改了一半的inode
+  mutex_lock(&NAIVE_I(inode)->i_map_lock);
   ninode->mode = inode->i_mode;
   ninode->i_uid = inode->i_uid;
   ninode->i_gid = inode->i_gid;
@@ -409,9 +2486,12 @@ static struct buffer_head *naive_update_inode(struct inode *inode) {
   ninode->i_atime = inode->i_atime.tv_sec;
   ninode->i_ctime = inode->i_ctime.tv_sec;
   ninode->i_mtime = inode->i_mtime.tv_sec;
+  naive_csum_inode_set(inode->i_sb, ninode);
+  memcpy(slot, ninode, NAIVE_INODE_SIZE);
+  mutex_unlock(&NAIVE_I(inode)->i_map_lock);
 
-  // 然后把这个块加标脏标记，告知系统已经修改
-  mark_buffer_dirty(bh);
+  // 然后把这个块登记到日志里，随事务提交后再写回原位
+  naive_journal_dirty(inode->i_sb, bh);
 
   return bh;
 }
@@ -420,15 +2500,37 @@ static struct buffer_head *naive_update_inode(struct inode *inode) {
 // 这里借鉴minix的写法，代理个update_inode，看起来比较专业
 static int naive_write_inode(struct inode *inode, int wait) {
   // 跟进去看看，说白了就是read_inode的逆方法
+  u64 start = naive_now_ns();
+  int err = 0;
+  naive_journal_start(inode->i_sb);
   brelse(naive_update_inode(inode));
-  return 0;
+  naive_journal_stop(inode->i_sb);
+  // fsync等要求落盘的场合，提交事务就算落盘了，不必等它写回原位
+  if (wait)
+    err = naive_journal_commit(inode->i_sb);
+  naive_stat_end(inode->i_sb, NAIVE_OP_WRITE_INODE, start);
+  return err;
 }
 
 // 从磁盘中读出指定inode，即自定义inode转原生inode
 // 作为参数传入的inode，需要的i_ino、i_sb属性被设置好，该函数需要填充其他属性
 static void naive_read_inode(struct inode *inode) {
-  // 先取到自定义inode再说
-  struct naive_inode *ninode = naive_get_inode(inode->i_sb, inode->i_ino);
+  // 先取到自定义inode再说，解码一次存进内存副本，之后各处就不用再读inode表了
+  struct buffer_head *bh;
+  struct naive_inode *ninode = &NAIVE_I(inode)->i_ninode;
+  u64 start = naive_now_ns();
+  struct naive_inode *slot = naive_get_inode(inode->i_sb, inode->i_ino, &bh);
+  if (slot == NULL || !naive_csum_inode_ok(inode->i_sb, slot, inode->i_ino)) {
+    brelse(bh);
+    make_bad_inode(inode);
+    naive_stat_end(inode->i_sb, NAIVE_OP_READ_INODE, start);
+    return;
+  }
+  memcpy(ninode, slot, NAIVE_INODE_SIZE);
+  brelse(bh);
+  // 还没有块的文件，第一块从inode所在的块组里找
+  NAIVE_I(inode)->i_goal =
+      naive_inode_group_start(NAIVE_SB(inode->i_sb), inode->i_ino);
   // 注意，存在盘上的都是自定义inode
   // 也就是说，只有ninode上才有有效信息，inode->i_mode等其他各项属性都是不可靠、需要填充的
   inode->i_mode = ninode->mode;
@@ -441,72 +2543,731 @@ static void naive_read_inode(struct inode *inode) {
     inode->i_op = &naive_iops;
     inode->i_fop = &naive_fops;
     inode->i_mapping->a_ops = &naive_aops;
-    inode->i_size = ninode->dir_children_count; // TODO: 合适吗？
+    inode->i_size = ninode->file_size;
+    inode->i_blocks = ninode->block_count * (inode->i_sb->s_blocksize >> 9);
   } else if (S_ISDIR(ninode->mode)) {
     // 是一个目录
     inode->i_op = &naive_iops;
     inode->i_fop = &naive_dops;
     inode->i_mapping->a_ops = &naive_aops;
-    inode->i_size = ninode->file_size;
+    inode->i_size = ninode->dir_children_count;
   } else {
     // lnk、tty等类型不支持
     make_bad_inode(inode);
   }
+  naive_stat_end(inode->i_sb, NAIVE_OP_READ_INODE, start);
 }
 
 // 根据inode编号在指定文件系统实例（一个超级块对应一个文件系统实例）的inode表中取出对应的自定义inode
-static struct naive_inode *naive_get_inode(struct super_block *sb, int ino) {
+// 返回的指针指向*p的数据，用完后调用者要brelse(*p)；读盘失败返回NULL
+static struct naive_inode *naive_get_inode(struct super_block *sb, int ino,
+                                           struct buffer_head **p) {
   // 先取出自定义超级块信息
   struct naive_super_block *nsb = NAIVE_SB(sb);
 
-  // naive只有一个超级块、只有一个BlockGroup
-  // 而且为了简单，我们的inode每个占一块
-  // 故下面这个简单的算式就可以算得ino对应inode在inode表中所在的块号
-  int block_no_of_ino = nsb->inode_table_block_no + ino; // FIXME
-  // 找一个bh，读出整个块
-  struct buffer_head *bh = sb_bread(sb, block_no_of_ino);
-  struct naive_inode *ninode = (struct naive_inode *)bh->b_data;
+  // inode表的每块紧凑地放着NAIVE_INODES_PER_BLOCK个inode，先算出所在的块（分了块组的话在inode所属块组的那一段inode表里），
+  // 再算块内偏移；每个块组的inode数是每块inode数的整数倍，块内偏移不受块组影响
+  int block_no_of_ino = naive_inode_block(nsb, ino);
+  int offset = ino % NAIVE_SBI(sb)->s_inodes_per_block;
+  // 找一个bh，读出整个块；相邻的inode共用这个块，stat一批文件时大多命中缓存
+  struct buffer_head *bh = naive_bread(sb, block_no_of_ino);
+  *p = bh;
+  if (bh == NULL)
+    return NULL;
+
+  return (struct naive_inode *)bh->b_data + offset;
+}
+
+// 最坏情况下每个延迟块写回时都接不上前面的块、各自新开一个extent，
+// 有n个延迟块的文件为此可能要新分配几个间接extent块；extent_count只在i_map_lock里变，这里读到旧值只会多算
+// 写回时先加extent、后还预留，中间这一会儿算出来的也只会偏多
+static int naive_meta_blocks(struct inode *inode, int n) {
+  struct super_block *sb = inode->i_sb;
+  int extents = NAIVE_I(inode)->i_ninode.extent_count;
+  return naive_extent_blocks(sb, extents + n) - naive_extent_blocks(sb, extents);
+}
+
+// 给延迟分配的一块记预留：整个文件系统剩下的空闲块要够所有已预留的块用，不够就是-ENOSPC
+// 顺带按最坏情况替间接extent块预留，写回时extent表长到要新的间接extent块也有块可用
+// 老镜像的extent表有上限，最坏情况下装不下了返回-EFBIG，由调用者改成马上分配，
+// 这样表真的满了时错误在写入时就报出来，而不是写回时把数据丢掉
+static int naive_reserve_block(struct inode *inode) {
+  struct super_block *sb = inode->i_sb;
+  struct naive_sb_info *sbi = NAIVE_SBI(sb);
+  struct naive_inode_info *ni = NAIVE_I(inode);
+  int meta, need;
+  spin_lock(&sbi->s_resv_lock);
+  if (!naive_extent_chain(sb) &&
+      ni->i_ninode.extent_count + ni->i_reserved + 1 >
+          NAIVE_MAX_EXTENTS(sb->s_blocksize)) {
+    spin_unlock(&sbi->s_resv_lock);
+    return -EFBIG;
+  }
+  meta = naive_meta_blocks(inode, ni->i_reserved + 1);
+  need = 1 + meta - ni->i_meta_reserved;
+  if (atomic_read(&sbi->s_bmap.total_free) - sbi->s_reserved < need) {
+    spin_unlock(&sbi->s_resv_lock);
+    return -ENOSPC;
+  }
+  sbi->s_reserved += need;
+  ni->i_reserved++;
+  ni->i_meta_reserved = meta;
+  spin_unlock(&sbi->s_resv_lock);
+  return 0;
+}
+
+// 写回时有n个延迟分配的块真正分配了（或者被丢掉了），归还它们的预留
+// 替间接extent块预留的块数按剩下的延迟块重算，用掉的、用不着的一并还回去
+static void naive_release_blocks(struct inode *inode, int n) {
+  struct naive_sb_info *sbi = NAIVE_SBI(inode->i_sb);
+  struct naive_inode_info *ni = NAIVE_I(inode);
+  int meta;
+  spin_lock(&sbi->s_resv_lock);
+  ni->i_reserved -= n;
+  meta = naive_meta_blocks(inode, ni->i_reserved);
+  sbi->s_reserved -= n + ni->i_meta_reserved - meta;
+  ni->i_meta_reserved = meta;
+  spin_unlock(&sbi->s_resv_lock);
+}
+
+// 文件的第block块是不是一个还在等写回分配的延迟块，看页缓存里对应的缓冲区就知道
+static bool naive_block_delayed(struct inode *inode, sector_t block) {
+  int bits = PAGE_CACHE_SHIFT - inode->i_blkbits;
+  struct page *page = find_get_page(inode->i_mapping, block >> bits);
+  struct buffer_head *bh;
+  bool res = false;
+  int i;
+  if (page == NULL)
+    return false;
+  if (page_has_buffers(page)) {
+    bh = page_buffers(page);
+    for (i = block & ((1 << bits) - 1); i > 0; i--)
+      bh = bh->b_this_page;
+    res = buffer_delay(bh);
+  }
+  page_cache_release(page);
+  return res;
+}
+
+// 把文件内的逻辑块号iblock映射到盘上的块，结果通过map_bh填进bh_result，这是页缓存读写文件数据的基础
+// create为真时（写回），没有映射的块就现分配，接在文件已有extent的后面
+// 要分配的是延迟块的话，后面紧跟着的延迟块也一起分配，一次拿到盘上连续的一段；
+// 不是延迟块（直接I/O往文件末尾之后写）就按调用者要的块数一次分配
+// 调用者可以在bh_result->b_size里要求一次映射多块，这里把同一extent里连续的块一并给出，
+// mpage据此拼出跨多页的大bio
+static int naive_get_block(struct inode *inode, sector_t iblock,
+                           struct buffer_head *bh_result, int create) {
+  struct super_block *sb = inode->i_sb;
+  unsigned long max_blocks = bh_result->b_size >> inode->i_blkbits;
+  struct naive_inode_info *ni = NAIVE_I(inode);
+  struct naive_inode *ninode = &ni->i_ninode;
+  int count = 1, block_no;
+  bool delayed;
+
+  // 写回线程和读页的线程可能同时在查、改同一个文件的extent表，都在i_map_lock里做
+  // i_map_lock总是在日志事务里面拿（write_inode也是），所以要分配时先放锁、开事务、再拿锁重查一遍
+  // 内联文件不走块映射，要写到块上的路径都先把它搬到块上了；内联标志也在锁里看
+  mutex_lock(&ni->i_map_lock);
+  if (ninode->flags & NAIVE_INODE_FLAG_INLINE) {
+    mutex_unlock(&ni->i_map_lock);
+    return -EIO;
+  }
+  block_no = naive_map_block(sb, ninode, iblock, &count);
+  if (block_no == 0 && create) {
+    mutex_unlock(&ni->i_map_lock);
+    naive_journal_start(sb);
+    mutex_lock(&ni->i_map_lock);
+    count = 1;
+    block_no = naive_map_block(sb, ninode, iblock, &count);
+    if (block_no == 0)
+      goto alloc;
+    naive_journal_stop(sb);
+  }
+  mutex_unlock(&ni->i_map_lock);
+  if (block_no != 0) {
+    // 延迟块可能在前面的块写回时已经顺带分配了，预留那时就还掉了
+    clear_buffer_delay(bh_result);
+    // map_bh会把b_size改成一块，先映射再改回连续的长度
+    map_bh(bh_result, sb, block_no);
+    if (max_blocks > 1)
+      bh_result->b_size = min(max_blocks, (unsigned long)count)
+                          << inode->i_blkbits;
+    return 0;
+  }
+  return 0; // 空洞（或者还没分配的延迟块），读出来是全0
+
+alloc:
+  delayed = buffer_delay(bh_result);
+  count = 1;
+  if (delayed)
+    while (count < NAIVE_MAX_ALLOC_RUN &&
+           naive_block_delayed(inode, iblock + count))
+      count++;
+  else
+    count = min_t(unsigned long, max_blocks, NAIVE_MAX_ALLOC_RUN);
+  // 位图和间接extent块进日志；数据块本身不进日志
+  block_no = naive_add_blocks(sb, ninode, iblock, &count, ni->i_goal, delayed);
+  if (block_no >= 0) {
+    ni->i_goal = block_no + count;
+    inode->i_blocks = ninode->block_count * (sb->s_blocksize >> 9);
+  }
+  mutex_unlock(&ni->i_map_lock);
+  naive_journal_stop(sb);
+  if (block_no < 0)
+    return block_no;
+  if (delayed) {
+    clear_buffer_delay(bh_result);
+    naive_release_blocks(inode, count);
+  }
+  // extent表变了，标脏后由write_inode写回
+  mark_inode_dirty(inode);
+  set_buffer_new(bh_result);
+  map_bh(bh_result, sb, block_no);
+  if (max_blocks > 1)
+    bh_result->b_size = min(max_blocks, (unsigned long)count)
+                        << inode->i_blkbits;
+  return 0;
+}
+
+// prepare_write用的块映射：已经分配了的照常映射，没分配的只预留一块，标成延迟分配，等写回时再分配
+// 这样一个文件攒了多少脏页，写回时就能一次分到多长的连续块，几个文件交替追加也不会在盘上交错
+static int naive_get_block_delay(struct inode *inode, sector_t iblock,
+                                 struct buffer_head *bh_result, int create) {
+  int err = naive_get_block(inode, iblock, bh_result, 0);
+  if (err || buffer_mapped(bh_result) || buffer_delay(bh_result))
+    return err;
+  err = naive_reserve_block(inode);
+  // 老镜像的extent表按最坏情况已经不够用了，这一块不再延迟，马上分配
+  if (err == -EFBIG)
+    return naive_get_block(inode, iblock, bh_result, 1);
+  if (err)
+    return err;
+  set_buffer_delay(bh_result);
+  // 让block_prepare_write把块里没写到的部分清零；它还会按b_blocknr去清块设备上同一块的缓存（去掉脏标记），
+  // 延迟块还没有盘上的位置，不能指向真实的块：块大小大于512时第0块就是超级块所在的块，会把超级块的修改丢掉
+  // 给一个哪个设备都没有的块号，按它在块设备的页缓存里什么也找不到
+  set_buffer_new(bh_result);
+  bh_result->b_bdev = inode->i_sb->s_bdev;
+  bh_result->b_blocknr = ~(sector_t)0;
+  return 0;
+}
+
+// 拿i_map_lock看文件是不是内联的，是就持着锁返回真，调用者在锁里读写inode里的内容，用完自己放锁
+// naive_inline_promote也在这把锁里改标志，所以不会读到搬了一半的inode；搬到块上是单向的，
+// 锁里看到不是内联，之后也一直不是，放了锁直接走块映射即可
+static bool naive_inline_lock(struct inode *inode) {
+  struct naive_inode_info *ni = NAIVE_I(inode);
+  mutex_lock(&ni->i_map_lock);
+  if (ni->i_ninode.flags & NAIVE_INODE_FLAG_INLINE)
+    return true;
+  mutex_unlock(&ni->i_map_lock);
+  return false;
+}
+
+// 内联文件的页不读盘：第0页拷inode里的内容，其余部分（和其他页）都是0
+// 调用者持有i_map_lock
+static void naive_inline_fill_page(struct inode *inode, struct page *page) {
+  struct naive_inode *ninode = &NAIVE_I(inode)->i_ninode;
+  char *kaddr = kmap_atomic(page, KM_USER0);
+  int n = 0;
+  if (page->index == 0)
+    n = min_t(loff_t, inode->i_size, NAIVE_INLINE_DATA_LEN);
+  memcpy(kaddr, ninode->inline_data, n);
+  memset(kaddr + n, 0, PAGE_CACHE_SIZE - n);
+  kunmap_atomic(kaddr, KM_USER0);
+  flush_dcache_page(page);
+  SetPageUptodate(page);
+}
+
+// 内联文件要写到NAIVE_INLINE_DATA_LEN之外了，把内容搬到新分配的第0块上，之后就是普通文件
+// 数据块不经日志，这里先同步写下去，日志里的inode再指向它，崩溃后不会指向没写过的块
+// 调用者持有i_mutex
+static int naive_inline_promote(struct inode *inode) {
+  struct super_block *sb = inode->i_sb;
+  struct naive_inode_info *ni = NAIVE_I(inode);
+  struct naive_inode *ninode = &ni->i_ninode;
+  char data[NAIVE_INLINE_DATA_LEN];
+  int n = min_t(loff_t, inode->i_size, NAIVE_INLINE_DATA_LEN);
+  struct buffer_head *bh;
+  int count = 1, block_no;
+
+  // 和write_inode、mmap的写回错开，免得它们看到一半内联一半extent的inode
+  naive_journal_start(sb);
+  mutex_lock(&ni->i_map_lock);
+  memcpy(data, ninode->inline_data, NAIVE_INLINE_DATA_LEN);
+  memset(ninode->inline_data, 0, NAIVE_INLINE_DATA_LEN);
+  ninode->flags &= ~NAIVE_INODE_FLAG_INLINE;
+  block_no = 0;
+  if (n > 0)
+    block_no = naive_add_blocks(sb, ninode, 0, &count, ni->i_goal, false);
+  if (block_no < 0) {
+    memcpy(ninode->inline_data, data, NAIVE_INLINE_DATA_LEN);
+    ninode->flags |= NAIVE_INODE_FLAG_INLINE;
+  }
+  mutex_unlock(&ni->i_map_lock);
+  naive_journal_stop(sb);
+  if (block_no < 0)
+    return block_no;
+  if (n > 0) {
+    bh = sb_getblk(sb, block_no);
+    if (bh == NULL)
+      return -EIO;
+    lock_buffer(bh);
+    memcpy(bh->b_data, data, n);
+    memset(bh->b_data + n, 0, sb->s_blocksize - n);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    sync_dirty_buffer(bh);
+    brelse(bh);
+    ni->i_goal = block_no + 1;
+    inode->i_blocks = ninode->block_count * (sb->s_blocksize >> 9);
+  }
+  mark_inode_dirty(inode);
+  return 0;
+}
+
+// 下面这些aops都是套用系统自带的mpage/block帮助函数，块映射全靠naive_get_block
+// 内联文件的内容就在inode里，读写都不经过块映射
+static int naive_readpage(struct file *file, struct page *page) {
+  struct inode *inode = page->mapping->host;
+  if (naive_inline_lock(inode)) {
+    naive_inline_fill_page(inode, page);
+    mutex_unlock(&NAIVE_I(inode)->i_map_lock);
+    unlock_page(page);
+    return 0;
+  }
+  return mpage_readpage(page, naive_get_block);
+}
+
+// 顺序读时系统的预读会一次给一批页，mpage按extent把连续的页合成一个bio
+// 内联文件一页都不读，系统会退回去逐页调readpage
+static int naive_readpages(struct file *file, struct address_space *mapping,
+                           struct list_head *pages, unsigned nr_pages) {
+  if (naive_inline_lock(mapping->host)) {
+    mutex_unlock(&NAIVE_I(mapping->host)->i_map_lock);
+    return 0;
+  }
+  return mpage_readpages(mapping, pages, nr_pages, naive_get_block);
+}
+
+// 内联文件的页只会被mmap写脏，把内容拷回inode就算写回了
+// 写回时文件可能正被并发的write搬到块上，在i_map_lock里确认还是内联的才往inode里拷，否则按普通文件写
+static int naive_writepage(struct page *page, struct writeback_control *wbc) {
+  struct inode *inode = page->mapping->host;
+  struct naive_inode *ninode = &NAIVE_I(inode)->i_ninode;
+  char *kaddr;
+  if (naive_inline_lock(inode)) {
+    if (page->index == 0) {
+      kaddr = kmap_atomic(page, KM_USER0);
+      memcpy(ninode->inline_data, kaddr,
+             min_t(loff_t, inode->i_size, NAIVE_INLINE_DATA_LEN));
+      kunmap_atomic(kaddr, KM_USER0);
+    }
+    mutex_unlock(&NAIVE_I(inode)->i_map_lock);
+    if (page->index == 0)
+      mark_inode_dirty(inode);
+    unlock_page(page);
+    return 0;
+  }
+  return block_write_full_page(page, naive_get_block, wbc);
+}
+
+static int naive_writepages(struct address_space *mapping,
+                            struct writeback_control *wbc) {
+  // 逐页的writepage会自己再确认一次
+  if (naive_inline_lock(mapping->host)) {
+    mutex_unlock(&NAIVE_I(mapping->host)->i_map_lock);
+    return generic_writepages(mapping, wbc);
+  }
+  return mpage_writepages(mapping, wbc, naive_get_block);
+}
+
+// 写之前先把涉及的块映射好，没分配的只预留
+// 内联文件写完还放得下就接着内联，只把第0页准备好；放不下就先搬到块上，再当普通文件写
+static int naive_prepare_write(struct file *file, struct page *page,
+                               unsigned from, unsigned to) {
+  struct inode *inode = page->mapping->host;
+  int err;
+  if (naive_inline_lock(inode)) {
+    if (page->index == 0 && to <= NAIVE_INLINE_DATA_LEN) {
+      if (!PageUptodate(page))
+        naive_inline_fill_page(inode, page);
+      mutex_unlock(&NAIVE_I(inode)->i_map_lock);
+      return 0;
+    }
+    mutex_unlock(&NAIVE_I(inode)->i_map_lock);
+    err = naive_inline_promote(inode);
+    if (err)
+      return err;
+  }
+  return block_prepare_write(page, from, to, naive_get_block_delay);
+}
+
+// 普通文件用系统自带的即可，它会顺便更新i_size
+// 内联文件把写的部分拷回inode，页本身不标脏，也就不会被写回到块上
+static int naive_commit_write(struct file *file, struct page *page,
+                              unsigned from, unsigned to) {
+  struct inode *inode = page->mapping->host;
+  struct naive_inode *ninode = &NAIVE_I(inode)->i_ninode;
+  loff_t pos = ((loff_t)page->index << PAGE_CACHE_SHIFT) + to;
+  char *kaddr;
+  if (!naive_inline_lock(inode))
+    return generic_commit_write(file, page, from, to);
+  kaddr = kmap_atomic(page, KM_USER0);
+  memcpy(ninode->inline_data + from, kaddr + from, to - from);
+  kunmap_atomic(kaddr, KM_USER0);
+  mutex_unlock(&NAIVE_I(inode)->i_map_lock);
+  if (pos > inode->i_size)
+    inode->i_size = pos;
+  mark_inode_dirty(inode);
+  return 0;
+}
+
+// 页的offset之后的部分被截掉（截断、写失败回退、inode清出内存），上面还没分配的延迟块不会再写回了，
+// 先把它们的预留还掉，再交给系统丢弃缓冲区；否则s_reserved只增不减，statfs的可用空间越来越少
+// 写回可能已经顺带把后面页上的延迟块分配掉了（那时预留就还了），所以在i_map_lock里查extent表，
+// 没分配的才还；写回挑要一起分配的延迟块也在i_map_lock里，两边不会对同一块各还一次
+static void naive_invalidatepage(struct page *page, unsigned long offset) {
+  struct inode *inode = page->mapping->host;
+  struct naive_inode_info *ni = NAIVE_I(inode);
+  struct buffer_head *head, *bh;
+  sector_t block;
+  unsigned long pos = 0;
+  int count, n = 0;
+
+  if (page_has_buffers(page)) {
+    block = (sector_t)page->index << (PAGE_CACHE_SHIFT - inode->i_blkbits);
+    head = bh = page_buffers(page);
+    mutex_lock(&ni->i_map_lock);
+    do {
+      if (pos >= offset && buffer_delay(bh)) {
+        count = 1;
+        if (naive_map_block(inode->i_sb, &ni->i_ninode, block, &count) == 0)
+          n++;
+        clear_buffer_delay(bh);
+      }
+      pos += bh->b_size;
+      block++;
+      bh = bh->b_this_page;
+    } while (bh != head);
+    if (n > 0)
+      naive_release_blocks(inode, n);
+    mutex_unlock(&ni->i_map_lock);
+  }
+  block_invalidatepage(page, offset);
+}
+
+static sector_t naive_bmap(struct address_space *mapping, sector_t block) {
+  if (naive_inline_lock(mapping->host)) {
+    mutex_unlock(&NAIVE_I(mapping->host)->i_map_lock);
+    return 0;
+  }
+  return generic_block_bmap(mapping, block, naive_get_block);
+}
+
+// O_DIRECT的读写绕过页缓存，由naive_get_block按extent映射，连续的块拼成大bio直接和设备交换数据
+// 大文件顺序写入后不再读的场合（比如导入数据）不会把页缓存冲掉，吞吐也接近裸设备
+// 系统在调用前已经把这一段的脏页写回并作废，延迟分配的块这时都已分配好了
+// 文件末尾之内的空洞系统会退回到带缓存的写，这里只需要给末尾之后的写分配块
+// 内联文件没有块可映射：读返回0让系统退回带缓存的读，写先搬到块上（写时调用者持有i_mutex）
+static ssize_t naive_direct_IO(int rw, struct kiocb *iocb,
+                               const struct iovec *iov, loff_t offset,
+                               unsigned long nr_segs) {
+  struct inode *inode = iocb->ki_filp->f_mapping->host;
+  int err;
+  if (naive_inline_lock(inode)) {
+    mutex_unlock(&NAIVE_I(inode)->i_map_lock);
+    if (!(rw & WRITE))
+      return 0;
+    err = naive_inline_promote(inode);
+    if (err)
+      return err;
+  }
+  return blockdev_direct_IO(rw, iocb, inode, inode->i_sb->s_bdev, iov, offset,
+                            nr_segs, naive_get_block, NULL);
+}
+
+// 共享可写的映射第一次写某页时调用，趁这时把页上没分配的块预留成延迟块
+// 否则要等写回时才分配，盘满了数据就悄悄丢了；在这里失败，写的进程会收到SIGBUS
+// 内联文件的页由writepage拷回inode，mmap改不了文件大小，不会超出内联区
+static int naive_page_mkwrite(struct vm_area_struct *vma, struct page *page) {
+  struct inode *inode = vma->vm_file->f_mapping->host;
+  loff_t size;
+  unsigned end;
+  int err = 0;
+
+  lock_page(page);
+  size = i_size_read(inode);
+  // 等锁的时候页可能被截断掉了
+  if (page->mapping != inode->i_mapping || page_offset(page) >= size) {
+    err = -EINVAL;
+    goto out_unlock;
+  }
+  if (naive_inline_lock(inode)) {
+    mutex_unlock(&NAIVE_I(inode)->i_map_lock);
+    goto out_unlock;
+  }
+  // 文件最后一页只处理到文件末尾
+  end = PAGE_CACHE_SIZE;
+  if (((loff_t)(page->index + 1) << PAGE_CACHE_SHIFT) > size)
+    end = size & ~PAGE_CACHE_MASK;
+  err = block_prepare_write(page, 0, end, naive_get_block_delay);
+  if (!err)
+    err = block_commit_write(page, 0, end);
+out_unlock:
+  unlock_page(page);
+  return err;
+}
+
+// 读还是用系统的filemap_nopage，写加上page_mkwrite
+static struct vm_operations_struct naive_file_vm_ops = {
+    .nopage = filemap_nopage,
+    .populate = filemap_populate,
+    .page_mkwrite = naive_page_mkwrite,
+};
 
-  return ninode;
+static int naive_file_mmap(struct file *file, struct vm_area_struct *vma) {
+  int err = generic_file_mmap(file, vma);
+  if (err)
+    return err;
+  vma->vm_ops = &naive_file_vm_ops;
+  return 0;
 }
 
 // 用于支持在目录中找文件（根据文件名锁定文件），将结果填充给dentry
 struct dentry *naive_lookup(struct inode *dir, struct dentry *dentry,
                             struct nameidata *nd) {
-  // 先把dir_record在的块读出来
   struct super_block *sb = dir->i_sb;
-  struct naive_inode *ninode = naive_get_inode(sb, dir->i_ino);
-  struct buffer_head *bh =
-      sb_bread(sb, ninode->block[0]); // FIXME: 一定是第0块吗？
+  if (dentry->d_name.len > NAIVE_MAX_FILENAME_LEN)
+    return ERR_PTR(-ENAMETOOLONG);
+  u64 start = naive_now_ns();
 
-  // 现在开始遍历dir_record，直到找到文件对应的inode
-  struct naive_dir_record *record_ptr = (struct naive_dir_record *)bh->b_data;
-  struct inode *inode = NULL;
+  // 目录的自定义inode在read_inode时已经解码好了
+  struct naive_inode *ninode = &NAIVE_I(dir)->i_ninode;
 
-  int i;
-  for (i = 0; i < ninode->dir_children_count; i++) {
-    if (strcmp(dentry->d_name.name, record_ptr->filename) == 0) {
-      // 文件名相同，就是找到了
-      // iget的作用是从盘上读取指定的inode，这里需要原生inode，所以用不了naive_get_inode
+  // 找到文件名对应的dir_record；带索引的目录按散列值直接定位到叶子块，不用逐块比较
+  // 内联目录的目录项就在inode的内存副本里，不用读盘
+  struct naive_dir_record *record_ptr;
+  struct inode *inode = NULL;
+  struct buffer_head *bh = NULL;
+  if (ninode->flags & NAIVE_INODE_FLAG_INLINE) {
+    record_ptr = naive_find_in_block(ninode->inline_data, NAIVE_INLINE_DATA_LEN,
+                                     dentry->d_name.name, dentry->d_name.len);
+    if (record_ptr != NULL)
       inode = iget(sb, record_ptr->i_ino);
-      break;
-    }
-    record_ptr++;
+  } else {
+    bh = naive_dir_find_entry(sb, ninode, dentry->d_name.name,
+                              dentry->d_name.len, &record_ptr);
+  }
+  if (bh != NULL) {
+    // iget的作用是从盘上读取指定的inode，这里需要原生inode，所以用不了naive_get_inode
+    inode = iget(sb, record_ptr->i_ino);
+    brelse(bh);
   }
   // 结果写到dentry，返给系统，没找到就填充NULL
   d_add(dentry, inode);
-  brelse(bh);
+  naive_stat_end(sb, NAIVE_OP_LOOKUP, start);
   return NULL;
 }
 
+// ============ stats.c ============
+
+// 各入口的调用次数、耗时直方图，以及读块、位图扫描的计数，用来在线上找热点，比如一次lookup读了几块
+
+static u64 naive_now_ns(void) {
+  struct timespec ts;
+  getnstimeofday(&ts);
+  return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 入口返回前调用，start是进入时的naive_now_ns()
+static void naive_stat_end(struct super_block *sb, int op, u64 start) {
+  struct naive_op_stat *st = &NAIVE_SBI(sb)->s_stats.ops[op];
+  u64 now = naive_now_ns();
+  u64 ns = now > start ? now - start : 0; // 墙上时间可能被往回调
+  unsigned long us = (unsigned long)(ns >> 10);
+  int bucket = 0;
+  while (us != 0 && bucket < NAIVE_STAT_BUCKETS - 1) {
+    us >>= 1;
+    bucket++;
+  }
+  spin_lock(&st->lock);
+  st->calls++;
+  st->ns += ns;
+  st->hist[bucket]++;
+  spin_unlock(&st->lock);
+}
+
+// 代替sb_bread，顺便计数
+static struct buffer_head *naive_bread(struct super_block *sb,
+                                       sector_t block) {
+  atomic_long_inc(&NAIVE_SBI(sb)->s_stats.bread);
+  return sb_bread(sb, block);
+}
+
+// 代替sb_breadahead，顺便计数
+static void naive_breadahead(struct super_block *sb, sector_t block) {
+  atomic_long_inc(&NAIVE_SBI(sb)->s_stats.readahead);
+  sb_breadahead(sb, block);
+}
+
+static void naive_stats_show_bitmap(struct seq_file *m, const char *name,
+                                    struct naive_bitmap *map) {
+  long allocs = atomic_long_read(&map->allocs);
+  long scanned = atomic_long_read(&map->scanned);
+  seq_printf(m,
+             "%s allocs %ld scans %ld bytes_scanned %ld bytes_per_alloc %ld\n",
+             name, allocs, atomic_long_read(&map->scans), scanned,
+             allocs != 0 ? scanned / allocs : 0);
+}
+
+// 每个入口一行：名字、调用次数、总耗时（纳秒）、直方图各格；后面是读块次数和两张位图的扫描情况
+// m->private是stats文件的proc_dir_entry，已经卸载了（data被清空）就什么都不输出
+static int naive_stats_show(struct seq_file *m, void *v) {
+  static const char *names[NAIVE_OPS] = {
+      "lookup",     "create",      "mkdir",          "readdir",
+      "read_inode", "write_inode", "journal_commit",
+  };
+  struct proc_dir_entry *entry = m->private;
+  struct naive_sb_info *sbi;
+  struct naive_op_stat *st;
+  u64 calls, ns, hist[NAIVE_STAT_BUCKETS];
+  int i, j;
+
+  mutex_lock(&naive_stats_mutex);
+  if (entry->data == NULL) {
+    mutex_unlock(&naive_stats_mutex);
+    return 0;
+  }
+  sbi = NAIVE_SBI(entry->data);
+  seq_printf(m, "# op calls total_ns hist: <1us <2us <4us ... <8ms >=8ms\n");
+  for (i = 0; i < NAIVE_OPS; i++) {
+    st = &sbi->s_stats.ops[i];
+    spin_lock(&st->lock);
+    calls = st->calls;
+    ns = st->ns;
+    memcpy(hist, st->hist, sizeof(hist));
+    spin_unlock(&st->lock);
+    seq_printf(m, "%s %llu %llu", names[i], (unsigned long long)calls,
+               (unsigned long long)ns);
+    for (j = 0; j < NAIVE_STAT_BUCKETS; j++)
+      seq_printf(m, " %llu", (unsigned long long)hist[j]);
+    seq_puts(m, "\n");
+  }
+  seq_printf(m, "sb_bread %ld\n", atomic_long_read(&sbi->s_stats.bread));
+  seq_printf(m, "sb_breadahead %ld\n",
+             atomic_long_read(&sbi->s_stats.readahead));
+  seq_printf(m, "csum_errors %ld\n",
+             atomic_long_read(&sbi->s_stats.csum_errors));
+  naive_stats_show_bitmap(m, "bmap", &sbi->s_bmap);
+  naive_stats_show_bitmap(m, "imap", &sbi->s_imap);
+  mutex_unlock(&naive_stats_mutex);
+  return 0;
+}
+
+// 打开的文件持有proc的inode，proc_dir_entry本身在文件关闭前不会释放，sb则要在读的时候再确认
+static int naive_stats_open(struct inode *inode, struct file *file) {
+  return single_open(file, naive_stats_show, PDE(inode));
+}
+
+static void naive_stats_reset(struct super_block *sb) {
+  struct naive_sb_info *sbi = NAIVE_SBI(sb);
+  struct naive_op_stat *st;
+  struct naive_bitmap *maps[] = {&sbi->s_bmap, &sbi->s_imap};
+  int i;
+  for (i = 0; i < NAIVE_OPS; i++) {
+    st = &sbi->s_stats.ops[i];
+    spin_lock(&st->lock);
+    st->calls = 0;
+    st->ns = 0;
+    memset(st->hist, 0, sizeof(st->hist));
+    spin_unlock(&st->lock);
+  }
+  atomic_long_set(&sbi->s_stats.bread, 0);
+  atomic_long_set(&sbi->s_stats.readahead, 0);
+  atomic_long_set(&sbi->s_stats.csum_errors, 0);
+  for (i = 0; i < 2; i++) {
+    atomic_long_set(&maps[i]->allocs, 0);
+    atomic_long_set(&maps[i]->scans, 0);
+    atomic_long_set(&maps[i]->scanned, 0);
+  }
+}
+
+// 写什么都行，写了就清零，比如echo 0 > stats，测一段负载前先清一下
+static ssize_t naive_stats_write(struct file *file, const char __user *buf,
+                                 size_t count, loff_t *ppos) {
+  struct proc_dir_entry *entry =
+      ((struct seq_file *)file->private_data)->private;
+  mutex_lock(&naive_stats_mutex);
+  if (entry->data != NULL)
+    naive_stats_reset(entry->data);
+  mutex_unlock(&naive_stats_mutex);
+  return count;
+}
+
+static struct file_operations naive_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = naive_stats_open,
+    .read = seq_read,
+    .write = naive_stats_write,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+// sbi一分配好就初始化各入口的锁，恢复日志、读根inode时就要计数了
+static void naive_stats_setup(struct naive_stats *stats) {
+  int i;
+  for (i = 0; i < NAIVE_OPS; i++)
+    spin_lock_init(&stats->ops[i].lock);
+}
+
+// 挂载成功后在/proc/fs/naivefs下建本次挂载的目录，建不出来就算了，不影响使用
+static void naive_stats_init(struct super_block *sb) {
+  struct naive_stats *stats = &NAIVE_SBI(sb)->s_stats;
+  struct proc_dir_entry *entry;
+  if (naive_proc_root == NULL)
+    return;
+  stats->proc = proc_mkdir(sb->s_id, naive_proc_root);
+  if (stats->proc == NULL)
+    return;
+  entry = create_proc_entry("stats", S_IFREG | S_IRUGO | S_IWUSR, stats->proc);
+  if (entry == NULL) {
+    remove_proc_entry(sb->s_id, naive_proc_root);
+    stats->proc = NULL;
+    return;
+  }
+  entry->proc_fops = &naive_stats_fops;
+  entry->data = sb;
+  stats->entry = entry;
+}
+
+// 卸载时先把/proc下的目录拆掉；卸载前就打开了的stats文件之后再读，看到data为空就不碰sb了
+static void naive_stats_exit(struct super_block *sb) {
+  struct naive_stats *stats = &NAIVE_SBI(sb)->s_stats;
+  if (stats->proc == NULL)
+    return;
+  mutex_lock(&naive_stats_mutex);
+  stats->entry->data = NULL;
+  mutex_unlock(&naive_stats_mutex);
+  remove_proc_entry("stats", stats->proc);
+  remove_proc_entry(sb->s_id, naive_proc_root);
+  stats->proc = NULL;
+}
+
 // ===============================================================================
 
 // sops实现了inode的读写和naive的卸载
 static struct super_operations naive_sops = {
+    .alloc_inode = naive_alloc_inode,
+    .destroy_inode = naive_destroy_inode,
+    .clear_inode = naive_clear_inode,
     .read_inode = naive_read_inode,
     .write_inode = naive_write_inode,
     .put_super = naive_put_super,
-    .statfs = simple_statfs,
+    .write_super = naive_write_super,
+    .sync_fs = naive_sync_fs,
+    .statfs = naive_statfs,
 };
 
 // iops实现了常用的三个
@@ -523,7 +3284,7 @@ static struct file_operations naive_fops = {
     .aio_read = generic_file_aio_read,
     .write = do_sync_write,
     .aio_write = generic_file_aio_write,
-    .mmap = generic_file_mmap,
+    .mmap = naive_file_mmap,
     .sendfile = generic_file_sendfile,
 };
 
@@ -533,68 +3294,193 @@ static struct file_operations naive_dops = {
 };
 
 static struct address_space_operations naive_aops = {
-    .readpage = simple_readpage,
+    .readpage = naive_readpage,
+    .readpages = naive_readpages,
+    .writepage = naive_writepage,
+    .writepages = naive_writepages,
     .sync_page = block_sync_page,
-    .commit_write = generic_commit_write,
+    .prepare_write = naive_prepare_write,
+    .commit_write = naive_commit_write,
+    .invalidatepage = naive_invalidatepage,
+    .bmap = naive_bmap,
+    .direct_IO = naive_direct_IO,
 };
 
 // 该函数说明了如何卸载文件系统，主要是做一些清理善后工作
 static void naive_put_super(struct super_block *sb) {
-  // FIXME: 报错，暂时注释
-  // 释放超级块即可
-  // struct naive_super_block *nfs = NAIVE_SB(sb);
-  // if (nfs == NULL)
-  //   return;
-  // kfree(nfs);
-  return;
+  struct naive_sb_info *sbi = NAIVE_SBI(sb);
+  if (sbi == NULL)
+    return;
+  naive_stats_exit(sb);
+  // 提交最后一个事务并做检查点，干净卸载后日志是空的，用户态工具不必恢复就能直接读写
+  if (sbi->s_journal.j_blocks != 0) {
+    naive_journal_commit(sb);
+    naive_journal_checkpoint(sb);
+  }
+  // 释放挂载期间一直持有的位图缓冲区，脏的会在释放前由系统写回
+  naive_release_bitmap(&sbi->s_imap);
+  naive_release_bitmap(&sbi->s_bmap);
+  sb->s_fs_info = NULL;
+  kfree(sbi);
+}
+
+// pdflush发现超级块脏了（有事务在攒着）会定期调用，提交掉，最多丢几秒的元数据修改
+static void naive_write_super(struct super_block *sb) {
+  sb->s_dirt = 0;
+  naive_journal_commit(sb);
+}
+
+// sync时提交事务，提交了就算落盘了
+static int naive_sync_fs(struct super_block *sb, int wait) {
+  sb->s_dirt = 0;
+  return naive_journal_commit(sb);
+}
+
+// df用的统计，全从内存里的计数拿，不扫位图也不读盘
+// 只报数据区的块，元数据的块一开始就标成了已用，算进来的话新盘的df也显示用了一截
+// 延迟分配预留了的块还没在位图上置位，但已经答应给人家了，算作已用
+static int naive_statfs(struct dentry *dentry, struct kstatfs *buf) {
+  struct super_block *sb = dentry->d_sb;
+  struct naive_sb_info *sbi = NAIVE_SBI(sb);
+  struct naive_super_block *nsb = NAIVE_SB(sb);
+  long free = atomic_read(&sbi->s_bmap.total_free) - sbi->s_reserved;
+  buf->f_type = NAIVE_MAGIC;
+  buf->f_bsize = sb->s_blocksize;
+  buf->f_blocks = nsb->block_total - sbi->s_overhead;
+  buf->f_bfree = buf->f_bavail = max(free, 0L);
+  buf->f_files = nsb->inode_total;
+  buf->f_ffree = atomic_read(&sbi->s_imap.total_free);
+  buf->f_namelen = NAIVE_MAX_FILENAME_LEN;
+  return 0;
 }
 
 // 该函数说明了如何从磁盘读出超级块，读出的结果填充到第一个参数sb
 static int naive_fill_super(struct super_block *sb, void *data, int silent) {
+  struct naive_sb_info *sbi = kzalloc(sizeof(struct naive_sb_info), GFP_KERNEL);
+  if (sbi == NULL)
+    return -ENOMEM;
+  naive_stats_setup(&sbi->s_stats);
+
+  // 块设备默认的块大小不一定是naivefs的块大小，先按最小的块大小读出超级块，看镜像用的是多大的块
+  if (!sb_set_blocksize(sb, NAIVE_MIN_BLOCK_SIZE))
+    goto out_free;
+
   // 从磁盘上读块，主要借助buffer_head指针和sb_bread来完成
-  struct buffer_head *bh = sb_bread(sb, NAIVE_SUPER_BLOCK_BLOCK);
-  // 我们在超级块的b_data中放的是自定义超级块信息
-  struct naive_super_block *nsb = (struct naive_super_block *)bh->b_data;
+  struct buffer_head *bh =
+      sb_bread(sb, NAIVE_SUPER_BLOCK_OFFSET / NAIVE_MIN_BLOCK_SIZE);
+  if (bh == NULL)
+    goto out_free;
+  int blocksize = naive_block_size((struct naive_super_block *)bh->b_data);
+  if (blocksize != NAIVE_MIN_BLOCK_SIZE) {
+    // 换成镜像的块大小重新读，之后sb_bread和页缓存的块映射都以此为单位
+    brelse(bh);
+    if (blocksize > NAIVE_MAX_BLOCK_SIZE || !sb_set_blocksize(sb, blocksize))
+      goto out_free;
+    bh = sb_bread(sb, NAIVE_SUPER_BLOCK_OFFSET / blocksize);
+    if (bh == NULL)
+      goto out_free;
+  }
+  // 我们在超级块的b_data中放的是自定义超级块信息，块比512B大时它在第0块中间
+  // 拷一份到私有信息里，缓冲区马上就还掉，之后都用这份副本
+  struct naive_super_block *nsb = &sbi->s_nsb;
+  memcpy(nsb, bh->b_data + NAIVE_SUPER_BLOCK_OFFSET % blocksize,
+         sizeof(struct naive_super_block));
+  brelse(bh);
+  if (nsb->magic != NAIVE_MAGIC) {
+    if (!silent)
+      printk(KERN_ERR "naivefs: %s: bad magic\n", sb->s_id);
+    goto out_free;
+  }
+  // 有不认识的特性就不挂载，老的内核模块看到带校验和的镜像也会这样
+  if (nsb->features & ~NAIVE_FEATURES_SUPPORTED) {
+    if (!silent)
+      printk(KERN_ERR "naivefs: %s: unsupported features %#x\n", sb->s_id,
+             nsb->features & ~NAIVE_FEATURES_SUPPORTED);
+    goto out_free;
+  }
+  // 带校验和的镜像都分了块组，位图块的块尾要留给校验和
+  if ((nsb->features & NAIVE_FEATURE_CSUM) &&
+      (nsb->checksum != naive_super_csum(nsb) || nsb->group_blocks == 0 ||
+       nsb->group_blocks > NAIVE_GROUP_MAX(blocksize) ||
+       nsb->group_inodes > NAIVE_GROUP_MAX(blocksize))) {
+    if (!silent)
+      printk(KERN_ERR "naivefs: %s: bad superblock checksum\n", sb->s_id);
+    goto out_free;
+  }
+  sbi->s_inodes_per_block = NAIVE_INODES_PER_BLOCK(blocksize);
+  sbi->s_dir_size = naive_dir_block_size(nsb);
+  // 块组的位图都只有一块，每个块组的inode要正好占满整数块inode表
+  if (nsb->group_blocks != 0 &&
+      (nsb->group_blocks > NAIVE_BITS_PER_BLOCK(blocksize) ||
+       nsb->group_inodes <= 0 ||
+       nsb->group_inodes > NAIVE_BITS_PER_BLOCK(blocksize) ||
+       nsb->group_inodes % sbi->s_inodes_per_block != 0)) {
+    if (!silent)
+      printk(KERN_ERR "naivefs: %s: bad block group geometry\n", sb->s_id);
+    goto out_free;
+  }
+  // 元数据占的块：老镜像是数据区之前的所有块；分了块组的是块组0之前的块，加上每个块组的位图和inode表
+  sbi->s_overhead = nsb->data_block_no;
+  if (nsb->group_blocks != 0)
+    sbi->s_overhead = nsb->bmap_block_no + nsb->bmap_blocks *
+                                               (nsb->data_block_no -
+                                                nsb->bmap_block_no);
+  sb->s_fs_info = sbi; // 将私有信息放到私有域，恢复日志时就要用
+  spin_lock_init(&sbi->s_resv_lock);
+
+  // 上次没有干净卸载的话，日志里可能还有事务没写回原位，先恢复，之后读到的位图和inode表才是一致的
+  if (naive_journal_load(sb) != 0)
+    goto out_release;
+
+  // 两张位图的位置和长度都记在超级块上，挂载时读一次就常驻内存，之后的分配不再重复读盘
+  // 块位图按绝对块号编址，数据块之前的块由mkfs标记为已用，这里也不允许分配
+  // 分了块组的话，两张位图的第i块就是块组i的位图，隔group_blocks块一个
+  if (naive_load_bitmap(sb, &sbi->s_bmap, nsb->bmap_block_no,
+                        naive_bmap_block(nsb, 1) - nsb->bmap_block_no,
+                        nsb->bmap_blocks, naive_bmap_bits(nsb),
+                        naive_bmap_base(nsb), nsb->data_block_no,
+                        nsb->block_total) != 0 ||
+      naive_load_bitmap(sb, &sbi->s_imap, nsb->imap_block_no,
+                        naive_imap_block(nsb, 1) - nsb->imap_block_no,
+                        nsb->imap_blocks, naive_imap_bits(nsb), 0,
+                        NAIVE_ROOT_INODE_NO + 1, nsb->inode_total) != 0)
+    goto out_release;
 
   // 现在，填充这些系统侧需要的基本信息
   sb->s_magic = nsb->magic; // 魔数
   sb->s_op = &naive_sops;   // sops
-  sb->s_maxbytes =
-      NAIVE_BLOCK_SIZE * NAIVE_BLOCK_PER_FILE; // 声明每个文件的最大大小
-  sb->s_fs_info = nsb; // 将自定义super_block结构放到私有域
-
-  // 我们还需要拼装一个根目录的inode，也叫根inode，这个inode要关联到超级块
-  // 利用new_inode方法可以取到一个可用的空inode
-  struct inode *root_inode = new_inode(sb);
-
-  // 填一些信息
-  my_inode_init_owner(root_inode, NULL, 0755 | S_IFDIR);
-
-  // 继续填一些信息
-  struct naive_inode *root_ninode = naive_get_inode(sb, NAIVE_ROOT_INODE_NO);
-  root_inode->i_ino = NAIVE_ROOT_INODE_NO;
-  root_inode->i_sb = sb;
-  root_inode->i_mode = root_ninode->mode;
-  // FIXME: 把目录下文件数作为i_size是否合适？
-  root_inode->i_size = root_ninode->dir_children_count;
-  // add，modify，create
-  root_inode->i_atime = root_inode->i_mtime = root_inode->i_ctime =
-      CURRENT_TIME;
-  // 增加一个链接数，避免被回收
-  root_inode->i_nlink++;
-  // i_op是inode操作集，f_op是文件对象操作集，由于root_inode对应一个目录，所以这里给fop赋dops
-  root_inode->i_op = &naive_iops;
-  root_inode->i_fop = &naive_dops;
-  // 和super_block类似，原生inode也提供了一个私有域来放自定义inode，但是很多文件系统都没用到
-  // 先写着再说吧，因为实际上只要有i_ino，调用naive_get_inode去找也可以
-  root_inode->i_private = root_ninode;
+  // 声明每个文件的最大大小，extent表只受块号范围限制
+  sb->s_maxbytes = (loff_t)blocksize * 0x7fffffff;
+
+  // 我们还需要一个根目录的inode，也叫根inode，这个inode要关联到超级块
+  // 和naive_lookup一样用iget取，read_inode会把盘上的根inode解码进内存副本、填好各种ops，
+  // 取到的inode也在散列表里，mkdir、create改了根目录后mark_inode_dirty才能真的把它写回
+  struct inode *root_inode = iget(sb, NAIVE_ROOT_INODE_NO);
+  if (root_inode == NULL)
+    goto out_release;
+  if (is_bad_inode(root_inode) || !S_ISDIR(root_inode->i_mode)) {
+    iput(root_inode);
+    goto out_release;
+  }
 
   // 最后关联根inode和超级块即可
   sb->s_root = d_alloc_root(root_inode);
+  if (sb->s_root == NULL) {
+    iput(root_inode);
+    goto out_release;
+  }
+  naive_stats_init(sb);
 
-  // buffer_header用完应当释放（不放也行）
-  brelse(bh);
+  // 位图的缓冲区要一直用到卸载，在naive_put_super中释放
   return 0;
+
+out_release:
+  naive_release_bitmap(&sbi->s_imap);
+  naive_release_bitmap(&sbi->s_bmap);
+out_free:
+  sb->s_fs_info = NULL;
+  kfree(sbi);
+  return -EIO;
 }
 
 // 该函数声明了如何获取一个超级块
@@ -617,9 +3503,25 @@ static struct file_system_type naive_fs_type = {
 
 // 将文件系统作为可插拔模块注册到系统
 static int __init init_naivefs(void) {
-  return register_filesystem(&naive_fs_type);
+  int err = naive_init_inodecache();
+  if (err)
+    return err;
+  // 统计目录建不出来也不影响挂载，只是看不到统计
+  naive_proc_root = proc_mkdir("naivefs", proc_root_fs);
+  err = register_filesystem(&naive_fs_type);
+  if (err) {
+    if (naive_proc_root != NULL)
+      remove_proc_entry("naivefs", proc_root_fs);
+    naive_destroy_inodecache();
+  }
+  return err;
 }
 // 拔出文件系统模块
-static void __exit exit_naivefs(void) { unregister_filesystem(&naive_fs_type); }
+static void __exit exit_naivefs(void) {
+  unregister_filesystem(&naive_fs_type);
+  if (naive_proc_root != NULL)
+    remove_proc_entry("naivefs", proc_root_fs);
+  naive_destroy_inodecache();
+}
 // 声明插拔函数
 module_init(init_naivefs) module_exit(exit_naivefs) MODULE_AUTHOR("Z0GSH1U");
@@ -6,42 +6,123 @@
 #ifndef NAIVEFS_H_
 #define NAIVEFS_H_
 
-#define NAIVE_BLOCK_SIZE 512       // 块大小512B
+#ifdef __KERNEL__
+#include <linux/crc32c.h>
+#include <linux/stddef.h>
+#else
+#include <stddef.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+#endif
+
+#define NAIVE_MIN_BLOCK_SIZE 512   // 最小块大小，老镜像都是512B
+#define NAIVE_MAX_BLOCK_SIZE 4096  // 最大块大小，不能超过页大小
+#define NAIVE_DEFAULT_BLOCK_SIZE 4096 // mkfs默认的块大小，正好一页
 #define NAIVE_MAGIC 990717         // 魔数
-#define NAIVE_BLOCK_PER_FILE 8     // 每个文件最多占多少块
-#define NAIVE_MAX_FILENAME_LEN 128 // 文件名最大长度
+#define NAIVE_INLINE_EXTENTS 4     // inode里直接存放几个extent
+#define NAIVE_MAX_FILENAME_LEN 255 // 文件名最大长度
 #define NAIVE_BOOT_BLOCK 0         // 引导块块号
-#define NAIVE_SUPER_BLOCK_BLOCK 1  // 超级块块号
-#define NAIVE_BMAP_BLOCK 2         // 块位图块号
-#define NAIVE_IMAP_BLOCK 3         // inode位图块号
+#define NAIVE_SUPER_BLOCK_OFFSET 512 // 超级块在盘上的字节偏移，与块大小无关
 #define NAIVE_ROOT_INODE_NO 0      // 根inode编号
+#define NAIVE_BITS_PER_BLOCK(bs) ((bs) * 8) // 一个位图块能管理的位数
+#define NAIVE_BYTES_PER_INODE 8192 // mkfs默认每多少字节的容量配一个inode
 #define NAIVE_SUPER_BLOCK_SIZE sizeof(struct naive_super_block)
 #define NAIVE_INODE_SIZE sizeof(struct naive_inode)
-#define NAIVE_DIR_RECORD_SIZE sizeof(struct naive_dir_record)
+#define NAIVE_INODES_PER_BLOCK(bs) ((bs) / NAIVE_INODE_SIZE) // 每块放几个inode
+#define NAIVE_EXTENT_SIZE sizeof(struct naive_extent)
+#define NAIVE_EXTENTS_PER_BLOCK(bs) ((bs) / NAIVE_EXTENT_SIZE) // 间接extent块能放几个extent
+#define NAIVE_MAX_EXTENTS(bs) (NAIVE_INLINE_EXTENTS + NAIVE_EXTENTS_PER_BLOCK(bs)) // 不带NAIVE_FEATURE_EXTENT_CHAIN时每个文件最多几个extent
+#define NAIVE_EXTENT_NEXT(eblock, bs) (((int *)(eblock))[(bs) / sizeof(int) - 1]) // 间接extent块的最后4字节：链上下一块的块号，0表示没有
+#define NAIVE_DIR_REC_LEN(name_len) ((8 + (name_len) + 3) & ~3) // 名字长name_len的目录项至少占多少字节
+#define NAIVE_FT_UNKNOWN 0         // 目录项中的文件类型：未知
+#define NAIVE_FT_REG_FILE 1        // 目录项中的文件类型：普通文件
+#define NAIVE_FT_DIR 2             // 目录项中的文件类型：目录
+#define NAIVE_INODE_FLAG_DX 1      // inode标志：该目录带有散列索引
+#define NAIVE_INODE_FLAG_INLINE 2  // inode标志：文件内容或目录项直接放在inode里，没有数据块
+#define NAIVE_INLINE_DATA_LEN 72   // inode里最多放多少字节的内联数据
+#define NAIVE_DX_MAX_LEVELS 2      // 根和叶子之间最多几层索引节点
+#define NAIVE_DIR_POS_EOF 0x7fffffff // readdir走到目录末尾时的位置，目录项的位置由散列值得出，都比它小
+#define NAIVE_JOURNAL_MAGIC 0x4e4a4e4c // 日志块的魔数
+#define NAIVE_JOURNAL_DESC 1          // 日志块类型：事务的描述块
+#define NAIVE_JOURNAL_COMMIT 2        // 日志块类型：事务的提交块
+#define NAIVE_JOURNAL_MIN_BLOCKS 32   // 日志区至少多少块
+#define NAIVE_JOURNAL_MAX_BLOCKS 4096 // mkfs默认给日志区分配的块数上限
+#define NAIVE_JOURNAL_TAGS(bs) (((bs) - 4 * sizeof(int)) / sizeof(int)) // 一个事务最多记几块
+#define NAIVE_DX_ROOT_LIMIT(bs) (((bs) - sizeof(struct naive_dx_root)) / sizeof(struct naive_dx_entry))
+#define NAIVE_DX_NODE_LIMIT(bs) (((bs) - sizeof(struct naive_dx_node)) / sizeof(struct naive_dx_entry))
+#define NAIVE_FEATURE_CSUM 1       // 超级块features：元数据带CRC32C校验和
+#define NAIVE_FEATURE_EXTENT_CHAIN 2 // 超级块features：间接extent块可以串成链，extent表不限长、不排序
+#define NAIVE_FEATURES_SUPPORTED (NAIVE_FEATURE_CSUM | NAIVE_FEATURE_EXTENT_CHAIN) // 认识的features，有不认识的就不挂载
+#define NAIVE_CSUM_SIZE 4          // 位图块、目录块最后4字节放校验和
+#define NAIVE_GROUP_MAX(bs) (NAIVE_BITS_PER_BLOCK(bs) - NAIVE_CSUM_SIZE * 8) // 带校验和时一个块组最多几块、几个inode
+#define NAIVE_FT_CSUM 0xde         // 目录块末尾放校验和的假目录项的文件类型
+#define NAIVE_DIR_TAIL_SIZE sizeof(struct naive_dir_tail)
 
 typedef unsigned char _Byte; // 字节定义
 
 // 自定义超级块
 // 考虑到naivefs基本不做异常处理，省略了很多没有用到的属性
+// 位图的长度随磁盘大小而定，可以跨越多个块，由超级块记录其起始块号和块数
+// 超级块总是在盘上第512字节处、占512字节，不知道块大小也能先读出来（仿照ext2）：
+// 块大小512B时它独占第1块，更大的块时它和引导扇区一起在第0块里
+//
+// 新镜像分成若干块组（仿照ext2），group_blocks不为0：
+// 引导块 | 超级块 | 日志区 | 块组0 | 块组1 | ...
+// 每个块组有group_blocks块（最后一个可以短些），依次是：块位图1块 | inode位图1块 | inode表 | 数据块
+// 块组g的块位图管理从它自己开始的group_blocks块，inode位图和inode表管理第g*group_inodes起的group_inodes个inode
+// 这时bmap_block_no、imap_block_no、inode_table_block_no都指块组0里的位置，bmap_blocks、imap_blocks都是块组数，
+// data_block_no是块组0的第一个数据块（根目录块）
+// group_blocks为0的是老镜像：两张位图、inode表各自连续地放在一起，相当于只有一个块组
 struct naive_super_block {
   int magic;                // 魔数
   int inode_total;          // inode的总量
   int block_total;          // 块的总量
+  int bmap_block_no;        // 块位图起始位置
+  int bmap_blocks;          // 块位图占多少块
+  int imap_block_no;        // inode位图起始位置
+  int imap_blocks;          // inode位图占多少块
   int inode_table_block_no; // inode表块起始位置
   int data_block_no;        // 数据块起始位置
-  // 补齐到一个块
-  _Byte _padding[(NAIVE_BLOCK_SIZE - 5 * sizeof(int))];
+  int journal_block_no;     // 日志区起始位置，在inode位图和inode表之间
+  int journal_blocks;       // 日志区占多少块，0表示没有日志（老的镜像）
+  int block_size;           // 块大小，0表示512B（老的镜像）
+  int group_blocks;         // 每个块组多少块，0表示不分块组（老的镜像）
+  int group_inodes;         // 每个块组多少个inode
+  int features;             // NAIVE_FEATURE_*，0表示都没有（老的镜像）
+  // 补齐到512字节
+  _Byte _padding[(NAIVE_MIN_BLOCK_SIZE - 16 * sizeof(int))];
+  unsigned int checksum;    // 带NAIVE_FEATURE_CSUM时是前面508字节的CRC32C
+};
+
+// 一个extent描述文件中一段连续的块：
+// 文件内从逻辑块号file_block开始的len个块，依次存放在从物理块号start开始的连续块上
+struct naive_extent {
+  int file_block; // 文件内的起始逻辑块号
+  int start;      // 盘上的起始物理块号
+  int len;        // 连续多少块
 };
 
 // 自定义inode
+// 文件的块映射是一张按file_block升序排列的extent表，
+// 前NAIVE_INLINE_EXTENTS个直接放在inode里，放不下的存到间接extent块里
+// 块组之间隔着位图和inode表，一个extent跨不过块组，一张表最多NAIVE_MAX_EXTENTS项就限制了文件最多跨几个块组；
+// 带NAIVE_FEATURE_EXTENT_CHAIN时间接extent块装满了就再接一块，用块尾的NAIVE_EXTENT_NEXT串成链，表不限长
+// （extent占12字节，块大小都是512的倍数，装满extent后块尾总剩下至少4字节）；
+// 新的extent总是追加在表尾，表不保证有序，加一个extent不用挪动后面的项，只改得到表尾和前一个extent所在的块
+// 小文件和小目录带NAIVE_INODE_FLAG_INLINE，内容直接放在extent表所在的地方，没有数据块，
+// extent_count、block_count都是0；放不下了再搬到第0块上，去掉这个标志
 struct naive_inode {
-  int mode;                        // mode
-  int i_ino;                       // ino
-  int block_count;                 // 该inode负责几个块
-  int block[NAIVE_BLOCK_PER_FILE]; // 负责哪几个块，用第0块首部存dir_record
+  int mode;         // mode
+  int i_ino;        // ino
+  int block_count;  // 该inode负责几个块
+  int extent_count; // extent表里有几项
   // 对于文件，记录文件大小；对于目录，记录目录下项目数
   union {
-    int file_size;
+    long long file_size;
     int dir_children_count;
   };
   // TODO: 下面这些属性原生inode上也有，先记着，没作用后续删掉
@@ -51,14 +132,249 @@ struct naive_inode {
   int i_atime;
   int i_ctime;
   int i_mtime;
-  // FIXME: 补齐是方便naive_get_inode计算，但是没必要
-  _Byte _padding[(NAIVE_BLOCK_SIZE - (10 + NAIVE_BLOCK_PER_FILE) * sizeof(int))];
+  int extent_block; // 间接extent块的块号，0表示没有
+  unsigned short flags;    // NAIVE_INODE_FLAG_*
+  unsigned short checksum; // 带NAIVE_FEATURE_CSUM时是inode的CRC32C的低16位，算的时候本字段当作0
+  // 内联数据和extent表共用后面的地方，inode正好128字节，inode表的一块可以紧凑地放下NAIVE_INODES_PER_BLOCK个inode
+  union {
+    struct naive_extent extents[NAIVE_INLINE_EXTENTS]; // 用第0个extent的首块存dir_record
+    char inline_data[NAIVE_INLINE_DATA_LEN];
+  };
 };
 
 // 目录下的项目的记录
+// 目录项是变长的（仿照ext2）：8字节的头后面紧跟name_len字节的文件名，整条按4字节对齐
+// rec_len是到下一条目录项的距离，一块里的目录项首尾相接，最后一条的rec_len延伸到块尾
+// name_len为0的目录项是空的，新分配的目录块就是一条rec_len为整块的空目录项
+// 删除或插入时只需调整相邻目录项的rec_len，不用挪动其他目录项
 struct naive_dir_record {
   int i_ino;                             // 所属目录的inode编号
-  char filename[NAIVE_MAX_FILENAME_LEN]; // 文件名
+  unsigned short rec_len;                // 本条目录项占多少字节
+  unsigned char name_len;                // 文件名长度，0表示空目录项
+  unsigned char file_type;               // NAIVE_FT_*，readdir不用读inode就能知道类型
+  char filename[NAIVE_MAX_FILENAME_LEN]; // 文件名，不以0结尾，实际只占name_len字节
+};
+
+// 带NAIVE_FEATURE_CSUM时，每个目录块的最后12字节是一条假目录项（仿照ext4），块尾4字节是校验和
+// 目录项、索引只用前面的块大小-12字节，格式和不带校验和时一样，最后一条目录项的rec_len延伸到假目录项之前
+struct naive_dir_tail {
+  int i_ino;               // 0
+  unsigned short rec_len;  // 12
+  unsigned char name_len;  // 0
+  unsigned char file_type; // NAIVE_FT_CSUM
+  unsigned int checksum;
+};
+
+// 目录只有一块时是线性的，目录项直接排在块里
+// 第0块放满后改成带散列索引的格式（inode带NAIVE_INODE_FLAG_DX）：
+// 第0块只留.和..，..的rec_len延伸到块尾，把索引根藏在它后面；叶子块仍是普通的目录块；
+// 根到叶子之间最多有NAIVE_DX_MAX_LEVELS层索引节点块，它们以一条占满整块的空目录项开头
+// 这样不认识索引的遍历方式（比如readdir）把每一块都当普通目录块走一遍就行
+// 每个索引块里的索引项按hash升序排列，第k项指向散列值落在[hash[k], hash[k+1])的下一层块
+struct naive_dx_entry {
+  unsigned int hash; // 这一项覆盖的最小散列值
+  int block;         // 下一层块在目录内的逻辑块号
+};
+
+// 索引块里用来占位的目录项头，只有.和..用得上name
+struct naive_dx_fake_record {
+  int i_ino;
+  unsigned short rec_len;
+  unsigned char name_len;
+  unsigned char file_type;
+  char name[4];
+};
+
+// 带索引目录的第0块
+struct naive_dx_root {
+  struct naive_dx_fake_record dot;    // .，rec_len为12
+  struct naive_dx_fake_record dotdot; // ..，rec_len延伸到块尾
+  int levels;                         // 根和叶子之间有几层索引节点
+  int count;                          // 索引项个数
+  int limit;                          // 最多放几个索引项
+  struct naive_dx_entry entries[0];
+};
+
+// 索引节点块
+struct naive_dx_node {
+  struct naive_dx_fake_record fake; // 占满整块的空目录项
+  int count;
+  int limit;
+  struct naive_dx_entry entries[0];
+};
+
+// 元数据日志（仿照jbd，只记元数据块的完整副本）
+// 日志区第0块是日志头，其余的块依次存放事务：描述块 | 若干元数据块的副本 | 提交块
+// 描述块记下这些副本各自的原位置，提交块落盘了事务才算数
+// 每个事务的序号比前一个大1，日志总是从第1块开始写；检查点（所有已提交的元数据都写回原位）之后
+// 日志头记下下一个事务的序号，日志区里残留的旧事务序号对不上，恢复时自然被跳过
+// 日志头、描述块和提交块都只用块的开头，块的其余部分是0
+struct naive_journal_header {
+  int magic;    // NAIVE_JOURNAL_MAGIC
+  int sequence; // 从第1块开始，第一个需要恢复的事务的序号
+};
+
+// 描述块和提交块
+struct naive_journal_block {
+  int magic;    // NAIVE_JOURNAL_MAGIC
+  int type;     // NAIVE_JOURNAL_DESC或NAIVE_JOURNAL_COMMIT
+  int sequence; // 所属事务的序号
+  int count;    // 事务里有几个元数据块
+  int blocks[0]; // 描述块：每个副本的原块号，最多NAIVE_JOURNAL_TAGS(块大小)个
 };
 
+// 超级块里记的块大小，老镜像没有记，是512B
+static inline int naive_block_size(const struct naive_super_block *nsb) {
+  return nsb->block_size != 0 ? nsb->block_size : NAIVE_MIN_BLOCK_SIZE;
+}
+
+// 块位图、inode位图的第i块（即块组i的位图）在哪里
+static inline int naive_bmap_block(const struct naive_super_block *nsb, int i) {
+  return nsb->bmap_block_no + i * (nsb->group_blocks ? nsb->group_blocks : 1);
+}
+
+static inline int naive_imap_block(const struct naive_super_block *nsb, int i) {
+  return nsb->imap_block_no + i * (nsb->group_blocks ? nsb->group_blocks : 1);
+}
+
+// 块位图、inode位图每块管理几位
+static inline int naive_bmap_bits(const struct naive_super_block *nsb) {
+  return nsb->group_blocks ? nsb->group_blocks
+                           : NAIVE_BITS_PER_BLOCK(naive_block_size(nsb));
+}
+
+static inline int naive_imap_bits(const struct naive_super_block *nsb) {
+  return nsb->group_blocks ? nsb->group_inodes
+                           : NAIVE_BITS_PER_BLOCK(naive_block_size(nsb));
+}
+
+// 块位图第0块第0位对应的块号，块位图第i块管理[base + i * 每块位数, ...)这一段
+static inline int naive_bmap_base(const struct naive_super_block *nsb) {
+  return nsb->group_blocks ? nsb->bmap_block_no : 0;
+}
+
+// inode所在的inode表块
+static inline int naive_inode_block(const struct naive_super_block *nsb,
+                                    int ino) {
+  int per_block = NAIVE_INODES_PER_BLOCK(naive_block_size(nsb));
+  if (nsb->group_blocks == 0)
+    return nsb->inode_table_block_no + ino / per_block;
+  return nsb->inode_table_block_no +
+         ino / nsb->group_inodes * nsb->group_blocks +
+         ino % nsb->group_inodes / per_block;
+}
+
+// inode所在块组的第一块，它的数据块从这里找起；不分块组时返回-1，不在乎位置
+static inline int naive_inode_group_start(const struct naive_super_block *nsb,
+                                          int ino) {
+  if (nsb->group_blocks == 0)
+    return -1;
+  return nsb->bmap_block_no + ino / nsb->group_inodes * nsb->group_blocks;
+}
+
+// 带NAIVE_FEATURE_CSUM的镜像上，目录块里目录项能用的字节数
+static inline int naive_dir_block_size(const struct naive_super_block *nsb) {
+  return naive_block_size(nsb) -
+         (nsb->features & NAIVE_FEATURE_CSUM ? NAIVE_DIR_TAIL_SIZE : 0);
+}
+
+// 元数据校验和用CRC32C（Castagnoli多项式），和内核的crc32c()一样不做首尾取反，初值由调用者给
+// 内核里直接用libcrc32c；用户态在x86-64上CPU支持SSE4.2时用crc32指令一次算8字节，
+// ARM上编译时开了CRC扩展就用对应的指令，都没有才逐位算
+#ifdef __KERNEL__
+#define naive_crc32c(crc, data, len) crc32c(crc, data, len)
+#else
+static inline unsigned int naive_crc32c_sw(unsigned int crc, const void *data,
+                                           size_t len) {
+  const unsigned char *p = data;
+  int k;
+  while (len--) {
+    crc ^= *p++;
+    for (k = 0; k < 8; k++)
+      crc = crc >> 1 ^ (0x82f63b78 & -(crc & 1));
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) static inline unsigned int
+naive_crc32c_hw(unsigned int crc, const void *data, size_t len) {
+  const unsigned char *p = data;
+  unsigned long long c = crc, v;
+  for (; len >= 8; len -= 8, p += 8) {
+    memcpy(&v, p, 8);
+    c = _mm_crc32_u64(c, v);
+  }
+  crc = c;
+  for (; len > 0; len--)
+    crc = _mm_crc32_u8(crc, *p++);
+  return crc;
+}
+#elif defined(__ARM_FEATURE_CRC32)
+static inline unsigned int naive_crc32c_hw(unsigned int crc, const void *data,
+                                           size_t len) {
+  const unsigned char *p = data;
+  unsigned long long v;
+  for (; len >= 8; len -= 8, p += 8) {
+    memcpy(&v, p, 8);
+    crc = __crc32cd(crc, v);
+  }
+  for (; len > 0; len--)
+    crc = __crc32cb(crc, *p++);
+  return crc;
+}
+#endif
+
+static inline unsigned int naive_crc32c(unsigned int crc, const void *data,
+                                        size_t len) {
+#if defined(__x86_64__)
+  if (__builtin_cpu_supports("sse4.2"))
+    return naive_crc32c_hw(crc, data, len);
+#elif defined(__ARM_FEATURE_CRC32)
+  return naive_crc32c_hw(crc, data, len);
+#endif
+  return naive_crc32c_sw(crc, data, len);
+}
+#endif
+
+// 超级块的校验和
+static inline unsigned int
+naive_super_csum(const struct naive_super_block *nsb) {
+  return naive_crc32c(~0U, nsb, offsetof(struct naive_super_block, checksum));
+}
+
+// 位图块、目录块的校验和：块号和前bs-4字节一起算，放在块尾，块写错了位置也查得出来
+static inline unsigned int naive_block_csum(int block_no, const void *data,
+                                            int bs) {
+  unsigned int crc = naive_crc32c(~0U, &block_no, sizeof(int));
+  return naive_crc32c(crc, data, bs - NAIVE_CSUM_SIZE);
+}
+
+static inline unsigned int *naive_block_csum_at(void *data, int bs) {
+  return (unsigned int *)((char *)data + bs - NAIVE_CSUM_SIZE);
+}
+
+// inode的校验和：checksum字段当作0算整个inode，inode里有i_ino，不用另外掺inode号
+// 128字节的inode没有空地方了，只存低16位（和ext4的128字节inode一样）
+static inline unsigned short naive_inode_csum(const struct naive_inode *ninode) {
+  const size_t off = offsetof(struct naive_inode, checksum);
+  unsigned short zero = 0;
+  unsigned int crc = naive_crc32c(~0U, ninode, off);
+  crc = naive_crc32c(crc, &zero, sizeof(zero));
+  crc = naive_crc32c(crc, (const char *)ninode + off + sizeof(zero),
+                     NAIVE_INODE_SIZE - off - sizeof(zero));
+  return crc & 0xffff;
+}
+
+// 目录索引用的文件名散列（32位FNV-1a），内核和用户态工具要算得一样
+static inline unsigned int naive_name_hash(const char *name, int len) {
+  unsigned int hash = 2166136261u;
+  int i;
+  for (i = 0; i < len; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
 #endif